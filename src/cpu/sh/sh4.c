@@ -846,6 +846,9 @@ sh4_fetch (sh4_t *ctx, uint32_t addr, uint16_t *inst)
 {
 	int ret;
 
+	if (vk_fastmem_get16 (ctx->fastmem, addr, inst))
+		return 0;
+
 	ret = vk_cpu_get ((vk_cpu_t *) ctx, 2, addr & ADDR_MASK, (void *) inst);
 	if (ret)
 		VK_CPU_ABORT (ctx, "unhandled fetch @%08X", addr);
@@ -893,11 +896,14 @@ sh4_put (sh4_t *ctx, unsigned size, uint32_t addr, uint64_t val)
 	return ret;
 }
 
+/* Accesses try the fastmem window first, if any; see sh4_new (). */
+
 static inline uint8_t
 R8 (sh4_t *ctx, uint32_t addr)
 {
 	uint8_t tmp;
-	sh4_get (ctx, 1, addr, &tmp);
+	if (!vk_fastmem_get8 (ctx->fastmem, addr, &tmp))
+		sh4_get (ctx, 1, addr, &tmp);
 	return tmp;
 }
 
@@ -905,7 +911,8 @@ static inline uint16_t
 R16 (sh4_t *ctx, uint32_t addr)
 {
 	uint16_t tmp;
-	sh4_get (ctx, 2, addr, &tmp);
+	if (!vk_fastmem_get16 (ctx->fastmem, addr, &tmp))
+		sh4_get (ctx, 2, addr, &tmp);
 	return tmp;
 }
 
@@ -913,7 +920,8 @@ static inline uint32_t
 R32 (sh4_t *ctx, uint32_t addr)
 {
 	uint32_t tmp;
-	sh4_get (ctx, 4, addr, &tmp);
+	if (!vk_fastmem_get32 (ctx->fastmem, addr, &tmp))
+		sh4_get (ctx, 4, addr, &tmp);
 	return tmp;
 }
 
@@ -921,32 +929,37 @@ static inline uint64_t
 R64 (sh4_t *ctx, uint32_t addr)
 {
 	uint64_t tmp;
-	sh4_get (ctx, 8, addr, &tmp);
+	if (!vk_fastmem_get64 (ctx->fastmem, addr, &tmp))
+		sh4_get (ctx, 8, addr, &tmp);
 	return tmp;
 }
 
 static inline void
 W8 (sh4_t *ctx, uint32_t addr, uint8_t val)
 {
-	sh4_put (ctx, 1, addr, val);
+	if (!vk_fastmem_put8 (ctx->fastmem, addr, val))
+		sh4_put (ctx, 1, addr, val);
 }
 
 static inline void
 W16 (sh4_t *ctx, uint32_t addr, uint16_t val)
 {
-	sh4_put (ctx, 2, addr, val);
+	if (!vk_fastmem_put16 (ctx->fastmem, addr, val))
+		sh4_put (ctx, 2, addr, val);
 }
 
 static inline void
 W32 (sh4_t *ctx, uint32_t addr, uint32_t val)
 {
-	sh4_put (ctx, 4, addr, val);
+	if (!vk_fastmem_put32 (ctx->fastmem, addr, val))
+		sh4_put (ctx, 4, addr, val);
 }
 
 static inline void
 W64 (sh4_t *ctx, uint32_t addr, uint64_t val)
 {
-	sh4_put (ctx, 8, addr, val);
+	if (!vk_fastmem_put64 (ctx->fastmem, addr, val))
+		sh4_put (ctx, 8, addr, val);
 }
 
 /* Interrupt Controller */
@@ -1088,6 +1101,7 @@ typedef void (* itype) (sh4_t *ctx, uint16_t inst);
 		mask_, \
 		match_, \
 		sh4_interp_##name_, \
+		#name_, \
 	}
 
 #define IS_SH4
@@ -1099,6 +1113,21 @@ typedef void (* itype) (sh4_t *ctx, uint16_t inst);
 #undef IDEF
 #undef IS_SH4
 
+#ifdef VK_SH4_PROFILE
+static const char *insns_names[65536];
+#endif
+
+#ifdef VK_SH4_PROFILE
+#define SET_HANDLER \
+	do { \
+		insns[inst] = desc[i].handler; \
+		insns_names[inst] = desc[i].name; \
+	} while (0)
+#else
+#define SET_HANDLER \
+	insns[inst] = desc[i].handler
+#endif
+
 #define CHECK_COLLISION \
 	do { \
 		if (insns[inst] != sh4_interp_invalid) { \
@@ -1120,21 +1149,21 @@ setup_insns_handlers_from_table (const idesctype *desc,
 			for (j = 0; j < 4096; j++) {
 				inst = desc[i].match | j;
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xF00F:
 			for (j = 0; j < 256; j++) {
 				inst = desc[i].match | (j << 4);
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xFF00:
 			for (j = 0; j < 256; j++) {
 				inst = desc[i].match | j;
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xF08F:
@@ -1143,34 +1172,34 @@ setup_insns_handlers_from_table (const idesctype *desc,
 				       ((j & 7) << 4) |
 				       ((j >> 3) << 8);
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xF0FF:
 			for (j = 0; j < 16; j++) {
 				inst = desc[i].match | (j << 8);
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xF1FF:
 			for (j = 0; j < 8; j++) {
 				inst = desc[i].match | (j << 9);
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xF3FF:
 			for (j = 0; j < 4; j++) {
 				inst = desc[i].match | (j << 10);
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xFFFF:
 			inst = desc[i].match;
 			CHECK_COLLISION;
-			insns[inst] = desc[i].handler;
+			SET_HANDLER;
 			break;
 		default:
 			VK_ABORT ("unhandled mask %04X", desc[i].mask);
@@ -1179,6 +1208,7 @@ setup_insns_handlers_from_table (const idesctype *desc,
 }
 
 #undef CHECK_COLLISION
+#undef SET_HANDLER
 
 static void
 setup_insns_handlers (void)
@@ -1192,6 +1222,136 @@ setup_insns_handlers (void)
 	setup_insns_handlers_from_table (insns_desc_sh4, NUMELEM (insns_desc_sh4));
 }
 
+/* Profiling */
+
+#ifdef VK_SH4_PROFILE
+
+#define PROF_TOP	40
+
+static inline void
+profile_step (sh4_t *ctx, uint32_t pc, uint16_t inst)
+{
+	uint32_t page, bucket;
+
+	ctx->prof.insns[inst]++;
+
+	pc &= 0x1FFFFFFF;
+	page = pc >> SH4_PROF_PAGE_SHIFT;
+	bucket = (pc & ((1 << SH4_PROF_PAGE_SHIFT) - 1)) >> SH4_PROF_BUCKET_SHIFT;
+	if (!ctx->prof.pcs[page]) {
+		ctx->prof.pcs[page] = (uint64_t *)
+			calloc (SH4_PROF_PAGE_BUCKETS, sizeof (uint64_t));
+		VK_ASSERT (ctx->prof.pcs[page]);
+	}
+	ctx->prof.pcs[page][bucket]++;
+}
+
+typedef struct {
+	uint64_t count;
+	uint32_t key;
+} prof_entry_t;
+
+static int
+compare_prof_entries (const void *a, const void *b)
+{
+	const prof_entry_t *x = (const prof_entry_t *) a;
+	const prof_entry_t *y = (const prof_entry_t *) b;
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+static void
+profile_dump_insns (sh4_t *ctx, uint64_t total)
+{
+	prof_entry_t *entries;
+	unsigned i, j, num = 0;
+
+	/* Aggregate the opcode counters by handler; the key is the index
+	 * of the first opcode seen for the handler. */
+	entries = (prof_entry_t *) calloc (65536, sizeof (prof_entry_t));
+	VK_ASSERT (entries);
+
+	for (i = 0; i < 65536; i++) {
+		if (!ctx->prof.insns[i])
+			continue;
+		for (j = 0; j < num; j++)
+			if (insns[entries[j].key] == insns[i])
+				break;
+		if (j == num)
+			entries[num++].key = i;
+		entries[j].count += ctx->prof.insns[i];
+	}
+
+	qsort (entries, num, sizeof (prof_entry_t), compare_prof_entries);
+
+	printf ("   count         %%      handler\n");
+	for (i = 0; i < num && i < PROF_TOP; i++)
+		printf ("   %-13lu %6.2f  %s\n", entries[i].count,
+		        entries[i].count * 100.0 / total,
+		        insns_names[entries[i].key]);
+
+	free (entries);
+}
+
+static void
+profile_dump_pcs (sh4_t *ctx, uint64_t total)
+{
+	prof_entry_t *entries = NULL;
+	unsigned page, bucket, num = 0, size = 0;
+
+	for (page = 0; page < SH4_PROF_NUM_PAGES; page++) {
+		if (!ctx->prof.pcs[page])
+			continue;
+		for (bucket = 0; bucket < SH4_PROF_PAGE_BUCKETS; bucket++) {
+			uint64_t count = ctx->prof.pcs[page][bucket];
+			if (!count)
+				continue;
+			if (num == size) {
+				size = size ? size * 2 : 4096;
+				entries = (prof_entry_t *)
+					realloc (entries, size * sizeof (prof_entry_t));
+				VK_ASSERT (entries);
+			}
+			entries[num].count = count;
+			entries[num].key = (page << SH4_PROF_PAGE_SHIFT) |
+			                   (bucket << SH4_PROF_BUCKET_SHIFT);
+			num++;
+		}
+	}
+
+	qsort (entries, num, sizeof (prof_entry_t), compare_prof_entries);
+
+	printf ("   count         %%      PC\n");
+	for (bucket = 0; bucket < num && bucket < PROF_TOP; bucket++)
+		printf ("   %-13lu %6.2f  @%08X-%08X\n", entries[bucket].count,
+		        entries[bucket].count * 100.0 / total,
+		        entries[bucket].key,
+		        entries[bucket].key + (1 << SH4_PROF_BUCKET_SHIFT) - 1);
+
+	free (entries);
+}
+
+static void
+profile_dump (sh4_t *ctx)
+{
+	uint64_t total = 0;
+	unsigned i;
+
+	for (i = 0; i < 65536; i++)
+		total += ctx->prof.insns[i];
+
+	printf ("SH-4 %s profile: %lu instructions\n",
+	        ctx->config.master ? "master" : "slave", total);
+	if (!total)
+		return;
+
+	profile_dump_insns (ctx, total);
+	profile_dump_pcs (ctx, total);
+}
+
+#undef PROF_TOP
+
+#endif /* VK_SH4_PROFILE */
+
 /* Execution */
 
 static void
@@ -1203,6 +1363,10 @@ sh4_step (sh4_t *ctx, uint32_t pc)
 
 	inst = vk_cpu_patch ((vk_cpu_t *) ctx, pc & 0x1FFFFFFF, inst);
 
+#ifdef VK_SH4_PROFILE
+	profile_step (ctx, pc, inst);
+#endif
+
 	insns[inst] (ctx, inst);
 
 	ctx->base.remaining --;
@@ -1227,6 +1391,7 @@ sh4_run (vk_cpu_t *cpu, int cycles)
 		sh4_step (ctx, PC);
 		PC += 2;
 	}
+	cpu->executed += cycles - cpu->remaining;
 	/* XXX BSC, SCI */
 	sh4_tmu_run (ctx, cycles);
 	//sh4_dmac_run (ctx, cycles);
@@ -1432,6 +1597,23 @@ sh4_set_porta_handlers (vk_cpu_t *cpu,
 	ctx->porta.put = put;
 }
 
+static void
+sh4_destroy (vk_device_t **dev_)
+{
+#ifdef VK_SH4_PROFILE
+	sh4_t *ctx = (sh4_t *) *dev_;
+	unsigned i;
+
+	/* sh4_new () may have failed before allocating the counters. */
+	if (ctx->prof.insns)
+		profile_dump (ctx);
+
+	free (ctx->prof.insns);
+	for (i = 0; i < SH4_PROF_NUM_PAGES; i++)
+		free (ctx->prof.pcs[i]);
+#endif
+}
+
 vk_cpu_t *
 sh4_new (vk_machine_t *mach, vk_mmap_t *mmap, bool master, bool le)
 {
@@ -1446,7 +1628,7 @@ sh4_new (vk_machine_t *mach, vk_mmap_t *mmap, bool master, bool le)
 		goto fail;
 
 	dev->reset		= sh4_reset;
-	dev->destroy		= NULL;
+	dev->destroy		= sh4_destroy;
 	dev->load_state		= sh4_load_state;
 	dev->save_state		= sh4_save_state;
 
@@ -1458,12 +1640,22 @@ sh4_new (vk_machine_t *mach, vk_mmap_t *mmap, bool master, bool le)
 	ctx->config.master = master;
 	ctx->config.little_endian = le;
 
+	/* Only the P0-P3 areas, which mirror the external address space,
+	 * are accessed through fastmem; see vk_mmap_enable_fastmem (). */
+	ctx->fastmem = mmap->fastmem;
+
 	ctx->iregs = vk_buffer_le32_new (0x10000, 0);
 	if (!ctx->iregs)
 		goto fail;
 
 	vk_machine_register_buffer (mach, ctx->iregs);
 
+#ifdef VK_SH4_PROFILE
+	ctx->prof.insns = (uint64_t *) calloc (65536, sizeof (uint64_t));
+	if (!ctx->prof.insns)
+		goto fail;
+#endif
+
 	setup_insns_handlers ();
 
 	return (vk_cpu_t *) ctx;
@@ -124,6 +124,15 @@ typedef struct {
 	uint32_t code;
 } sh4_irq_state_t;
 
+#ifdef VK_SH4_PROFILE
+/* PCs are profiled in 16-byte buckets, the counters for each 1 MB page of
+ * the physical address space being allocated on first use. */
+#define SH4_PROF_PAGE_SHIFT	20
+#define SH4_PROF_BUCKET_SHIFT	4
+#define SH4_PROF_NUM_PAGES	(0x20000000 >> SH4_PROF_PAGE_SHIFT)
+#define SH4_PROF_PAGE_BUCKETS	(1 << (SH4_PROF_PAGE_SHIFT - SH4_PROF_BUCKET_SHIFT))
+#endif
+
 typedef struct sh4_t sh4_t;
 
 struct sh4_t {
@@ -154,6 +163,9 @@ struct sh4_t {
 		sh4_fpscr_t	fpscr;
 	} regs;
 
+	/* The fastmem window of the mmap, if any */
+	vk_fastmem_t	*fastmem;
+
 	/* On-Chip Modules */
 	vk_buffer_t	*iregs;
 
@@ -185,6 +197,13 @@ struct sh4_t {
 		bool	master;
 		bool	little_endian;
 	} config;
+
+#ifdef VK_SH4_PROFILE
+	struct {
+		uint64_t	*insns;
+		uint64_t	*pcs[SH4_PROF_NUM_PAGES];
+	} prof;
+#endif
 };
 
 vk_cpu_t	*sh4_new (vk_machine_t *mach, vk_mmap_t *mmap, bool master, bool le);
@@ -16,6 +16,8 @@
  * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "vk/input.h"
+
 #include "mach/hikaru/hikaru-gpu.h"
 #include "mach/hikaru/hikaru-gpu-private.h"
 
@@ -58,8 +60,132 @@
  * the completely rasterized frame buffer to the GPU 1A; 1A000024 is cleared
  * when the GPU 1A is done compositing the frame buffer with the 2D layers and
  * has displayed them on-screen.)
+ *
+ *
+ * CP Statistics
+ * =============
+ *
+ * Each CP run (i.e., each frame) counts the instructions it executes, by
+ * opcode, and the meshes, vertices, jumps and calls they amount to. The
+ * per-frame counters are logged at the end of each run if GPU_LOG_CP_STATS
+ * is set, and accumulated into totals printed by hikaru_gpu_print_stats.
+ *
+ *
+ * CP Frame Dumps
+ * ==============
+ *
+ * Pressing F9, or setting GPU_DUMP_CP_FRAME=n, dumps the next (resp. the
+ * n-th) CP run to 'cp-frame-<n>.bin', for offline analysis and replay. The
+ * file is a sequence of chunks, each made of a four-character tag, a 32-bit
+ * size and the data; all values are in host byte order:
+ *
+ *  "VKCP"	version (32-bit) and frame number (32-bit)
+ *  "REGS"	the GPU registers at CP begin
+ *  "CP  "	the CP registers at CP begin
+ *  "STAT"	the CP state (tables and scratch objects) at CP begin
+ *  "CMDR"	CMDRAM
+ *  "RAMS"	slave RAM
+ *  "TEX0"	TEXRAM bank 0
+ *  "TEX1"	TEXRAM bank 1
+ *  "INSN"	one per executed instruction: the PC followed by the
+ *		instruction words
+ *  "END "	empty
+ *
+ * The structure chunks are raw copies of hikaru_gpu_t fields and are only
+ * meaningful to the same build.
  */
 
+#define CP_DUMP_VERSION	1
+
+static void
+put_dump_chunk (hikaru_gpu_t *gpu, const char *tag,
+                const void *data, uint32_t size)
+{
+	FILE *fp = gpu->cp_dump.fp;
+
+	fwrite (tag, 1, 4, fp);
+	fwrite (&size, sizeof (size), 1, fp);
+	if (size)
+		fwrite (data, 1, size, fp);
+}
+
+static void
+begin_dump (hikaru_gpu_t *gpu)
+{
+	hikaru_t *hikaru = (hikaru_t *) gpu->base.mach;
+	uint32_t header[2];
+	char path[64];
+
+	sprintf (path, "cp-frame-%lu.bin", gpu->stats.cp_frames);
+
+	gpu->cp_dump.fp = fopen (path, "wb");
+	if (!gpu->cp_dump.fp) {
+		VK_ERROR ("CP: can't open '%s' for writing", path);
+		return;
+	}
+
+	header[0] = CP_DUMP_VERSION;
+	header[1] = (uint32_t) gpu->stats.cp_frames;
+
+	put_dump_chunk (gpu, "VKCP", header, sizeof (header));
+	put_dump_chunk (gpu, "REGS", &gpu->regs, sizeof (gpu->regs));
+	put_dump_chunk (gpu, "CP  ", &gpu->cp, sizeof (gpu->cp));
+	put_dump_chunk (gpu, "STAT", &gpu->state, sizeof (gpu->state));
+	put_dump_chunk (gpu, "CMDR", gpu->cmdram->ptr, gpu->cmdram->size);
+	put_dump_chunk (gpu, "RAMS", hikaru->ram_s->ptr, hikaru->ram_s->size);
+	put_dump_chunk (gpu, "TEX0", gpu->texram[0]->ptr, gpu->texram[0]->size);
+	put_dump_chunk (gpu, "TEX1", gpu->texram[1]->ptr, gpu->texram[1]->size);
+
+	VK_LOG ("CP: dumping frame %lu to '%s'", gpu->stats.cp_frames, path);
+}
+
+static void
+dump_insn (hikaru_gpu_t *gpu, uint32_t *inst, uint32_t size)
+{
+	FILE *fp = gpu->cp_dump.fp;
+	uint32_t chunk_size = 4 + size;
+
+	fwrite ("INSN", 1, 4, fp);
+	fwrite (&chunk_size, sizeof (chunk_size), 1, fp);
+	fwrite (&PC, sizeof (PC), 1, fp);
+	fwrite (inst, 1, size, fp);
+}
+
+void
+hikaru_gpu_cp_end_dump (hikaru_gpu_t *gpu)
+{
+	if (!gpu->cp_dump.fp)
+		return;
+
+	put_dump_chunk (gpu, "END ", NULL, 0);
+	fclose (gpu->cp_dump.fp);
+	gpu->cp_dump.fp = NULL;
+}
+
+static bool
+is_dump_requested (hikaru_gpu_t *gpu)
+{
+	bool key = vk_input_get_key (SDLK_F9);
+	bool pressed = key && !gpu->cp_dump.key_down;
+
+	gpu->cp_dump.key_down = key;
+
+	return pressed || (gpu->cp_dump.frame >= 0 &&
+	                   gpu->stats.cp_frames == (uint64_t) gpu->cp_dump.frame);
+}
+
+static void
+log_frame_stats (hikaru_gpu_t *gpu)
+{
+	hikaru_gpu_cp_counters_t *frame = &gpu->stats.frame;
+
+	VK_LOG ("CP frame %lu: %lu insns, %lu meshes (%lu static), "
+	        "%lu vertices, %lu jumps, %lu calls",
+	        gpu->stats.cp_frames, frame->insns,
+	        frame->meshes, frame->static_meshes,
+	        frame->vertices, frame->jumps, frame->calls);
+}
+
 static void
 on_frame_begin (hikaru_gpu_t *gpu)
 {
@@ -102,6 +228,11 @@ on_cp_begin (hikaru_gpu_t *gpu)
 	PC = REG15 (0x70);
 	SP(0) = REG15 (0x74);
 	SP(1) = REG15 (0x78);
+
+	memset (&gpu->stats.frame, 0, sizeof (gpu->stats.frame));
+
+	if (is_dump_requested (gpu))
+		begin_dump (gpu);
 }
 
 static void
@@ -114,6 +245,19 @@ on_cp_end (hikaru_gpu_t *gpu)
 	REG15 (0x58) &= ~3;
 	REG1A (0x24) &= ~1;
 
+	if (gpu->debug.log_cp_stats)
+		log_frame_stats (gpu);
+
+	gpu->stats.total.insns		+= gpu->stats.frame.insns;
+	gpu->stats.total.meshes		+= gpu->stats.frame.meshes;
+	gpu->stats.total.static_meshes	+= gpu->stats.frame.static_meshes;
+	gpu->stats.total.vertices	+= gpu->stats.frame.vertices;
+	gpu->stats.total.jumps		+= gpu->stats.frame.jumps;
+	gpu->stats.total.calls		+= gpu->stats.frame.calls;
+	gpu->stats.cp_frames++;
+
+	hikaru_gpu_cp_end_dump (gpu);
+
 	/* Notify that the GPUs are done and need feeding */
 	hikaru_gpu_raise_irq (gpu, GPU15_IRQ_CMD_ANALYSIS_END, GPU1A_IRQ_PLOT_END);
 }
@@ -186,6 +330,7 @@ hikaru_gpu_cp_on_put (hikaru_gpu_t *gpu)
 #define FLAG_PUSH	(FLAG_BEGIN | FLAG_CONTINUE)
 #define FLAG_STATIC	(1 << 3)
 #define FLAG_INVALID	(1 << 4)
+#define FLAG_VERTEX	(1 << 5)
 
 static struct {
 	void (* handler)(hikaru_gpu_t *, uint32_t *);
@@ -251,8 +396,9 @@ static void
 push_pc (hikaru_gpu_t *gpu)
 {
 	VK_ASSERT ((SP(0) >> 24) == 0x48);
-	vk_buffer_put (gpu->cmdram, 4, SP(0) & 0x3FFFFFF, PC);
+	vk_buffer_put32_fast (gpu->cmdram, SP(0) & 0x3FFFFFF, PC);
 	SP(0) -= 4;
+	gpu->stats.frame.calls++;
 }
 
 static void
@@ -260,7 +406,7 @@ pop_pc (hikaru_gpu_t *gpu)
 {
 	SP(0) += 4;
 	VK_ASSERT ((SP(0) >> 24) == 0x48);
-	PC = vk_buffer_get (gpu->cmdram, 4, SP(0) & 0x3FFFFFF) + 8;
+	PC = vk_buffer_get32_fast (gpu->cmdram, SP(0) & 0x3FFFFFF) + 8;
 }
 
 static int
@@ -314,6 +460,8 @@ hikaru_gpu_cp_exec (hikaru_gpu_t *gpu, int cycles)
 			bool is_static = (flags & FLAG_STATIC) != 0;
 			hikaru_renderer_begin_mesh (HR, PC, is_static);
 			gpu->state.in_mesh = 1;
+			gpu->stats.frame.meshes++;
+			gpu->stats.frame.static_meshes += is_static;
 		} else if (gpu->state.in_mesh && !(flags & FLAG_CONTINUE)) {
 			hikaru_renderer_end_mesh (HR, PC);
 			gpu->state.in_mesh = 0;
@@ -326,11 +474,19 @@ hikaru_gpu_cp_exec (hikaru_gpu_t *gpu, int cycles)
 				VK_ERROR ("CP @%08X : unhandled instruction", PC);
 		}
 
+		if (gpu->cp_dump.fp)
+			dump_insn (gpu, inst, get_insn_size (inst));
+
 		insns[op].handler (gpu, inst);
 
 		if (!(flags & FLAG_JUMP))
 			PC += get_insn_size (inst);
 
+		gpu->stats.cp_executed++;
+		gpu->stats.ops[op]++;
+		gpu->stats.frame.insns++;
+		gpu->stats.frame.vertices += (flags & FLAG_VERTEX) != 0;
+		gpu->stats.frame.jumps += (flags & FLAG_JUMP) != 0;
 		cycles--;
 	}
 
@@ -2685,10 +2841,10 @@ static const struct {
 	K(0x103, 0x103, 0),
 	K(0x104, 0x104, 0),
 	K(0x113, 0x103, 0),
-	K(0x12C, 0x12C, FLAG_PUSH | FLAG_STATIC),
-	K(0x12D, 0x12C, FLAG_PUSH | FLAG_STATIC),
-	K(0x12E, 0x12C, FLAG_PUSH | FLAG_STATIC),
-	K(0x12F, 0x12C, FLAG_PUSH | FLAG_STATIC),
+	K(0x12C, 0x12C, FLAG_PUSH | FLAG_STATIC | FLAG_VERTEX),
+	K(0x12D, 0x12C, FLAG_PUSH | FLAG_STATIC | FLAG_VERTEX),
+	K(0x12E, 0x12C, FLAG_PUSH | FLAG_STATIC | FLAG_VERTEX),
+	K(0x12F, 0x12C, FLAG_PUSH | FLAG_STATIC | FLAG_VERTEX),
 	/* 0x140 */
 	K(0x154, 0x154, 0),
 	K(0x158, 0x158, FLAG_PUSH),
@@ -2701,18 +2857,18 @@ static const struct {
 	K(0x191, 0x191, 0),
 	K(0x194, 0x194, 0),
 	K(0x1A1, 0x1A1, 0),
-	K(0x1AC, 0x1AC, FLAG_PUSH),
-	K(0x1AD, 0x1AC, FLAG_PUSH),
-	K(0x1AE, 0x1AC, FLAG_PUSH),
-	K(0x1AF, 0x1AC, FLAG_PUSH),
-	K(0x1B8, 0x1B8, FLAG_PUSH),
-	K(0x1B9, 0x1B8, FLAG_PUSH),
-	K(0x1BA, 0x1B8, FLAG_PUSH),
-	K(0x1BB, 0x1B8, FLAG_PUSH),
-	K(0x1BC, 0x1B8, FLAG_PUSH),
-	K(0x1BD, 0x1B8, FLAG_PUSH),
-	K(0x1BE, 0x1B8, FLAG_PUSH),
-	K(0x1BF, 0x1B8, FLAG_PUSH),
+	K(0x1AC, 0x1AC, FLAG_PUSH | FLAG_VERTEX),
+	K(0x1AD, 0x1AC, FLAG_PUSH | FLAG_VERTEX),
+	K(0x1AE, 0x1AC, FLAG_PUSH | FLAG_VERTEX),
+	K(0x1AF, 0x1AC, FLAG_PUSH | FLAG_VERTEX),
+	K(0x1B8, 0x1B8, FLAG_PUSH | FLAG_VERTEX),
+	K(0x1B9, 0x1B8, FLAG_PUSH | FLAG_VERTEX),
+	K(0x1BA, 0x1B8, FLAG_PUSH | FLAG_VERTEX),
+	K(0x1BB, 0x1B8, FLAG_PUSH | FLAG_VERTEX),
+	K(0x1BC, 0x1B8, FLAG_PUSH | FLAG_VERTEX),
+	K(0x1BD, 0x1B8, FLAG_PUSH | FLAG_VERTEX),
+	K(0x1BE, 0x1B8, FLAG_PUSH | FLAG_VERTEX),
+	K(0x1BF, 0x1B8, FLAG_PUSH | FLAG_VERTEX),
 	/* 0x1C0 */
 	K(0x1C2, 0x1C2, FLAG_JUMP)
 };
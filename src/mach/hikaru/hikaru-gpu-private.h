@@ -277,6 +277,16 @@ typedef struct {
 	uint32_t enabled	: 1;
 } hikaru_layer_t;
 
+/* CP execution counters, see hikaru-gpu-cp.c. */
+typedef struct {
+	uint64_t insns;
+	uint64_t meshes;
+	uint64_t static_meshes;
+	uint64_t vertices;
+	uint64_t jumps;
+	uint64_t calls;
+} hikaru_gpu_cp_counters_t;
+
 typedef struct {
 	vk_device_t base;
 
@@ -405,8 +415,23 @@ typedef struct {
 		uint32_t log_dma	: 1;
 		uint32_t log_idma	: 1;
 		uint32_t log_cp		: 1;
+		uint32_t log_cp_stats	: 1;
 	} debug;
 
+	struct {
+		uint64_t cp_executed;
+		uint64_t cp_frames;
+		uint64_t ops[0x200];
+		hikaru_gpu_cp_counters_t frame;
+		hikaru_gpu_cp_counters_t total;
+	} stats;
+
+	struct {
+		FILE *fp;
+		int frame;
+		bool key_down;
+	} cp_dump;
+
 } hikaru_gpu_t;
 
 #define REG15(addr_)	(*(uint32_t *) &gpu->regs._15[(addr_) & 0xFF])
@@ -498,6 +523,9 @@ const char *get_layer_str (hikaru_layer_t *);
 
 /* hikaru-gpu.c */
 void hikaru_gpu_raise_irq (hikaru_gpu_t *gpu, uint32_t _15, uint32_t _1A);
+void hikaru_gpu_copy_level (vk_buffer_t *srcbuf, vk_buffer_t *texram,
+                            uint32_t bus_addr, unsigned x0, unsigned y0,
+                            unsigned w, unsigned h);
 
 /* hikaru-gpu-cp.c */
 void hikaru_gpu_cp_init (hikaru_gpu_t *);
@@ -505,6 +533,7 @@ void hikaru_gpu_cp_exec (hikaru_gpu_t *, int cycles);
 void hikaru_gpu_cp_vblank_in (hikaru_gpu_t *);
 void hikaru_gpu_cp_vblank_out (hikaru_gpu_t *);
 void hikaru_gpu_cp_on_put (hikaru_gpu_t *);
+void hikaru_gpu_cp_end_dump (hikaru_gpu_t *);
 
 /* hikaru-renderer.c */
 void hikaru_renderer_begin_mesh (vk_renderer_t *rend, uint32_t addr,
@@ -517,5 +546,9 @@ void hikaru_renderer_push_vertices (vk_renderer_t *rend,
 
 void		 hikaru_renderer_invalidate_texcache (vk_renderer_t *rend,
 		                                      hikaru_texhead_t *th);
+void		*hikaru_renderer_decode_texture_abgr1111 (vk_buffer_t *texram,
+		                                          uint32_t w, uint32_t h,
+		                                          uint32_t basex,
+		                                          uint32_t basey);
 
 #endif /* __HIKARU_GPU_PRIVATE_H__ */
@@ -16,6 +16,7 @@
  * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "vk/profiler.h"
 #include "mach/hikaru/hikaru-gpu.h"
 #include "mach/hikaru/hikaru-gpu-private.h"
 #include "mach/hikaru/hikaru-renderer.h"
@@ -728,9 +729,10 @@ hikaru_gpu_fill_layer_info (hikaru_gpu_t *gpu)
  * PH:@0C01290A.
  */
 
-static void
-copy_level (vk_buffer_t *srcbuf, vk_buffer_t *texram, uint32_t bus_addr,
-            unsigned x0, unsigned y0, unsigned w, unsigned h)
+void
+hikaru_gpu_copy_level (vk_buffer_t *srcbuf, vk_buffer_t *texram,
+                       uint32_t bus_addr, unsigned x0, unsigned y0,
+                       unsigned w, unsigned h)
 {
 	uint32_t offs;
 	unsigned x, y;
@@ -739,8 +741,8 @@ copy_level (vk_buffer_t *srcbuf, vk_buffer_t *texram, uint32_t bus_addr,
 	for (y = 0; y < h; y++) {
 		for (x = 0; x < w; x++, offs += 2) {
 			uint32_t temp = (y0 + y) * 4096 + (x0 + x) * 2;
-			uint32_t texel = vk_buffer_get (srcbuf, 2, offs);
-			vk_buffer_put (texram, 2, temp ^ 2, texel);
+			uint16_t texel = vk_buffer_get16_fast (srcbuf, offs);
+			vk_buffer_put16_fast (texram, temp ^ 2, texel);
 		}
 	}
 }
@@ -778,8 +780,8 @@ copy_texture (hikaru_gpu_t *gpu, uint32_t bus_addr, unsigned size,
 			break;
 		}
 
-		copy_level (srcbuf, gpu->texram[bank], bus_offs,
-		            dstx, dsty, level_w, level_h);
+		hikaru_gpu_copy_level (srcbuf, gpu->texram[bank], bus_offs,
+		                       dstx, dsty, level_w, level_h);
 
 		/* Update the number of transferred bytes. */
 		size_copied += level_w * level_h * 2;
@@ -884,10 +886,10 @@ hikaru_gpu_step_idma (hikaru_gpu_t *gpu)
 	/* Read the IDMA table address in CMDRAM */
 	addr = (REG15 (0x0C) & 0xFFFFFF);
 
-	entry[0] = vk_buffer_get (gpu->cmdram, 4, addr+0x0);
-	entry[1] = vk_buffer_get (gpu->cmdram, 4, addr+0x4);
-	entry[2] = vk_buffer_get (gpu->cmdram, 4, addr+0x8);
-	entry[3] = vk_buffer_get (gpu->cmdram, 4, addr+0xC);
+	entry[0] = vk_buffer_get32_fast (gpu->cmdram, addr+0x0);
+	entry[1] = vk_buffer_get32_fast (gpu->cmdram, addr+0x4);
+	entry[2] = vk_buffer_get32_fast (gpu->cmdram, addr+0x8);
+	entry[3] = vk_buffer_get32_fast (gpu->cmdram, addr+0xC);
 
 	/* If the entry supplies a positive size, process it */
 	if (entry[1]) {
@@ -940,26 +942,58 @@ hikaru_gpu_step_idma (hikaru_gpu_t *gpu)
  *
  * NOTE: 1A000024 bit 0 seems to signal when the device is busy.
  *
+ * The DMA runs along with the GPU, a few rows each time it executes; the
+ * rows left to copy are kept in the ports themselves, like the IDMA does.
+ * Control bit E stays set until the copy is done.
  */
 
-/* XXX convert to begin/step/end; according to PHARRIER, the DMA operation
- * should take more or less C cycles for each texel, where C is a small
- * constant. */
+/* According to PHARRIER, the DMA operation should take more or less C
+ * cycles for each texel, where C is a small constant. XXX 2 is a guess. */
+#define DMA_CYCLES_PER_TEXEL	2
 
 static void
-hikaru_gpu_begin_dma (hikaru_gpu_t *gpu)
+get_dma_params (hikaru_gpu_t *gpu, uint32_t *src_x, uint32_t *src_y,
+                uint32_t *dst_x, uint32_t *dst_y, uint32_t *w, uint32_t *h)
 {
 	uint32_t *regs = &REG1ADMA (0);
-	uint32_t src_x, src_y, dst_x, dst_y, w, h, i, j;
 
-	src_x = regs[0] & 0x7FF;
-	src_y = regs[0] >> 11;
+	*src_x = regs[0] & 0x7FF;
+	*src_y = (regs[0] >> 11) & 0x7FF;
+
+	*dst_x = regs[1] & 0x7FF;
+	*dst_y = (regs[1] >> 11) & 0x7FF;
+
+	*w = regs[2] & 0xFFFF;
+	*h = regs[2] >> 16;
+}
+
+static void
+set_dma_params (hikaru_gpu_t *gpu, uint32_t src_x, uint32_t src_y,
+                uint32_t dst_x, uint32_t dst_y, uint32_t w, uint32_t h)
+{
+	uint32_t *regs = &REG1ADMA (0);
 
-	dst_x = regs[1] & 0x7FF;
-	dst_y = regs[1] >> 11;
+	regs[0] = (src_y << 11) | src_x;
+	regs[1] = (dst_y << 11) | dst_x;
+	regs[2] = (h << 16) | w;
+}
 
-	w = regs[2] & 0xFFFF;
-	h = regs[2] >> 16;
+static void
+hikaru_gpu_end_dma (hikaru_gpu_t *gpu)
+{
+	REG1ADMA (0xC) &= ~1;
+
+	if (gpu->debug.log_dma)
+		VK_LOG ("GPU DMA: done");
+}
+
+static void
+hikaru_gpu_begin_dma (hikaru_gpu_t *gpu)
+{
+	uint32_t *regs = &REG1ADMA (0);
+	uint32_t src_x, src_y, dst_x, dst_y, w, h;
+
+	get_dma_params (gpu, &src_x, &src_y, &dst_x, &dst_y, &w, &h);
 
 	if (gpu->debug.log_dma) {
 		VK_LOG ("GPU DMA: [%08X %08X %08X %08X] { %u %u } --> { %u %u }, %ux%u",
@@ -967,17 +1001,60 @@ hikaru_gpu_begin_dma (hikaru_gpu_t *gpu)
 			src_x, src_y, dst_x, dst_y, w, h);
 	}
 
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			uint32_t src_offs = (src_y + i) * 4096 + (src_x + j) * 2;
-			uint32_t dst_offs = (dst_y + i) * 4096 + (dst_x + j) * 2;
-			uint16_t pixel;
-			pixel = vk_buffer_get (gpu->fb, 2, src_offs);
-			vk_buffer_put (gpu->fb, 2, dst_offs, pixel);
-		}
-	}
+	/* Clip both rectangles to the 2048x2048 FB sheet. */
+	w = MIN2 (w, 2048 - MAX2 (src_x, dst_x));
+	h = MIN2 (h, 2048 - MAX2 (src_y, dst_y));
+	set_dma_params (gpu, src_x, src_y, dst_x, dst_y, w, h);
 
 	REG1A (0x24) |= 1;
+
+	if (!w || !h)
+		hikaru_gpu_end_dma (gpu);
+}
+
+/* Copies whole rows, as many as the cycles allow, but at least one. */
+static void
+hikaru_gpu_step_dma (hikaru_gpu_t *gpu, int cycles)
+{
+	vk_buffer_t *fb = gpu->fb;
+	uint32_t src_x, src_y, dst_x, dst_y, w, h, rows, i;
+	bool backwards;
+
+	if (!(REG1ADMA (0xC) & 1))
+		return;
+
+	get_dma_params (gpu, &src_x, &src_y, &dst_x, &dst_y, &w, &h);
+	if (!w || !h) {
+		hikaru_gpu_end_dma (gpu);
+		return;
+	}
+
+	rows = MAX2 (cycles, 0) / (w * DMA_CYCLES_PER_TEXEL);
+	rows = MIN2 (MAX2 (rows, 1), h);
+
+	/* If the destination is below the source, copy from the bottom row
+	 * up, so that overlapping rows are read before being overwritten;
+	 * memmove () takes care of overlaps within a row. */
+	backwards = dst_y > src_y;
+
+	for (i = 0; i < rows; i++) {
+		uint32_t y = backwards ? (h - 1 - i) : i;
+		uint32_t src_offs = (src_y + y) * 4096 + src_x * 2;
+		uint32_t dst_offs = (dst_y + y) * 4096 + dst_x * 2;
+
+		memmove (&fb->ptr[dst_offs], &fb->ptr[src_offs], w * 2);
+		vk_buffer_mark_dirty (fb, dst_offs, w * 2);
+	}
+
+	if (!backwards) {
+		src_y += rows;
+		dst_y += rows;
+	}
+	h -= rows;
+	set_dma_params (gpu, src_x, src_y, dst_x, dst_y, w, h);
+
+	if (!h)
+		hikaru_gpu_end_dma (gpu);
 }
 
 /****************************************************************************
@@ -1014,20 +1091,28 @@ hikaru_gpu_vblank_out (vk_device_t *dev)
 	hikaru_gpu_cp_vblank_out (gpu);
 }
 
+static vk_profiler_section_t prof_idma = VK_PROFILER_SECTION ("idma");
+static vk_profiler_section_t prof_cp = VK_PROFILER_SECTION ("gpu_cp");
+
 static int
 hikaru_gpu_exec (vk_device_t *dev, int cycles)
 {
 	hikaru_gpu_t *gpu = (hikaru_gpu_t *) dev;
 
 	/* Exec the DMA */
-	/* XXX */
+	hikaru_gpu_step_dma (gpu, cycles);
 
 	/* Exec the IDMA */
+	vk_profiler_enter (&prof_idma);
 	hikaru_gpu_step_idma (gpu);
+	vk_profiler_leave (&prof_idma);
 
 	/* Exec the CP */
-	if (REG15 (0x58) == 3)
+	if (REG15 (0x58) == 3) {
+		vk_profiler_enter (&prof_cp);
 		hikaru_gpu_cp_exec (gpu, cycles);
+		vk_profiler_leave (&prof_cp);
+	}
 
 	return 0;
 }
@@ -1205,6 +1290,36 @@ hikaru_gpu_is_texram_twiddled (vk_device_t *dev)
 	return REG15 (0x8C) == 0x02020202;
 }
 
+/* Prints the CP counters, accumulated since the GPU was created, as
+ * 'key=value' lines; opcodes which never executed are omitted. */
+void
+hikaru_gpu_print_stats (vk_device_t *dev, FILE *fp, double secs)
+{
+	hikaru_gpu_t *gpu = (hikaru_gpu_t *) dev;
+	hikaru_gpu_cp_counters_t *total = &gpu->stats.total;
+	unsigned op;
+
+	fprintf (fp, "gpu_cp.insns=%lu\n", gpu->stats.cp_executed);
+	fprintf (fp, "gpu_cp.ips=%.0f\n", gpu->stats.cp_executed / secs);
+	fprintf (fp, "gpu_cp.frames=%lu\n", gpu->stats.cp_frames);
+	fprintf (fp, "gpu_cp.meshes=%lu\n", total->meshes);
+	fprintf (fp, "gpu_cp.static_meshes=%lu\n", total->static_meshes);
+	fprintf (fp, "gpu_cp.vertices=%lu\n", total->vertices);
+	fprintf (fp, "gpu_cp.jumps=%lu\n", total->jumps);
+	fprintf (fp, "gpu_cp.calls=%lu\n", total->calls);
+	for (op = 0; op < 0x200; op++)
+		if (gpu->stats.ops[op])
+			fprintf (fp, "gpu_cp.op_%03X=%lu\n", op, gpu->stats.ops[op]);
+}
+
+static void
+hikaru_gpu_destroy (vk_device_t **dev_)
+{
+	hikaru_gpu_t *gpu = (hikaru_gpu_t *) *dev_;
+
+	hikaru_gpu_cp_end_dump (gpu);
+}
+
 static void
 hikaru_gpu_reset (vk_device_t *dev, vk_reset_type_t type)
 {
@@ -1280,7 +1395,7 @@ hikaru_gpu_new (vk_machine_t *mach,
 	if (!gpu)
 		return NULL;
 
-	dev->destroy	= NULL;
+	dev->destroy	= hikaru_gpu_destroy;
 	dev->reset	= hikaru_gpu_reset;
 	dev->exec	= hikaru_gpu_exec;
 	dev->get	= hikaru_gpu_get;
@@ -1300,6 +1415,10 @@ hikaru_gpu_new (vk_machine_t *mach,
 		vk_util_get_bool_option ("GPU_LOG_IDMA", false);
 	gpu->debug.log_cp =
 		vk_util_get_bool_option ("GPU_LOG_CP", false);
+	gpu->debug.log_cp_stats =
+		vk_util_get_bool_option ("GPU_LOG_CP_STATS", false);
+
+	gpu->cp_dump.frame = vk_util_get_int_option ("GPU_DUMP_CP_FRAME", -1);
 
 	hikaru_gpu_cp_init (gpu);
 
@@ -17,6 +17,7 @@
  */
 
 #include "vk/core.h"
+#include "vk/profiler.h"
 
 #include "mach/hikaru/hikaru.h"
 #include "mach/hikaru/hikaru-memctl.h"
@@ -393,6 +394,33 @@ typedef struct {
 	bool master;
 } hikaru_memctl_t;
 
+/* Reads from ROM data held either in a buffer or in a pager; returns false
+ * if out of bounds. */
+static uint32_t
+rom_get_size (vk_buffer_t *buf, vk_pager_t *pager)
+{
+	return pager ? vk_pager_get_size (pager) : vk_buffer_get_size (buf);
+}
+
+static int
+rom_get (hikaru_t *hikaru, vk_buffer_t *buf, vk_pager_t *pager,
+         unsigned size, uint32_t offs, void *val)
+{
+	uint64_t data;
+
+	if (pager) {
+		if (vk_pager_get (pager, size, offs, &data)) {
+			VK_CPU_ERROR (hikaru->sh_current, "ROMBD can't page in R%u [%08X]",
+			              size * 8, offs);
+			return -1;
+		}
+		set_ptr (val, size, data);
+		return 0;
+	}
+	set_ptr (val, size, vk_buffer_get (buf, size, offs));
+	return 0;
+}
+
 static int
 rombd_get (hikaru_t *hikaru, unsigned size, uint32_t bus_addr, void *val)
 {
@@ -419,11 +447,13 @@ rombd_get (hikaru_t *hikaru, unsigned size, uint32_t bus_addr, void *val)
 		uint32_t bank_mask = bank_size - 1;
 		uint32_t real_offs = (offs & bank_mask) + num * bank_size;
 
-		if (real_offs < vk_buffer_get_size (hikaru->eprom))
-			set_ptr (val, size, vk_buffer_get (hikaru->eprom, size, real_offs));
-		else
+		if (real_offs >= rom_get_size (hikaru->eprom, hikaru->eprom_pager)) {
 			VK_CPU_ERROR (hikaru->sh_current, "ROMBD out-of-bounds R%u %08X [%08X]",
 			              size * 8, bus_addr, real_offs);
+			return 0;
+		}
+		return rom_get (hikaru, hikaru->eprom, hikaru->eprom_pager,
+		                size, real_offs, val);
 
 	} else if (bank >= config->maskrom_bank[0] &&
 	           bank <= config->maskrom_bank[1]) {
@@ -434,11 +464,13 @@ rombd_get (hikaru_t *hikaru, unsigned size, uint32_t bus_addr, void *val)
 		uint32_t bank_mask = bank_size - 1;
 		uint32_t real_offs = (offs & bank_mask) + num * bank_size;
 
-		if (real_offs < vk_buffer_get_size (hikaru->maskrom))
-			set_ptr (val, size, vk_buffer_get (hikaru->maskrom, size, real_offs));
-		else
+		if (real_offs >= rom_get_size (hikaru->maskrom, hikaru->maskrom_pager)) {
 			VK_CPU_ERROR (hikaru->sh_current, "ROMBD out-of-bounds R%u %08X [num=%X offs=%X bsize=%X bmask=%X roffs=%08X]",
 			              size * 8, bus_addr, num, offs, bank_size, bank_mask, real_offs);
+			return 0;
+		}
+		return rom_get (hikaru, hikaru->maskrom, hikaru->maskrom_pager,
+		                size, real_offs, val);
 	}
 	return 0;
 }
@@ -545,7 +577,7 @@ static const struct {
 };
 
 static uint32_t
-twiddle_offs (uint32_t offs)
+twiddle_offs_slow (uint32_t offs)
 {
 	uint32_t toffs = 0, i;
 	for (i = 0; i < NUMELEM (d_to_t); i++) {
@@ -555,6 +587,28 @@ twiddle_offs (uint32_t offs)
 	return toffs;
 }
 
+/* The twiddled offset is split in two lookups, on the low 11 and the high
+ * 10 bits of the offset; see init_twiddle_tables (). */
+static uint32_t twiddle_lo[1 << 11];
+static uint32_t twiddle_hi[1 << 10];
+
+static void
+init_twiddle_tables (void)
+{
+	uint32_t i;
+
+	for (i = 0; i < NUMELEM (twiddle_lo); i++)
+		twiddle_lo[i] = twiddle_offs_slow (i);
+	for (i = 0; i < NUMELEM (twiddle_hi); i++)
+		twiddle_hi[i] = twiddle_offs_slow (i << 11);
+}
+
+static inline uint32_t
+twiddle_offs (uint32_t offs)
+{
+	return twiddle_lo[offs & 0x7FF] | twiddle_hi[(offs >> 11) & 0x3FF];
+}
+
 static void
 texram_put (hikaru_t *hikaru, uint32_t bank, uint32_t size, uint32_t offs, uint64_t val)
 {
@@ -566,11 +620,47 @@ texram_put (hikaru_t *hikaru, uint32_t bank, uint32_t size, uint32_t offs, uint6
 
 		VK_ASSERT (size == 4);
 
-		vk_buffer_put (hikaru->texram[bank], 2, toffs_lo, bswap16 (val));
-		vk_buffer_put (hikaru->texram[bank], 2, toffs_hi, bswap16 (val >> 16));
+		vk_buffer_put16_fast (hikaru->texram[bank], toffs_lo, bswap16 (val));
+		vk_buffer_put16_fast (hikaru->texram[bank], toffs_hi, bswap16 (val >> 16));
+	}
+}
+
+/* Same as texram_put () on num consecutive words, with the access mode
+ * checked once. */
+static void
+texram_put_block (hikaru_t *hikaru, uint32_t bank, uint32_t offs,
+                  const uint32_t *src, unsigned num)
+{
+	vk_buffer_t *texram = hikaru->texram[bank];
+	unsigned i;
+
+	if (hikaru_gpu_is_texram_twiddled (hikaru->gpu)) {
+		for (i = 0; i < num; i++)
+			vk_buffer_put32_fast (texram, offs + i * 4, src[i]);
+		return;
+	}
+
+	for (i = 0; i < num; i++) {
+		uint32_t index = (offs >> 1) + i * 2;
+
+		vk_buffer_put16_fast (texram, twiddle_offs (index) << 1,
+		                      bswap16 (src[i]));
+		vk_buffer_put16_fast (texram, twiddle_offs (index + 1) << 1,
+		                      bswap16 (src[i] >> 16));
 	}
 }
 
+/* Returns the TEXRAM bank a BUS address falls in, or -1. */
+static int
+get_texram_bank (uint32_t bus_addr)
+{
+	if (bus_addr >= 0x04000000 && bus_addr <= 0x043FFFFF)
+		return 0;
+	if (bus_addr >= 0x06000000 && bus_addr <= 0x063FFFFF)
+		return 1;
+	return -1;
+}
+
 static int
 memctl_bus_put (hikaru_memctl_t *memctl, unsigned size, uint32_t bus_addr, uint64_t val)
 {
@@ -698,10 +788,13 @@ hikaru_memctl_put (vk_device_t *dev, unsigned size, uint32_t addr, uint64_t val)
 	return memctl_bus_put (memctl, size, bus_addr, val);
 }
 
+static vk_profiler_section_t prof_dma = VK_PROFILER_SECTION ("memctl_dma");
+
 static int
 hikaru_memctl_exec (vk_device_t *dev, int cycles)
 {
 	hikaru_memctl_t *memctl = (hikaru_memctl_t *) dev;
+	hikaru_t *hikaru = (hikaru_t *) memctl->base.mach;
 	uint32_t src, dst, len, ctl, todo;
 
 	len = vk_buffer_get (memctl->regs, 4, 0x38);
@@ -723,13 +816,30 @@ hikaru_memctl_exec (vk_device_t *dev, int cycles)
 
 	VK_ASSERT ((len & 0xFF000000) == 0);
 
-	while (todo--) {
-		uint32_t tmp;
-		memctl_bus_get (memctl, 4, src & 0x7FFFFFFF, &tmp);
-		memctl_bus_put (memctl, 4, dst & 0x7FFFFFFF, tmp);
-		src += 4;
-		dst += 4;
+	vk_profiler_enter (&prof_dma);
+	while (todo) {
+		uint32_t words[256], num = MIN2 (todo, NUMELEM (words)), i;
+		int bank = get_texram_bank (dst & 0x7FFFFFFF);
+
+		/* Texture uploads are written to TEXRAM a block at a time */
+		if (bank >= 0 &&
+		    get_texram_bank ((dst & 0x7FFFFFFF) + num * 4 - 1) == bank) {
+			for (i = 0; i < num; i++)
+				memctl_bus_get (memctl, 4, (src + i * 4) & 0x7FFFFFFF,
+				                &words[i]);
+			texram_put_block (hikaru, bank, dst & 0x3FFFFF, words, num);
+		} else {
+			for (i = 0; i < num; i++) {
+				uint32_t tmp;
+				memctl_bus_get (memctl, 4, (src + i * 4) & 0x7FFFFFFF, &tmp);
+				memctl_bus_put (memctl, 4, (dst + i * 4) & 0x7FFFFFFF, tmp);
+			}
+		}
+		src += num * 4;
+		dst += num * 4;
+		todo -= num;
 	}
+	vk_profiler_leave (&prof_dma);
 
 	/* Transfer completed */
 	if (len == 0) {
@@ -784,6 +894,7 @@ hikaru_memctl_new (vk_machine_t *mach, bool master)
 
 	vk_machine_register_buffer (mach, memctl->regs);
 
+	init_twiddle_tables ();
 	return dev;
 
 fail:
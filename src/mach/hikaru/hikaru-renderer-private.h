@@ -37,6 +37,7 @@ enum {
 	HR_DEBUG_NO_DIFFUSE,
 	HR_DEBUG_NO_SPECULAR,
 	HR_DEBUG_FOG,
+	HR_DEBUG_NO_OIT,
 
 	HR_NUM_DEBUG_VARS
 };
@@ -69,6 +70,7 @@ typedef union {
 		uint64_t has_light3_specular	: 1;
 
 		uint64_t has_fog		: 1;
+		uint64_t has_oit		: 1;
 	};
 	uint64_t full;
 } hikaru_glsl_variant_t;
@@ -78,9 +80,40 @@ typedef struct {
 	hikaru_texhead_t th;
 } hikaru_texture_t;
 
+/* Vertex data is uploaded in a packed format: position as floats, the normal
+ * as signed 2:10:10:10, texcoords as half floats and alpha as a byte. Colors
+ * come from the material and are not stored per-vertex at all. */
+
+#define HR_LAYOUT_NRM	HR_PUSH_NRM
+#define HR_LAYOUT_TXC	HR_PUSH_TXC
+#define HR_LAYOUT_ALPHA	(1 << 3)
+
+typedef struct {
+	vec3f_t position;	/* 0x00 */
+	uint32_t normal;	/* 0x0C */
+	uint16_t texcoords[2];	/* 0x10 */
+	uint8_t alpha;		/* 0x14 */
+	uint8_t padding[3];
+} hikaru_packed_vertex_t;
+
+/* Triangles are output as indices into the packed vertices. Culled and
+ * double-sided (nocull) triangles go to separate index ranges, so that the
+ * latter can be drawn once with culling disabled. */
+
+enum {
+	HR_INDICES_CULL,
+	HR_INDICES_NOCULL,
+
+	HR_NUM_INDEX_RANGES
+};
+
 typedef struct {
 	GLuint			vbo;
-	uint32_t		num_tris;
+	GLuint			ibo;
+	uint32_t		num_verts;
+	uint32_t		num_indices[HR_NUM_INDEX_RANGES];
+	uint32_t		layout;
+	uint32_t		stride;
 	uint32_t		addr[2];
 	uint32_t		vp_index;
 	uint32_t		mv_index;
@@ -120,9 +153,13 @@ typedef struct {
 	uint32_t		 total_meshes;
 
 	struct {
-		unsigned		num_verts, num_tris;
+		unsigned		num_verts, num_out_verts;
+		uint32_t		flags;
 		hikaru_vertex_t		tmp[4];
-		hikaru_vertex_body_t	all[MAX_VERTICES_PER_MESH];
+		uint32_t		tmp_index[4];
+		hikaru_packed_vertex_t	all[MAX_VERTICES_PER_MESH];
+		uint16_t		indices[HR_NUM_INDEX_RANGES][MAX_VERTICES_PER_MESH * 3];
+		uint32_t		num_indices[HR_NUM_INDEX_RANGES];
 	} push;
 
 	struct {
@@ -136,13 +173,8 @@ typedef struct {
 			GLuint		u_projection;
 			GLuint		u_modelview;
 			GLuint		u_normal;
-			struct {
-				GLuint	position;
-				GLuint	direction;
-				GLuint	diffuse;
-				GLuint	specular;
-				GLuint	extents;
-			} u_lights[4];
+			GLuint		u_lightsets;
+			GLuint		u_lightset;
 			GLuint		u_ambient;
 			GLuint		u_texture;
 			GLuint		u_fog;
@@ -150,11 +182,28 @@ typedef struct {
 		} locs;
 	} meshes;
 
+	struct {
+		GLuint buffer;
+		GLuint texture;
+		unsigned max;
+	} lightsets;
+
 	struct {
 		hikaru_texture_t cache[2][0x40][0x80];
 		bool is_clear[2];
 	} textures;
 
+	struct {
+		bool active;
+		GLuint target;		/* Scene FBO, or 0 if none */
+		GLuint program;
+		GLuint fb, cb[2], db;
+		struct {
+			GLuint u_accum;
+			GLuint u_weight;
+		} locs;
+	} oit;
+
 	struct {
 		GLuint program;
 		GLuint fb[2], cb[2], db[2];
@@ -17,6 +17,7 @@
  */
 
 #include "vk/input.h"
+#include "vk/profiler.h"
 
 #include "mach/hikaru/hikaru-renderer.h"
 #include "mach/hikaru/hikaru-renderer-private.h"
@@ -61,6 +62,7 @@ static const struct {
 	[HR_DEBUG_NO_DIFFUSE]		= {  0, 1, SDLK_d },
 	[HR_DEBUG_NO_SPECULAR]		= {  0, 1, SDLK_s },
 	[HR_DEBUG_FOG]			= {  0, 1, SDLK_g },
+	[HR_DEBUG_NO_OIT]		= {  0, 1, SDLK_o },
 };
 
 static void
@@ -98,6 +100,19 @@ update_debug_flags (hikaru_renderer_t *hr)
  Utils
 ****************************************************************************/
 
+#define VK_COPY_VEC2F(dst_, src_) \
+	do { \
+		dst_[0] = src_[0]; \
+		dst_[1] = src_[1]; \
+	} while (0)
+
+#define VK_COPY_VEC3F(dst_, src_) \
+	do { \
+		dst_[0] = src_[0]; \
+		dst_[1] = src_[1]; \
+		dst_[2] = src_[2]; \
+	} while (0)
+
 static GLuint
 get_uniform_loc (GLuint prog, const char *id)
 {
@@ -152,10 +167,10 @@ abgr1111_to_rgba4444 (uint32_t texel)
 #define PUT16(x, y, t) \
 	*(uint16_t *) &(data[(y)*w*2 + (x)*2]) = (t)
 
-static void *
-decode_texture_abgr1111 (vk_buffer_t *texram,
-                         uint32_t w, uint32_t h,
-                         uint32_t basex, uint32_t basey)
+void *
+hikaru_renderer_decode_texture_abgr1111 (vk_buffer_t *texram,
+                                         uint32_t w, uint32_t h,
+                                         uint32_t basex, uint32_t basey)
 {
 	uint32_t x, y;
 	uint8_t *data;
@@ -167,11 +182,14 @@ decode_texture_abgr1111 (vk_buffer_t *texram,
 	for (y = 0; y < h; y++) {
 		for (x = 0; x < w; x += 4) {
 			uint32_t offs = (basey + y) * 4096 + (basex + x);
-			uint32_t texels = vk_buffer_get (texram, 4, offs);
-			PUT16 (x + 2, y*2 + 0, abgr1111_to_rgba4444 (texels >> 28));
-			PUT16 (x + 3, y*2 + 0, abgr1111_to_rgba4444 (texels >> 24));
-	      		PUT16 (x + 2, y*2 + 1, abgr1111_to_rgba4444 (texels >> 20));
-			PUT16 (x + 3, y*2 + 1, abgr1111_to_rgba4444 (texels >> 16));
+			uint32_t texels = vk_buffer_get32_fast (texram, offs);
+			/* The smallest mipmaps are only two texels wide. */
+			if (x + 2 < w) {
+				PUT16 (x + 2, y*2 + 0, abgr1111_to_rgba4444 (texels >> 28));
+				PUT16 (x + 3, y*2 + 0, abgr1111_to_rgba4444 (texels >> 24));
+				PUT16 (x + 2, y*2 + 1, abgr1111_to_rgba4444 (texels >> 20));
+				PUT16 (x + 3, y*2 + 1, abgr1111_to_rgba4444 (texels >> 16));
+			}
 	      		PUT16 (x + 0, y*2 + 0, abgr1111_to_rgba4444 (texels >> 12));
 			PUT16 (x + 1, y*2 + 0, abgr1111_to_rgba4444 (texels >> 8));
 	      		PUT16 (x + 0, y*2 + 1, abgr1111_to_rgba4444 (texels >> 4));
@@ -278,8 +296,8 @@ upload_texture (hikaru_renderer_t *hr, hikaru_texhead_t *th)
 			VK_ASSERT_NO_GL_ERROR ();
 			break;
 		case HIKARU_FORMAT_ABGR1111:
-			data = decode_texture_abgr1111 (hr->gpu->texram[bank],
-			                                w, h, basex, basey);
+			data = hikaru_renderer_decode_texture_abgr1111 (hr->gpu->texram[bank],
+			                                                w, h, basex, basey);
 			if (!data)
 				goto fail;
 
@@ -324,6 +342,51 @@ fail:
 	return 0;
 }
 
+/* Headless renderers have no GL textures, but still decode the formats GL
+ * can't take as they are, so that they pay the same CPU cost. */
+static int
+decode_texture (hikaru_renderer_t *hr, hikaru_texhead_t *th)
+{
+	uint32_t w, h, num_levels, level, basex, basey, bank;
+
+	w = 16 << th->logw;
+	h = 16 << th->logh;
+	num_levels = hr->debug.flags[HR_DEBUG_NO_MIPMAPS] ? 1 :
+	             MIN2 (th->logw, th->logh) + 4;
+
+	get_texhead_coords (&basex, &basey, th);
+	bank = th->bank;
+
+	for (level = 0; level < num_levels; level++) {
+		void *data;
+
+		switch (th->format) {
+		case HIKARU_FORMAT_ABGR1555:
+		case HIKARU_FORMAT_ABGR4444:
+		case HIKARU_FORMAT_LA8:
+			break;
+		case HIKARU_FORMAT_ABGR1111:
+			data = hikaru_renderer_decode_texture_abgr1111 (hr->gpu->texram[bank],
+			                                                w, h, basex, basey);
+			if (!data)
+				return -1;
+			free (data);
+			break;
+		default:
+			return -1;
+		}
+
+		w >>= 1;
+		h >>= 1;
+		VK_ASSERT (w && h);
+
+		basex += (2048 - basex) / 2;
+		basey += (1024 - basey) / 2;
+		bank ^= 1;
+	}
+	return 0;
+}
+
 hikaru_texture_t *
 get_texture (hikaru_renderer_t *hr, hikaru_texhead_t *th)
 {
@@ -347,10 +410,16 @@ get_texture (hikaru_renderer_t *hr, hikaru_texhead_t *th)
 
 	destroy_texture (cached);
 
-	id = upload_texture (hr, th);
-	if (!id) {
-		destroy_texture (cached);
-		return NULL;
+	if (hr->base.headless) {
+		if (decode_texture (hr, th))
+			return NULL;
+		id = 0;
+	} else {
+		id = upload_texture (hr, th);
+		if (!id) {
+			destroy_texture (cached);
+			return NULL;
+		}
 	}
 
 	cached->th = *th;
@@ -454,7 +523,8 @@ struct light_t {								\n \
 	vec2 extents;								\n \
 };										\n \
 										\n \
-uniform light_t		u_lights[4];						\n \
+uniform samplerBuffer	u_lightsets;						\n \
+uniform int		u_lightset;						\n \
 uniform vec3		u_ambient;						\n \
 uniform sampler2D	u_texture;						\n \
 uniform vec2		u_fog;							\n \
@@ -469,6 +539,22 @@ in vec3 p_unknown;								\n \
 in vec2 p_texcoords;								\n \
 in float p_alpha;								\n \
 										\n \
+light_t										\n \
+get_light (int i)								\n \
+{										\n \
+	int base = (u_lightset * 4 + i) * 4;					\n \
+	vec4 t0 = texelFetch (u_lightsets, base + 0);				\n \
+	vec4 t1 = texelFetch (u_lightsets, base + 1);				\n \
+	light_t light;								\n \
+										\n \
+	light.position  = t0.xyz;						\n \
+	light.direction = t1.xyz;						\n \
+	light.diffuse   = texelFetch (u_lightsets, base + 2).rgb;		\n \
+	light.specular  = texelFetch (u_lightsets, base + 3).rgb;		\n \
+	light.extents   = vec2 (t0.w, t1.w);					\n \
+	return light;								\n \
+}										\n \
+										\n \
 void										\n \
 apply_light (inout vec3 diffuse,						\n \
              inout vec3 specular,						\n \
@@ -538,16 +624,16 @@ main (void)									\n \
 	vec3 ambient  = u_ambient * p_ambient;					\n \
 										\n \
 #if HAS_LIGHT0									\n \
-	apply_light (diffuse, specular, u_lights[0], LIGHT0_TYPE, LIGHT0_ATT_TYPE, HAS_LIGHT0_SPECULAR);		\n \
+	apply_light (diffuse, specular, get_light (0), LIGHT0_TYPE, LIGHT0_ATT_TYPE, HAS_LIGHT0_SPECULAR);		\n \
 #endif										\n \
 #if HAS_LIGHT1									\n \
-	apply_light (diffuse, specular, u_lights[1], LIGHT1_TYPE, LIGHT1_ATT_TYPE, HAS_LIGHT1_SPECULAR);		\n \
+	apply_light (diffuse, specular, get_light (1), LIGHT1_TYPE, LIGHT1_ATT_TYPE, HAS_LIGHT1_SPECULAR);		\n \
 #endif										\n \
 #if HAS_LIGHT2									\n \
-	apply_light (diffuse, specular, u_lights[2], LIGHT2_TYPE, LIGHT2_ATT_TYPE, HAS_LIGHT2_SPECULAR);		\n \
+	apply_light (diffuse, specular, get_light (2), LIGHT2_TYPE, LIGHT2_ATT_TYPE, HAS_LIGHT2_SPECULAR);		\n \
 #endif										\n \
 #if HAS_LIGHT3									\n \
-	apply_light (diffuse, specular, u_lights[3], LIGHT3_TYPE, LIGHT3_ATT_TYPE, HAS_LIGHT3_SPECULAR);		\n \
+	apply_light (diffuse, specular, get_light (3), LIGHT3_TYPE, LIGHT3_ATT_TYPE, HAS_LIGHT3_SPECULAR);		\n \
 #endif										\n \
 										\n \
 	color = vec4 (ambient +  diffuse, p_alpha) * texel + vec4 (specular, 0.0);	\n \
@@ -558,7 +644,14 @@ main (void)									\n \
 #if HAS_FOG									\n \
 	float z = gl_FragCoord.z / gl_FragCoord.w;				\n \
 	float a = clamp (u_fog.x * (z - u_fog.y), 0.0, 1.0);			\n \
-	gl_FragColor = mix (color, vec4 (u_fog_color, 1.0), a);			\n \
+	color = mix (color, vec4 (u_fog_color, 1.0), a);			\n \
+#endif										\n \
+										\n \
+#if HAS_OIT									\n \
+	float w = clamp (pow (min (1.0, color.a * 10.0) + 0.01, 3.0) * 1e8 *	\n \
+	                 pow (1.0 - gl_FragCoord.z * 0.9, 3.0), 1e-2, 3e3);	\n \
+	gl_FragData[0] = vec4 (color.rgb * color.a * w, color.a);		\n \
+	gl_FragData[1] = vec4 (color.a * w);					\n \
 #else										\n \
 	gl_FragColor = color;							\n \
 #endif										\n \
@@ -624,6 +717,8 @@ get_glsl_variant (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	variant.has_fog		= mat->depth_blend == 0 &&
 	                          hr->debug.flags[HR_DEBUG_FOG];
 
+	variant.has_oit		= hr->oit.active;
+
 	if (!variant.has_lighting)
 		return variant;
 
@@ -687,7 +782,8 @@ upload_glsl_program (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	"#define LIGHT3_TYPE %d\n"
 	"#define LIGHT3_ATT_TYPE %d\n"
 	"#define HAS_LIGHT3_SPECULAR %d\n"
-	"#define HAS_FOG %d\n";
+	"#define HAS_FOG %d\n"
+	"#define HAS_OIT %d\n";
 
 	hikaru_glsl_variant_t variant;
 	char *definitions, *vs_source, *fs_source;
@@ -729,7 +825,8 @@ upload_glsl_program (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	                variant.light3_type,
 	                variant.light3_att_type,
 	                variant.has_light3_specular,
-	                variant.has_fog);
+	                variant.has_fog,
+	                variant.has_oit);
 	VK_ASSERT (ret >= 0);
 
 	ret = asprintf (&vs_source, mesh_vs_source, definitions);
@@ -766,25 +863,10 @@ update_locations:
 		glGetUniformLocation (hr->meshes.program, "u_modelview");
 	hr->meshes.locs.u_normal =
 		glGetUniformLocation (hr->meshes.program, "u_normal");
-	for (i = 0; i < 4; i++) {
-		char temp[64];
-
-		sprintf (temp, "u_lights[%d].position", i);
-		hr->meshes.locs.u_lights[i].position =
-			glGetUniformLocation (hr->meshes.program, temp);
-		sprintf (temp, "u_lights[%d].direction", i);
-		hr->meshes.locs.u_lights[i].direction =
-			glGetUniformLocation (hr->meshes.program, temp);
-		sprintf (temp, "u_lights[%d].diffuse", i);
-		hr->meshes.locs.u_lights[i].diffuse =
-			glGetUniformLocation (hr->meshes.program, temp);
-		sprintf (temp, "u_lights[%d].specular", i);
-		hr->meshes.locs.u_lights[i].specular =
-			glGetUniformLocation (hr->meshes.program, temp);
-		sprintf (temp, "u_lights[%d].extents", i);
-		hr->meshes.locs.u_lights[i].extents =
-			glGetUniformLocation (hr->meshes.program, temp);
-	}
+	hr->meshes.locs.u_lightsets =
+		glGetUniformLocation (hr->meshes.program, "u_lightsets");
+	hr->meshes.locs.u_lightset =
+		glGetUniformLocation (hr->meshes.program, "u_lightset");
 	hr->meshes.locs.u_ambient =
 		glGetUniformLocation (hr->meshes.program, "u_ambient");
 	hr->meshes.locs.u_texture =
@@ -794,6 +876,25 @@ update_locations:
 	hr->meshes.locs.u_fog_color =
 		glGetUniformLocation (hr->meshes.program, "u_fog_color");
 	VK_ASSERT_NO_GL_ERROR ();
+
+	/* The lightset table lives in texture unit 2, see upload_lightsets. */
+	glUniform1i (hr->meshes.locs.u_lightsets, 2);
+	VK_ASSERT_NO_GL_ERROR ();
+}
+
+static void
+get_light_ambient (hikaru_renderer_t *hr, hikaru_mesh_t *mesh, float *out)
+{
+	hikaru_viewport_t *vp =
+		(mesh->vp_index == ~0) ? NULL : &hr->vp_list[mesh->vp_index];
+
+	if (hr->debug.flags[HR_DEBUG_NO_AMBIENT] || !vp)
+		out[0] = out[1] = out[2] = 0.0f;
+	else {
+		out[0] = vp->color.ambient[0] * INV255;
+		out[1] = vp->color.ambient[1] * INV255;
+		out[2] = vp->color.ambient[2] * INV255;
+	}
 }
 
 static void
@@ -851,6 +952,13 @@ upload_viewport (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	            vp->clip.r - vp->clip.l,
 	            vp->clip.t - vp->clip.b);
 
+	if (hr->meshes.variant.has_lighting) {
+		vec3f_t ambient;
+
+		get_light_ambient (hr, mesh, ambient);
+		glUniform3fv (hr->meshes.locs.u_ambient, 1, ambient);
+	}
+
 	if (hr->meshes.variant.has_fog) {
 		vec2f_t fog;
 		vec3f_t fog_color;
@@ -918,21 +1026,6 @@ upload_material_texhead (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	VK_ASSERT_NO_GL_ERROR ();
 }
 
-static void
-get_light_ambient (hikaru_renderer_t *hr, hikaru_mesh_t *mesh, float *out)
-{
-	hikaru_viewport_t *vp =
-		(mesh->vp_index == ~0) ? NULL : &hr->vp_list[mesh->vp_index];
-
-	if (hr->debug.flags[HR_DEBUG_NO_AMBIENT] || !vp)
-		out[0] = out[1] = out[2] = 0.0f;
-	else {
-		out[0] = vp->color.ambient[0] * INV255;
-		out[1] = vp->color.ambient[1] * INV255;
-		out[2] = vp->color.ambient[2] * INV255;
-	}
-}
-
 static void
 get_light_diffuse (hikaru_renderer_t *hr, hikaru_light_t *lit, float *out)
 {
@@ -967,63 +1060,269 @@ get_light_specular (hikaru_renderer_t *hr, hikaru_light_t *lit, float *out)
 static void
 upload_lightset (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 {
-	hikaru_lightset_t *ls = &hr->ls_list[mesh->ls_index];
-	float tmp[4];
-	unsigned i;
-
 	if (!hr->meshes.variant.has_lighting)
 		return;
 
-	LOG ("lightset = %s", get_lightset_str (ls));
+	LOG ("lightset = [%u] %s", mesh->ls_index,
+	     get_lightset_str (&hr->ls_list[mesh->ls_index]));
 
-	get_light_ambient (hr, mesh, tmp);
-	glUniform3fv (hr->meshes.locs.u_ambient, 1, (const GLfloat *) tmp);
+	glUniform1i (hr->meshes.locs.u_lightset, mesh->ls_index);
 	VK_ASSERT_NO_GL_ERROR ();
+}
 
-	for (i = 0; i < 4; i++) {
-		hikaru_light_t *lt = &ls->lights[i];
+/* All the lightsets recorded during the frame are uploaded at once to a
+ * texture buffer; meshes then only need to pass their lightset index. Each
+ * light takes four RGBA32F texels: position and direction (with the
+ * extents in their w), diffuse and specular. That keeps MAX_LIGHTSETS
+ * within the 65536 texels GL guarantees; see also hr->lightsets.max. */
+#define TEXELS_PER_LIGHT	4
 
-		if (ls->mask & (1 << i))
-			continue;
+static void
+upload_lightsets (hikaru_renderer_t *hr)
+{
+	vec4f_t *data;
+	unsigned i, j;
 
-		glUniform3fv (hr->meshes.locs.u_lights[i].position, 1,
-		              lt->position);
-		VK_ASSERT_NO_GL_ERROR ();
+	if (!hr->num_lss)
+		return;
+
+	data = (vec4f_t *) calloc (hr->num_lss * 4 * TEXELS_PER_LIGHT,
+	                           sizeof (vec4f_t));
+	VK_ASSERT (data);
+
+	for (i = 0; i < hr->num_lss; i++) {
+		hikaru_lightset_t *ls = &hr->ls_list[i];
+		for (j = 0; j < 4; j++) {
+			hikaru_light_t *lt = &ls->lights[j];
+			vec4f_t *dst = &data[(i * 4 + j) * TEXELS_PER_LIGHT];
+
+			/* The shader doesn't look at masked-out lights. */
+			if (ls->mask & (1 << j))
+				continue;
+
+			VK_COPY_VEC3F (dst[0], lt->position);
+			VK_COPY_VEC3F (dst[1], lt->direction);
+			dst[0][3] = lt->attenuation[0];
+			dst[1][3] = lt->attenuation[1];
+			get_light_diffuse (hr, lt, dst[2]);
+			get_light_specular (hr, lt, dst[3]);
+		}
+	}
+
+	glBindBuffer (GL_TEXTURE_BUFFER, hr->lightsets.buffer);
+	glBufferData (GL_TEXTURE_BUFFER,
+	              hr->num_lss * 4 * TEXELS_PER_LIGHT * sizeof (vec4f_t),
+	              (const GLvoid *) data, GL_STREAM_DRAW);
+	glBindBuffer (GL_TEXTURE_BUFFER, 0);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	glActiveTexture (GL_TEXTURE0 + 2);
+	glBindTexture (GL_TEXTURE_BUFFER, hr->lightsets.texture);
+	glTexBuffer (GL_TEXTURE_BUFFER, GL_RGBA32F, hr->lightsets.buffer);
+	glActiveTexture (GL_TEXTURE0 + 0);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	free (data);
+}
+
+/****************************************************************************
+ Order-Independent Transparency
+****************************************************************************/
+
+/* Translucent meshes are drawn with weighted blended OIT (McGuire & Bavoil,
+ * 2013): a single geometry pass accumulates weighted premultiplied colors
+ * and revealage in an offscreen framebuffer, and a full-screen pass then
+ * resolves them over the opaque scene. This is two passes per viewport
+ * regardless of the number of translucent meshes.
+ *
+ * Only glBlendFuncSeparate is needed: color buffer 0 accumulates the
+ * weighted colors in RGB and the revealage (product of 1 - alpha) in A;
+ * color buffer 1 accumulates the weights. */
+
+static const char *oit_vs_source =
+"#version 140									\n"
+"										\n"
+"#extension GL_ARB_explicit_attrib_location : require				\n"
+"										\n"
+"layout(location = 0) in vec3 i_position;					\n"
+"										\n"
+"void main (void) {								\n"
+"	gl_Position = vec4 (i_position.xy * 2.0 - 1.0, 0.0, 1.0);		\n"
+"}										\n";
+
+static const char *oit_fs_source =
+"#version 140									\n"
+"										\n"
+"uniform sampler2D u_accum;							\n"
+"uniform sampler2D u_weight;							\n"
+"										\n"
+"void main (void) {								\n"
+"	ivec2 p = ivec2 (gl_FragCoord.xy);					\n"
+"	vec4 accum = texelFetch (u_accum, p, 0);				\n"
+"	float weight = texelFetch (u_weight, p, 0).r;				\n"
+"										\n"
+"	if (accum.a >= 1.0)							\n"
+"		discard;							\n"
+"										\n"
+"	gl_FragColor = vec4 (accum.rgb / max (weight, 1e-5), accum.a);		\n"
+"}										\n";
+
+static int
+build_oit_state (hikaru_renderer_t *hr)
+{
+	static const GLenum targets[2] = {
+		GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1
+	};
+	static const GLenum formats[2] = { GL_RGBA16F, GL_R16F };
+	unsigned i;
+
+	hr->oit.program = vk_renderer_compile_program (oit_vs_source, oit_fs_source);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	hr->oit.locs.u_accum = get_uniform_loc (hr->oit.program, "u_accum");
+	hr->oit.locs.u_weight = get_uniform_loc (hr->oit.program, "u_weight");
+
+	glGenFramebuffers (1, &hr->oit.fb);
+	glGenTextures (2, hr->oit.cb);
+	glGenRenderbuffers (1, &hr->oit.db);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	glBindFramebuffer (GL_FRAMEBUFFER, hr->oit.fb);
+	VK_ASSERT_NO_GL_ERROR ();
 
-		glUniform3fv (hr->meshes.locs.u_lights[i].direction, 1,
-		              lt->direction);
+	for (i = 0; i < 2; i++) {
+		glBindTexture (GL_TEXTURE_2D, hr->oit.cb[i]);
+		glTexStorage2D (GL_TEXTURE_2D, 1, formats[i], 640, 480);
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		VK_ASSERT_NO_GL_ERROR ();
 
-		get_light_diffuse (hr, lt, tmp);
-		glUniform3fv (hr->meshes.locs.u_lights[i].diffuse, 1, tmp);
+		glFramebufferTexture2D (GL_FRAMEBUFFER, targets[i],
+		                        GL_TEXTURE_2D, hr->oit.cb[i], 0);
 		VK_ASSERT_NO_GL_ERROR ();
+	}
+
+	glDrawBuffers (2, targets);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	/* Same format as the framebuffer depth buffers, so that the opaque
+	 * depth can be blitted in. */
+	glBindRenderbuffer (GL_RENDERBUFFER, hr->oit.db);
+	glRenderbufferStorage (GL_RENDERBUFFER, GL_DEPTH_COMPONENT, 640, 480);
+	glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+	                           GL_RENDERBUFFER, hr->oit.db);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	if (glCheckFramebufferStatus (GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		return -1;
+
+	glBindTexture (GL_TEXTURE_2D, 0);
+	glBindFramebuffer (GL_FRAMEBUFFER, 0);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	return 0;
+}
+
+static void
+destroy_oit_state (hikaru_renderer_t *hr)
+{
+	glBindFramebuffer (GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers (1, &hr->oit.fb);
+	glDeleteTextures (2, hr->oit.cb);
+	glDeleteRenderbuffers (1, &hr->oit.db);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	vk_renderer_destroy_program (hr->oit.program);
+}
+
+static void
+begin_oit (hikaru_renderer_t *hr)
+{
+	static const GLfloat clear_accum[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+	static const GLfloat clear_weight[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	static const GLfloat clear_depth = 1.0f;
+
+	/* Copy the opaque depth from the scene FBO, so that hidden
+	 * translucent fragments are rejected. If the scene isn't drawn to
+	 * one of our FBOs there is no depth to copy; start from a clear
+	 * depth buffer instead. Note that both the blit and the clears are
+	 * affected by the scissor test (and the clear by the depth mask.) */
+	glDisable (GL_SCISSOR_TEST);
 
-		get_light_specular (hr, lt, tmp);
-		glUniform3fv (hr->meshes.locs.u_lights[i].specular, 1, tmp);
+	if (hr->oit.target) {
+		glBindFramebuffer (GL_READ_FRAMEBUFFER, hr->oit.target);
+		glBindFramebuffer (GL_DRAW_FRAMEBUFFER, hr->oit.fb);
+		glBlitFramebuffer (0, 0, 640, 480, 0, 0, 640, 480,
+		                   GL_DEPTH_BUFFER_BIT, GL_NEAREST);
 		VK_ASSERT_NO_GL_ERROR ();
+	}
 
-		glUniform2fv (hr->meshes.locs.u_lights[i].extents, 1,
-		              lt->attenuation);
+	glBindFramebuffer (GL_FRAMEBUFFER, hr->oit.fb);
+	if (!hr->oit.target) {
+		glDepthMask (GL_TRUE);
+		glClearBufferfv (GL_DEPTH, 0, &clear_depth);
 	}
+	glClearBufferfv (GL_COLOR, 0, clear_accum);
+	glClearBufferfv (GL_COLOR, 1, clear_weight);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	glEnable (GL_SCISSOR_TEST);
+
+	glEnable (GL_BLEND);
+	glBlendFuncSeparate (GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+	glDepthMask (GL_FALSE);
+	glEnable (GL_POLYGON_OFFSET_FILL);
+
+	hr->oit.active = true;
+}
+
+static void
+end_oit (hikaru_renderer_t *hr)
+{
+	hr->oit.active = false;
+
+	glBindFramebuffer (GL_FRAMEBUFFER, hr->oit.target);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	glViewport (0, 0, 640, 480);
+	glDisable (GL_DEPTH_TEST);
+	glDisable (GL_CULL_FACE);
+
+	/* Resolve: dst = avg_color * (1 - revealage) + dst * revealage. */
+	glBlendFunc (GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+
+	glUseProgram (hr->oit.program);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	glActiveTexture (GL_TEXTURE0 + 0);
+	glBindTexture (GL_TEXTURE_2D, hr->oit.cb[0]);
+	glActiveTexture (GL_TEXTURE0 + 1);
+	glBindTexture (GL_TEXTURE_2D, hr->oit.cb[1]);
+	glActiveTexture (GL_TEXTURE0 + 0);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	glUniform1i (hr->oit.locs.u_accum,  0);
+	glUniform1i (hr->oit.locs.u_weight, 1);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	glBindVertexArray (hr->framebuffer.vao);
+	glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
+	glBindVertexArray (0);
+	VK_ASSERT_NO_GL_ERROR ();
+	hr->base.num_draw_calls++;
+
+	glEnable (GL_DEPTH_TEST);
+	glEnable (GL_CULL_FACE);
+
+	/* The resolve program replaced the mesh program; make sure the next
+	 * mesh binds its own again. */
+	hr->meshes.variant.full = ~0;
 }
 
 /****************************************************************************
  Meshes
 ****************************************************************************/
 
-#define VK_COPY_VEC2F(dst_, src_) \
-	do { \
-		dst_[0] = src_[0]; \
-		dst_[1] = src_[1]; \
-	} while (0)
-
-#define VK_COPY_VEC3F(dst_, src_) \
-	do { \
-		dst_[0] = src_[0]; \
-		dst_[1] = src_[1]; \
-		dst_[2] = src_[2]; \
-	} while (0)
-
 static float
 clampf (float x, float min_, float max_)
 {
@@ -1032,26 +1331,15 @@ clampf (float x, float min_, float max_)
 }
 
 static void
-copy_colors (hikaru_renderer_t *hr, hikaru_vertex_t *dst, hikaru_vertex_t *src)
+copy_alpha (hikaru_renderer_t *hr, hikaru_vertex_t *dst, hikaru_vertex_t *src)
 {
 	hikaru_gpu_t *gpu = hr->gpu;
-	hikaru_material_t *mat = &MAT.scratch;
 	float alpha;
-	unsigned i;
-
-	for (i = 0; i < 3; i++)
-		dst->body.diffuse[i] = mat->diffuse[i];
-
-	for (i = 0; i < 3; i++)
-		dst->body.ambient[i] = mat->ambient[i];
 
-	for (i = 0; i < 4; i++)
-		dst->body.specular[i] = mat->specular[i];
-
-	for (i = 0; i < 3; i++)
-		dst->body.unknown[i] = mat->unknown[i];
-
-	/* Patch diffuse alpha depending on poly type. NOTE: transparent
+	/* Colors are per-material and are supplied as constant attributes at
+	 * draw time; only alpha may vary per-vertex.
+	 *
+	 * Patch diffuse alpha depending on poly type. NOTE: transparent
 	 * polygons also have an alpha, with unknown meaning (it seems to have
 	 * opposite sign w.r.t. translucent alpha though). */
 	alpha = 1.0f;
@@ -1079,40 +1367,114 @@ copy_texcoords (hikaru_renderer_t *hr,
 	dst->body.texcoords[1] = (src->body.texcoords[1] + (0.5f * gpu->texoffset_y)) / h;
 }
 
+/* Round to nearest; denormals flush to zero, overflows and NaNs become
+ * infinities. */
+static uint16_t
+float_to_half (float f)
+{
+	alias32uf_t a;
+	uint32_t sign, mant, h;
+	int32_t exp;
+
+	a.f = f;
+	sign = (a.u >> 16) & 0x8000;
+	exp  = (int32_t) ((a.u >> 23) & 0xFF) - 127 + 15;
+	mant = a.u & 0x7FFFFF;
+
+	if (exp <= 0)
+		return sign;
+	if (exp >= 31)
+		return sign | 0x7C00;
+
+	h = sign | (exp << 10) | (mant >> 13);
+	if (mant & 0x1000)
+		h++;
+	return h;
+}
+
+/* The shader renormalizes the normal anyway, so normalize it here to make
+ * the most out of the 10 bits and to avoid clamping normals longer than 1
+ * (which static meshes do produce). */
+static uint32_t
+pack_normal (const vec3f_t n)
+{
+	float len = sqrtf (n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+	float scale = (len > 0.0f) ? (511.0f / len) : 0.0f;
+	uint32_t packed = 0;
+	unsigned i;
+
+	for (i = 0; i < 3; i++) {
+		int32_t c = (int32_t) lrintf (n[i] * scale);
+		c = (c > 511) ? 511 : (c < -511) ? -511 : c;
+		packed |= ((uint32_t) c & 0x3FF) << (i * 10);
+	}
+	return packed;
+}
+
+static void
+pack_vertex (hikaru_packed_vertex_t *dst, hikaru_vertex_body_t *src)
+{
+	memset ((void *) dst, 0, sizeof (hikaru_packed_vertex_t));
+
+	VK_COPY_VEC3F (dst->position, src->position);
+	dst->normal = pack_normal (src->normal);
+	dst->texcoords[0] = float_to_half (src->texcoords[0]);
+	dst->texcoords[1] = float_to_half (src->texcoords[1]);
+	dst->alpha = src->alpha;
+}
+
+/* Strip and fan triangles share most of their vertices: the ppivot bit and
+ * the tmp[] rotation in push_vertices already tell us which vertex is which,
+ * so remember the output index of each temporary vertex and reuse it as long
+ * as its attributes (which can be patched by the texcoord pushes) did not
+ * change. */
+static uint16_t
+emit_vertex (hikaru_renderer_t *hr, unsigned slot)
+{
+	hikaru_packed_vertex_t packed;
+	uint32_t index = hr->push.tmp_index[slot];
+
+	pack_vertex (&packed, &hr->push.tmp[slot].body);
+
+	if (index != ~0 &&
+	    !memcmp ((void *) &packed, (void *) &hr->push.all[index], sizeof (packed)))
+		return index;
+
+	index = hr->push.num_out_verts++;
+	VK_ASSERT (index < MAX_VERTICES_PER_MESH);
+
+	hr->push.all[index] = packed;
+	hr->push.tmp_index[slot] = index;
+	return index;
+}
+
 static void
 add_triangle (hikaru_renderer_t *hr)
 {
 	if (hr->push.num_verts >= 3) {
-		uint32_t index = hr->push.num_tris * 3;
-		hikaru_vertex_body_t *dst = &hr->push.all[index];
+		hikaru_vertex_info_t info = hr->push.tmp[2].info;
+		unsigned range = info.nocull ? HR_INDICES_NOCULL : HR_INDICES_CULL;
+		uint16_t *dst = &hr->push.indices[range][hr->push.num_indices[range]];
 
-		VK_ASSERT ((index + 2) < MAX_VERTICES_PER_MESH);
+		VK_ASSERT ((hr->push.num_indices[range] + 2) < MAX_VERTICES_PER_MESH * 3);
 
-		if (hr->push.tmp[2].info.twosided &&
-		    !hr->push.tmp[2].info.nocull)
+		if (info.twosided && !info.nocull)
 			VK_ERROR ("got a vertex with culling and two-sided lighting!");
 
-		if (hr->push.tmp[2].info.twosided)
+		if (info.twosided)
 			hr->meshes.current->has_two_sided_lighting = 1;
 
-		if (hr->push.tmp[2].info.nocull) {
-			dst[0] = hr->push.tmp[0].body;
-			dst[1] = hr->push.tmp[2].body;
-			dst[2] = hr->push.tmp[1].body;
-			dst[3] = hr->push.tmp[0].body;
-			dst[4] = hr->push.tmp[1].body;
-			dst[5] = hr->push.tmp[2].body;
-			hr->push.num_tris += 1;
-		} else if (hr->push.tmp[2].info.winding) {
-			dst[0] = hr->push.tmp[0].body;
-			dst[1] = hr->push.tmp[2].body;
-			dst[2] = hr->push.tmp[1].body;
+		/* Double-sided triangles are drawn with culling disabled, so
+		 * their winding does not matter. */
+		dst[0] = emit_vertex (hr, 0);
+		if (info.winding && !info.nocull) {
+			dst[1] = emit_vertex (hr, 2);
+			dst[2] = emit_vertex (hr, 1);
 		} else {
-			dst[0] = hr->push.tmp[0].body;
-			dst[1] = hr->push.tmp[1].body;
-			dst[2] = hr->push.tmp[2].body;
+			dst[1] = emit_vertex (hr, 1);
+			dst[2] = emit_vertex (hr, 2);
 		}
-		hr->push.num_tris += 1;
+		hr->push.num_indices[range] += 3;
 	}
 }
 
@@ -1138,6 +1500,9 @@ hikaru_renderer_push_vertices (vk_renderer_t *rend,
 	    hr->debug.flags[HR_DEBUG_SELECT_VIEWPORT] != vp_index)
 		return;
 
+	/* Keep track of the attributes actually used by the mesh. */
+	hr->push.flags |= flags;
+
 	switch (num) {
 
 	case 1:
@@ -1154,14 +1519,18 @@ hikaru_renderer_push_vertices (vk_renderer_t *rend,
 		if (flags & HR_PUSH_POS) {
 
 			/* Do not change the pivot if it is not required */
-			if (!v->info.ppivot)
+			if (!v->info.ppivot) {
 				hr->push.tmp[0] = hr->push.tmp[1];
+				hr->push.tmp_index[0] = hr->push.tmp_index[1];
+			}
 			hr->push.tmp[1] = hr->push.tmp[2];
+			hr->push.tmp_index[1] = hr->push.tmp_index[2];
 			memset ((void *) &hr->push.tmp[2], 0, sizeof (hikaru_vertex_t));
+			hr->push.tmp_index[2] = ~0;
 
-			/* Set the position, colors and alpha. */
+			/* Set the position and alpha. */
 			VK_COPY_VEC3F (hr->push.tmp[2].body.position, v->body.position);
-			copy_colors (hr, &hr->push.tmp[2], v);
+			copy_alpha (hr, &hr->push.tmp[2], v);
 
 			/* Account for the added vertex. */
 			hr->push.num_verts += 1;
@@ -1225,6 +1594,7 @@ print_rendstate (hikaru_renderer_t *hr, hikaru_mesh_t *mesh, char *prefix)
 static void
 update_and_set_rendstate (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 {
+	static bool warned_lss = false;
 	hikaru_gpu_t *gpu = hr->gpu;
 	unsigned i;
 
@@ -1242,9 +1612,21 @@ update_and_set_rendstate (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	hr->tex_list[hr->num_texs++] = TEX0;
 	VK_ASSERT (hr->num_texs < MAX_TEXHEADS);
 
-	LOG ("RENDSTATE updating ls %u/%u", hr->num_lss, MAX_LIGHTSETS);
-	hr->ls_list[hr->num_lss++] = LS0;
-	VK_ASSERT (hr->num_lss < MAX_LIGHTSETS);
+	/* Lightsets rarely change between meshes, and they all end up in
+	 * the same per-frame table; don't store duplicates. Once the table
+	 * is full, meshes keep the last lightset stored. */
+	if (!hr->num_lss ||
+	    memcmp ((void *) &hr->ls_list[hr->num_lss - 1], (void *) &LS0,
+	            sizeof (hikaru_lightset_t))) {
+		LOG ("RENDSTATE updating ls %u/%u", hr->num_lss, hr->lightsets.max);
+		if (hr->num_lss < hr->lightsets.max)
+			hr->ls_list[hr->num_lss++] = LS0;
+		else if (!warned_lss) {
+			VK_ERROR ("too many lightsets in a frame, max is %u",
+			          hr->lightsets.max);
+			warned_lss = true;
+		}
+	}
 
 	/* Copy the per-instance modelviews from last to first. */
 	/* TODO optimize by setting MV.total to 0 (and fix the fallback). */
@@ -1284,20 +1666,110 @@ update_and_set_rendstate (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	print_rendstate (hr, mesh, "U");
 }
 
-#define OFFSET(member_) \
-	((const GLvoid *) offsetof (hikaru_vertex_body_t, member_))
+static unsigned
+get_layout_offsets (uint32_t layout, unsigned *nrm, unsigned *txc, unsigned *alpha)
+{
+	unsigned offs = sizeof (vec3f_t);
 
-#define VAP(loc_, num_, type_, member_, normalize_) \
-	if (loc_ != (GLuint) -1) { \
+	*nrm = *txc = *alpha = ~0;
+	if (layout & HR_LAYOUT_NRM) {
+		*nrm = offs;
+		offs += sizeof (uint32_t);
+	}
+	if (layout & HR_LAYOUT_TXC) {
+		*txc = offs;
+		offs += 2 * sizeof (uint16_t);
+	}
+	if (layout & HR_LAYOUT_ALPHA) {
+		*alpha = offs;
+		offs += sizeof (uint8_t);
+	}
+	return (offs + 3) & ~3;
+}
+
+#define VAP(loc_, num_, type_, offs_, normalize_) \
+	do { \
 		glVertexAttribPointer (loc_, num_, type_, normalize_, \
-		                       sizeof (hikaru_vertex_body_t), \
-		                       OFFSET (member_)); \
+		                       mesh->stride, \
+		                       (const GLvoid *) (uintptr_t) (offs_)); \
 		VK_ASSERT_NO_GL_ERROR (); \
 		\
 		glEnableVertexAttribArray (loc_); \
 		VK_ASSERT_NO_GL_ERROR (); \
+	} while (0)
+
+#define CONST_ATTRIB(loc_, x_, y_, z_, w_) \
+	do { \
+		glDisableVertexAttribArray (loc_); \
+		glVertexAttrib4f (loc_, x_, y_, z_, w_); \
+		VK_ASSERT_NO_GL_ERROR (); \
+	} while (0)
+
+static void
+set_vertex_attributes (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+{
+	hikaru_material_t *mat = &hr->mat_list[mesh->mat_index];
+	unsigned nrm, txc, alpha;
+
+	get_layout_offsets (mesh->layout, &nrm, &txc, &alpha);
+
+	VAP (0, 3, GL_FLOAT, 0, GL_FALSE);
+
+	if (nrm != ~0)
+		VAP (1, 4, GL_INT_2_10_10_10_REV, nrm, GL_TRUE);
+	else
+		CONST_ATTRIB (1, 0.0f, 0.0f, 0.0f, 0.0f);
+
+	if (txc != ~0)
+		VAP (6, 2, GL_HALF_FLOAT, txc, GL_FALSE);
+	else
+		CONST_ATTRIB (6, 0.0f, 0.0f, 0.0f, 0.0f);
+
+	if (alpha != ~0)
+		VAP (7, 1, GL_UNSIGNED_BYTE, alpha, GL_TRUE);
+	else
+		CONST_ATTRIB (7, 1.0f, 0.0f, 0.0f, 0.0f);
+
+	CONST_ATTRIB (2, mat->diffuse[0] * INV255,
+	                 mat->diffuse[1] * INV255,
+	                 mat->diffuse[2] * INV255, 1.0f);
+	CONST_ATTRIB (3, mat->ambient[0] * INV255,
+	                 mat->ambient[1] * INV255,
+	                 mat->ambient[2] * INV255, 1.0f);
+	CONST_ATTRIB (4, mat->specular[0] * INV255,
+	                 mat->specular[1] * INV255,
+	                 mat->specular[2] * INV255,
+	                 mat->specular[3] * INV255);
+	CONST_ATTRIB (5, mat->unknown[0] / 65535.0f,
+	                 mat->unknown[1] / 65535.0f,
+	                 mat->unknown[2] / 65535.0f, 1.0f);
+}
+
+#undef CONST_ATTRIB
+#undef VAP
+
+static void
+draw_triangles (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+{
+	uint32_t num_cull = mesh->num_indices[HR_INDICES_CULL];
+	uint32_t num_nocull = mesh->num_indices[HR_INDICES_NOCULL];
+
+	if (num_cull) {
+		glDrawElements (GL_TRIANGLES, num_cull, GL_UNSIGNED_SHORT,
+		                (const GLvoid *) 0);
+		hr->base.num_draw_calls++;
 	}
 
+	if (num_nocull) {
+		glDisable (GL_CULL_FACE);
+		glDrawElements (GL_TRIANGLES, num_nocull, GL_UNSIGNED_SHORT,
+		                (const GLvoid *) (num_cull * sizeof (uint16_t)));
+		glEnable (GL_CULL_FACE);
+		hr->base.num_draw_calls++;
+	}
+	VK_ASSERT_NO_GL_ERROR ();
+}
+
 static void
 draw_mesh (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 {
@@ -1306,8 +1778,11 @@ draw_mesh (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	VK_ASSERT (mesh);
 	VK_ASSERT (mesh->vbo);
 
-	LOG ("==== DRAWING MESH @%p (#vertices=%u #instances=%u) ====",
-	     mesh, mesh->num_tris * 3, mesh->num_instances);
+	LOG ("==== DRAWING MESH @%p (#vertices=%u #indices=%u+%u #instances=%u) ====",
+	     mesh, mesh->num_verts,
+	     mesh->num_indices[HR_INDICES_CULL],
+	     mesh->num_indices[HR_INDICES_NOCULL],
+	     mesh->num_instances);
 
 	print_rendstate (hr, mesh, "D");
 
@@ -1315,6 +1790,7 @@ draw_mesh (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	VK_ASSERT_NO_GL_ERROR ();
 
 	glBindBuffer (GL_ARRAY_BUFFER, mesh->vbo);
+	glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
 	VK_ASSERT_NO_GL_ERROR ();
 
 	upload_glsl_program (hr, mesh);
@@ -1326,14 +1802,7 @@ draw_mesh (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	VK_ASSERT_NO_GL_ERROR ();
 
 	/* We must do it here since locs are computed in upload_glsl_program. */
-	VAP (0, 3, GL_FLOAT,          position,  GL_FALSE);
-	VAP (1, 3, GL_FLOAT,          normal,    GL_FALSE);
-	VAP (2, 3, GL_UNSIGNED_BYTE,  diffuse,   GL_TRUE);
-	VAP (3, 3, GL_UNSIGNED_BYTE,  ambient,   GL_TRUE);
-	VAP (4, 4, GL_UNSIGNED_BYTE,  specular,  GL_TRUE);
-	VAP (5, 3, GL_UNSIGNED_SHORT, unknown,   GL_TRUE);
-	VAP (6, 2, GL_FLOAT,          texcoords, GL_FALSE);
-	VAP (7, 1, GL_UNSIGNED_BYTE,  alpha,     GL_TRUE);
+	set_vertex_attributes (hr, mesh);
 
 	glPolygonOffset (0.0f, -mesh->depth_bias);
 
@@ -1341,25 +1810,56 @@ draw_mesh (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 		unsigned i = MIN2 (hr->debug.flags[HR_DEBUG_SELECT_INSTANCE],
 		                   mesh->num_instances - 1);
 		upload_modelview (hr, mesh, i);
-		glDrawArrays (GL_TRIANGLES, 0, mesh->num_tris * 3);
+		draw_triangles (hr, mesh);
 	} else {
 		for (i = 0; i < mesh->num_instances; i++) {
 			upload_modelview (hr, mesh, i);
-			glDrawArrays (GL_TRIANGLES, 0, mesh->num_tris * 3);
+			draw_triangles (hr, mesh);
 		}
 	}
 
 	glBindVertexArray (0);
 }
 
-#undef OFFSET
+/* Squeeze the attributes the mesh does not use out of the push buffer. This
+ * is done in place: the packed stride is never larger than the full one. */
+static void
+compact_vertex_data (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+{
+	uint8_t *dst = (uint8_t *) hr->push.all;
+	unsigned nrm, txc, alpha, i;
+
+	mesh->stride = get_layout_offsets (mesh->layout, &nrm, &txc, &alpha);
+	if (mesh->stride == sizeof (hikaru_packed_vertex_t))
+		return;
+
+	for (i = 0; i < mesh->num_verts; i++, dst += mesh->stride) {
+		hikaru_packed_vertex_t src = hr->push.all[i];
+
+		memcpy (dst, src.position, sizeof (vec3f_t));
+		if (nrm != ~0)
+			memcpy (dst + nrm, &src.normal, sizeof (uint32_t));
+		if (txc != ~0)
+			memcpy (dst + txc, src.texcoords, 2 * sizeof (uint16_t));
+		if (alpha != ~0)
+			dst[alpha] = src.alpha;
+	}
+}
 
 static void
 upload_vertex_data (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 {
 	VK_ASSERT (mesh);
 
-	mesh->num_tris = hr->push.num_tris;
+	mesh->num_verts = hr->push.num_out_verts;
+	mesh->num_indices[HR_INDICES_CULL] = hr->push.num_indices[HR_INDICES_CULL];
+	mesh->num_indices[HR_INDICES_NOCULL] = hr->push.num_indices[HR_INDICES_NOCULL];
+	mesh->layout |= hr->push.flags & (HR_LAYOUT_NRM | HR_LAYOUT_TXC);
+
+	compact_vertex_data (hr, mesh);
+
+	if (hr->base.headless)
+		return;
 
 	/* Generate the VAO if required. */
 	if (!hr->meshes.vao) {
@@ -1377,9 +1877,25 @@ upload_vertex_data (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	/* Upload the vertex data to the VBO. */
 	glBindBuffer (GL_ARRAY_BUFFER, mesh->vbo);
 	glBufferData (GL_ARRAY_BUFFER,
-	              sizeof (hikaru_vertex_body_t) * mesh->num_tris * 3,
+	              mesh->stride * mesh->num_verts,
 	              (const GLvoid *) hr->push.all, GL_DYNAMIC_DRAW);
 	VK_ASSERT_NO_GL_ERROR ();
+
+	/* Upload both index ranges, culled first, to the IBO. */
+	glGenBuffers (1, &mesh->ibo);
+	glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+	glBufferData (GL_ELEMENT_ARRAY_BUFFER,
+	              sizeof (uint16_t) * (mesh->num_indices[HR_INDICES_CULL] +
+	                                   mesh->num_indices[HR_INDICES_NOCULL]),
+	              NULL, GL_DYNAMIC_DRAW);
+	glBufferSubData (GL_ELEMENT_ARRAY_BUFFER, 0,
+	                 sizeof (uint16_t) * mesh->num_indices[HR_INDICES_CULL],
+	                 (const GLvoid *) hr->push.indices[HR_INDICES_CULL]);
+	glBufferSubData (GL_ELEMENT_ARRAY_BUFFER,
+	                 sizeof (uint16_t) * mesh->num_indices[HR_INDICES_CULL],
+	                 sizeof (uint16_t) * mesh->num_indices[HR_INDICES_NOCULL],
+	                 (const GLvoid *) hr->push.indices[HR_INDICES_NOCULL]);
+	VK_ASSERT_NO_GL_ERROR ();
 }
 
 void
@@ -1410,9 +1926,19 @@ hikaru_renderer_begin_mesh (vk_renderer_t *rend, uint32_t addr,
 	update_and_set_rendstate (hr, mesh);
 	mesh->addr[0] = addr;
 
+	/* Only translucent meshes carry per-vertex alpha. */
+	if (polytype == HIKARU_POLYTYPE_TRANSLUCENT)
+		mesh->layout = HR_LAYOUT_ALPHA;
+
 	/* Clear the push buffer. */
 	hr->push.num_verts = 0;
-	hr->push.num_tris = 0;
+	hr->push.num_out_verts = 0;
+	hr->push.num_indices[HR_INDICES_CULL] = 0;
+	hr->push.num_indices[HR_INDICES_NOCULL] = 0;
+	hr->push.flags = 0;
+	hr->push.tmp_index[0] = ~0;
+	hr->push.tmp_index[1] = ~0;
+	hr->push.tmp_index[2] = ~0;
 }
 
 void
@@ -1452,8 +1978,13 @@ draw_meshes_for_polytype (hikaru_renderer_t *hr, unsigned vpi, int polytype)
 	LOG (" ==== DRAWING VP %u, POLYTYPE %d ====", vpi, polytype);
 
 	switch (polytype) {
-	case HIKARU_POLYTYPE_TRANSPARENT:
 	case HIKARU_POLYTYPE_TRANSLUCENT:
+		if (!hr->debug.flags[HR_DEBUG_NO_OIT]) {
+			begin_oit (hr);
+			break;
+		}
+		/* fall-through */
+	case HIKARU_POLYTYPE_TRANSPARENT:
 		glEnable (GL_BLEND);
 		glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 		glDepthMask (GL_FALSE);
@@ -1477,11 +2008,16 @@ draw_meshes_for_polytype (hikaru_renderer_t *hr, unsigned vpi, int polytype)
 		draw_mesh (hr, mesh);
 	}
 
+	if (hr->oit.active)
+		end_oit (hr);
+
 destroy_meshes:
 	for (j = 0; j < num; j++) {
 		hikaru_mesh_t *mesh = &meshes[j];
 		if (mesh->vbo)
 			glDeleteBuffers (1, &mesh->vbo);
+		if (mesh->ibo)
+			glDeleteBuffers (1, &mesh->ibo);
 	}
 }
 
@@ -1520,6 +2056,8 @@ draw_scene (hikaru_renderer_t *hr)
 	glEnable (GL_CULL_FACE);
 	glCullFace (GL_BACK);
 
+	upload_lightsets (hr);
+
 	for (vpi = 0; vpi < 8; vpi++) {
 		glDepthMask (GL_TRUE);
 		glClear (GL_DEPTH_BUFFER_BIT);
@@ -1548,6 +2086,9 @@ destroy_3d_state (hikaru_renderer_t *hr)
 		for (i = 0; i < 8; i++)
 			free (hr->mesh_list[vpi][i]);
 
+	if (hr->base.headless)
+		return;
+
 	vk_renderer_destroy_program (hr->meshes.program);
 	VK_ASSERT_NO_GL_ERROR ();
 
@@ -1555,12 +2096,16 @@ destroy_3d_state (hikaru_renderer_t *hr)
 		glBindVertexArray (0);
 		glDeleteVertexArrays (1, &hr->meshes.vao);
 	}
+
+	glDeleteTextures (1, &hr->lightsets.texture);
+	glDeleteBuffers (1, &hr->lightsets.buffer);
 }
 
 static int
 build_3d_state (hikaru_renderer_t *hr)
 {
 	unsigned vpi, i;
+	GLint max_texels;
 
 	hr->vp_list = (hikaru_viewport_t *)
 			malloc (sizeof (hikaru_viewport_t) * MAX_VIEWPORTS);
@@ -1585,6 +2130,19 @@ build_3d_state (hikaru_renderer_t *hr)
 		}
 	}
 
+	hr->lightsets.max = MAX_LIGHTSETS;
+	if (hr->base.headless)
+		return 0;
+
+	/* Don't upload more lightsets than the texture buffer can hold. */
+	glGetIntegerv (GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+	hr->lightsets.max = MIN2 (MAX_LIGHTSETS,
+	                          max_texels / (4 * TEXELS_PER_LIGHT));
+
+	glGenBuffers (1, &hr->lightsets.buffer);
+	glGenTextures (1, &hr->lightsets.texture);
+	VK_ASSERT_NO_GL_ERROR ();
+
 	return 0;
 }
 
@@ -1852,6 +2410,9 @@ upload_layer (hikaru_renderer_t *hr, hikaru_layer_t *layer, GLuint *id, float *m
 
 /* TODO make use of the framebuffer configuration in the GPU:1A registers,
  * right now it only uses the information in the 781/181 commands. */
+static vk_profiler_section_t prof_layers = VK_PROFILER_SECTION ("upload_layer");
+static vk_profiler_section_t prof_scene = VK_PROFILER_SECTION ("draw_scene");
+
 static void
 draw (hikaru_renderer_t *hr)
 {
@@ -1875,6 +2436,8 @@ draw (hikaru_renderer_t *hr)
 
 	/* We only care about unit 0 for now. (Unit 1 is probably only used
 	 * for the dual-monitor case.) */
+	vk_profiler_enter (&prof_layers);
+
 	if ((LAYERS.layer[0][0].enabled || n1 == 2 || n2 == 2) &&
 	    !hr->debug.flags[HR_DEBUG_NO_LAYER1])
 		upload_layer (hr, &LAYERS.layer[0][0], &layer1, &mult1);
@@ -1883,12 +2446,18 @@ draw (hikaru_renderer_t *hr)
 	    !hr->debug.flags[HR_DEBUG_NO_LAYER2])
 		upload_layer (hr, &LAYERS.layer[0][1], &layer2, &mult2);
 
+	vk_profiler_leave (&prof_layers);
+
 
-	/* Draw the 3D scene to the front buffer. */
-	glBindFramebuffer (GL_FRAMEBUFFER, f);
+	/* Draw the 3D scene to the front buffer. Only the two GPU
+	 * framebuffers have an FBO; the layers are plain textures. */
+	hr->oit.target = (n1 < 2) ? hr->framebuffer.fb[n1] : 0;
+	glBindFramebuffer (GL_FRAMEBUFFER, hr->oit.target);
 	VK_ASSERT_NO_GL_ERROR ();
 
+	vk_profiler_enter (&prof_scene);
 	draw_scene (hr);
+	vk_profiler_leave (&prof_scene);
 	VK_ASSERT_NO_GL_ERROR ();
 
 	glBindFramebuffer (GL_FRAMEBUFFER, 0);
@@ -1951,6 +2520,7 @@ draw (hikaru_renderer_t *hr)
 
 	glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
 	VK_ASSERT_NO_GL_ERROR ();
+	hr->base.num_draw_calls++;
 
 	glBindVertexArray (0);
 	glUseProgram (0);
@@ -1991,7 +2561,31 @@ hikaru_renderer_begin_frame (vk_renderer_t *renderer)
 
 	update_debug_flags (hr);
 
-	VK_ASSERT_NO_GL_ERROR ();
+	if (!hr->base.headless)
+		VK_ASSERT_NO_GL_ERROR ();
+}
+
+/* Headless counterpart of the texture binds in draw (): decodes (and
+ * caches) the textures of the frame's meshes. */
+static void
+decode_textures (hikaru_renderer_t *hr)
+{
+	unsigned vpi, i, j;
+
+	if (hr->debug.flags[HR_DEBUG_NO_3D] ||
+	    hr->debug.flags[HR_DEBUG_NO_TEXTURES])
+		return;
+
+	for (vpi = 0; vpi < 8; vpi++)
+		for (i = 0; i < 8; i++)
+			for (j = 0; j < hr->num_meshes[vpi][i]; j++) {
+				hikaru_mesh_t *mesh = &hr->mesh_list[vpi][i][j];
+
+				if (mesh->mat_index == ~0 || mesh->tex_index == ~0 ||
+				    !hr->mat_list[mesh->mat_index].has_texture)
+					continue;
+				get_texture (hr, &hr->tex_list[mesh->tex_index]);
+			}
 }
 
 static void
@@ -1999,10 +2593,16 @@ hikaru_renderer_end_frame (vk_renderer_t *renderer)
 {
 	hikaru_renderer_t *hr = (hikaru_renderer_t *) renderer;
 
-	VK_ASSERT_NO_GL_ERROR ();
+	/* Headless: the frame's meshes have been built, and their textures
+	 * decoded, but they are never drawn. */
+	if (hr->base.headless)
+		decode_textures (hr);
+	else {
+		VK_ASSERT_NO_GL_ERROR ();
 
-	draw (hr);
-	VK_ASSERT_NO_GL_ERROR ();
+		draw (hr);
+		VK_ASSERT_NO_GL_ERROR ();
+	}
 
 	LOG (" ==== RENDSTATE STATISTICS ==== ");
 	LOG ("  vp  : %u", hr->num_vps);
@@ -2025,7 +2625,10 @@ hikaru_renderer_destroy (vk_renderer_t **renderer_)
 		hikaru_renderer_t *hr = (hikaru_renderer_t *) *renderer_;
 
 		destroy_3d_state (hr);
-		destroy_fb_state (hr);
+		if (!hr->base.headless) {
+			destroy_oit_state (hr);
+			destroy_fb_state (hr);
+		}
 
 		hikaru_renderer_invalidate_texcache (*renderer_, NULL);
 	}
@@ -2053,21 +2656,29 @@ hikaru_renderer_new (vk_buffer_t *fb, vk_buffer_t *texram[2])
 	if (ret)
 		goto fail;
 
-	VK_ASSERT_NO_GL_ERROR ();
+	init_debug_flags (hr);
 
 	memset ((void *) program_cache, 0, sizeof (program_cache));
 	num_programs = 0;
 
-	init_debug_flags (hr);
-
 	if (build_3d_state (hr))
 		goto fail;
+
+	/* Headless renderers still build meshes, but have no use for the
+	 * GL state needed to draw them. */
+	if (hr->base.headless)
+		return (vk_renderer_t *) hr;
+
 	VK_ASSERT_NO_GL_ERROR ();
 
 	if (build_fb_state (hr))
 		goto fail;
 	VK_ASSERT_NO_GL_ERROR ();
 
+	if (build_oit_state (hr))
+		goto fail;
+	VK_ASSERT_NO_GL_ERROR ();
+
 	return (vk_renderer_t *) hr;
 
 fail:
@@ -133,6 +133,7 @@
 
 #include "vk/core.h"
 #include "vk/games.h"
+#include "vk/profiler.h"
 
 #include "cpu/sh/sh4.h"
 
@@ -433,6 +434,9 @@ hikaru_raise_memctl_irq (vk_machine_t *mach)
  * a little more bearable. */
 static const unsigned cycles_per_line = (50 * MHZ) / (60 * 480);
 
+static vk_profiler_section_t prof_sh4_m = VK_PROFILER_SECTION ("sh4_run/M");
+static vk_profiler_section_t prof_sh4_s = VK_PROFILER_SECTION ("sh4_run/S");
+
 static void
 hikaru_run_cycles (vk_machine_t *mach, int cycles)
 {
@@ -440,11 +444,15 @@ hikaru_run_cycles (vk_machine_t *mach, int cycles)
 
 	/* Run the master */
 	hikaru->sh_current = hikaru->sh_m;
+	vk_profiler_enter (&prof_sh4_m);
 	vk_cpu_run (hikaru->sh_m, cycles);
+	vk_profiler_leave (&prof_sh4_m);
 
 	/* Run the slave */
 	hikaru->sh_current = hikaru->sh_s;
+	vk_profiler_enter (&prof_sh4_s);
 	vk_cpu_run (hikaru->sh_s, cycles);
+	vk_profiler_leave (&prof_sh4_s);
 
 	/* Run the MEMCTL and GPU */
 	vk_device_exec (hikaru->memctl_m, cycles);
@@ -526,6 +534,38 @@ hikaru_get_debug_string (vk_machine_t *mach)
 	return out;
 }
 
+static void
+hikaru_print_stats (vk_machine_t *mach, FILE *fp, double secs)
+{
+	hikaru_t *hikaru = (hikaru_t *) mach;
+
+	fprintf (fp, "sh4_m.insns=%lu\n", hikaru->sh_m->executed);
+	fprintf (fp, "sh4_m.ips=%.0f\n", hikaru->sh_m->executed / secs);
+	fprintf (fp, "sh4_s.insns=%lu\n", hikaru->sh_s->executed);
+	fprintf (fp, "sh4_s.ips=%.0f\n", hikaru->sh_s->executed / secs);
+	hikaru_gpu_print_stats (hikaru->gpu, fp, secs);
+}
+
+static void
+hikaru_print_mmap_stats (vk_machine_t *mach, FILE *fp)
+{
+	hikaru_t *hikaru = (hikaru_t *) mach;
+
+	fprintf (fp, "master memory accesses:\n");
+	vk_mmap_print_stats (hikaru->mmap_m, fp);
+	fprintf (fp, "slave memory accesses:\n");
+	vk_mmap_print_stats (hikaru->mmap_s, fp);
+}
+
+static void
+hikaru_reset_mmap_stats (vk_machine_t *mach)
+{
+	hikaru_t *hikaru = (hikaru_t *) mach;
+
+	vk_mmap_reset_stats (hikaru->mmap_m);
+	vk_mmap_reset_stats (hikaru->mmap_s);
+}
+
 #define SAVE(thing_) \
 		vk_state_put (state, (void *) &(thing_), sizeof (thing_))
 
@@ -740,6 +780,8 @@ hikaru_set_rombd_config (hikaru_t *hikaru)
 		has_rom = false;
 		hikaru->eprom = NULL;
 		hikaru->maskrom = NULL;
+		hikaru->eprom_pager = NULL;
+		hikaru->maskrom_pager = NULL;
 	} else if (!strcmp (game->name, "airtrix")) {
 		eprom_bank_size = 4;
 		maskrom_bank_size = 16;
@@ -917,16 +959,16 @@ hikaru_init (hikaru_t *hikaru)
 	unk_m.mach = mach;
 	unk_s.mach = mach;
 
-	hikaru->ram_m		= vk_buffer_le32_new (32*MB, 0);
-	hikaru->ram_s		= vk_buffer_le32_new (32*MB, 0);
-	hikaru->cmdram		= vk_buffer_le32_new (4*MB, 0);
-	hikaru->fb		= vk_buffer_le32_new (8*MB, 0);
-	hikaru->texram[0]	= vk_buffer_le32_new (4*MB, 0);
-	hikaru->texram[1]	= vk_buffer_le32_new (4*MB, 0);
-	hikaru->aica_ram_m	= vk_buffer_le32_new (8*MB, 0);
-	hikaru->aica_ram_s	= vk_buffer_le32_new (8*MB, 0);
+	hikaru->ram_m		= vk_buffer_new_ram (32*MB);
+	hikaru->ram_s		= vk_buffer_new_ram (32*MB);
+	hikaru->cmdram		= vk_buffer_new_ram (4*MB);
+	hikaru->fb		= vk_buffer_new_ram (8*MB);
+	hikaru->texram[0]	= vk_buffer_new_ram (4*MB);
+	hikaru->texram[1]	= vk_buffer_new_ram (4*MB);
+	hikaru->aica_ram_m	= vk_buffer_new_ram (8*MB);
+	hikaru->aica_ram_s	= vk_buffer_new_ram (8*MB);
 	hikaru->mie_ram		= vk_buffer_le32_new (32*KB, 0);
-	hikaru->bram		= vk_buffer_le32_new (64*KB, 0);
+	hikaru->bram		= vk_buffer_new_ram (64*KB);
 
 	if (!hikaru->ram_m || !hikaru->ram_s ||
 	    !hikaru->cmdram || !hikaru->fb ||
@@ -952,6 +994,8 @@ hikaru_init (hikaru_t *hikaru)
 		hikaru->bootrom 	= vk_game_get_section_data (game, "bootrom");
 		hikaru->eprom   	= vk_game_get_section_data (game, "eprom");
 		hikaru->maskrom 	= vk_game_get_section_data (game, "maskrom");
+		hikaru->eprom_pager	= vk_game_get_section_pager (game, "eprom");
+		hikaru->maskrom_pager	= vk_game_get_section_pager (game, "maskrom");
 
 		/* Patch theBOOTROM  EEPROM check. Allows games to load. */
 		VK_PRINT ("patching BOOTROM");
@@ -971,7 +1015,16 @@ hikaru_init (hikaru_t *hikaru)
 			return -1;
 	} else {
 		/* Create a mock bootrom */                                     
-		hikaru->bootrom = vk_buffer_le32_new (2*MB, 0);
+		hikaru->bootrom = vk_buffer_new_ram (2*MB);
+	}
+
+	/* Fastmem can only map RAM buffers, so copy the BOOTROM into one. */
+	if (vk_mmap_fastmem && hikaru->bootrom && hikaru->bootrom->fd < 0) {
+		vk_buffer_t *bootrom = vk_buffer_new_ram (hikaru->bootrom->size);
+		if (!bootrom)
+			return -1;
+		memcpy (bootrom->ptr, hikaru->bootrom->ptr, bootrom->size);
+		hikaru->bootrom = bootrom;
 	}
 
 	hikaru->memctl_m = hikaru_memctl_new (mach, true);
@@ -1011,6 +1064,12 @@ hikaru_init (hikaru_t *hikaru)
 	if (!hikaru->mmap_m || !hikaru->mmap_s)
 		return -1;
 
+	/* The SH-4 P0-P3 areas mirror the 29-bit external address space. */
+	if (vk_mmap_fastmem &&
+	    (vk_mmap_enable_fastmem (hikaru->mmap_m, 0x20000000, 7) ||
+	     vk_mmap_enable_fastmem (hikaru->mmap_s, 0x20000000, 7)))
+		return -1;
+
 	hikaru->sh_m = sh4_new (mach, hikaru->mmap_m, true, true);
 	hikaru->sh_s = sh4_new (mach, hikaru->mmap_s, false, true);
 
@@ -1046,6 +1105,9 @@ hikaru_new (vk_game_t *game)
 	mach->load_state	= hikaru_load_state;
 	mach->save_state	= hikaru_save_state;
 	mach->get_debug_string	= hikaru_get_debug_string;
+	mach->print_stats	= hikaru_print_stats;
+	mach->print_mmap_stats	= hikaru_print_mmap_stats;
+	mach->reset_mmap_stats	= hikaru_reset_mmap_stats;
 
 	if (hikaru_init (hikaru))
 		hikaru_destroy (&mach);
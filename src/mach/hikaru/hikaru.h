@@ -22,6 +22,7 @@
 #include "vk/mmap.h"
 #include "vk/cpu.h"
 #include "vk/machine.h"
+#include "vk/pager.h"
 
 typedef struct {
 	bool has_rom;
@@ -80,10 +81,13 @@ typedef struct {
 	vk_buffer_t *mie_ram;
 	vk_buffer_t *bram;
 
-	/* ROM data */
+	/* ROM data; the EPROM and MASKROM are either buffers or, if loaded
+	 * lazily, pagers */
 	vk_buffer_t *bootrom;
 	vk_buffer_t *eprom;
 	vk_buffer_t *maskrom;
+	vk_pager_t *eprom_pager;
+	vk_pager_t *maskrom_pager;
 
 	/* ROMBD configuration */
 	hikaru_rombd_config_t rombd_config;
@@ -0,0 +1,458 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks for the emulator hot paths. None of them require game
+ * ROMs: each benchmark builds just the components it exercises. Each one
+ * is run once to warm up, then NUM_REPS times; the best and median times
+ * per operation are reported. */
+
+#include "vk/core.h"
+#include "vk/buffer.h"
+#include "vk/vector.h"
+#include "vk/mmap.h"
+#include "vk/cpu.h"
+#include "vk/profiler.h"
+
+#include "cpu/sh/sh4.h"
+
+#include "mach/hikaru/hikaru.h"
+#include "mach/hikaru/hikaru-memctl.h"
+#include "mach/hikaru/hikaru-gpu.h"
+#include "mach/hikaru/hikaru-gpu-private.h"
+
+#define NUM_REPS	7
+
+unsigned vk_verbosity = 0;
+
+static volatile uint64_t sink;
+
+typedef struct {
+	const char *name;
+	/* Performs num operations, returns the number actually performed. */
+	uint64_t (* run) (void *ctx, uint64_t num);
+	uint64_t num;
+	void *ctx;
+} bench_t;
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static void
+run_bench (bench_t *bench)
+{
+	uint64_t times[NUM_REPS], ops = 0;
+	unsigned i;
+
+	bench->run (bench->ctx, bench->num);
+
+	for (i = 0; i < NUM_REPS; i++) {
+		uint64_t start = vk_profiler_get_time ();
+		ops = bench->run (bench->ctx, bench->num);
+		times[i] = vk_profiler_get_time () - start;
+	}
+
+	qsort (times, NUM_REPS, sizeof (uint64_t), compare_u64);
+
+	printf ("%-32s %12.2f ns/op (median %.2f) x %lu\n", bench->name,
+	        (double) times[0] / ops,
+	        (double) times[NUM_REPS / 2] / ops, ops);
+}
+
+/****************************************************************************
+ Buffers and vectors
+****************************************************************************/
+
+static uint64_t
+bench_buffer_get32 (void *ctx, uint64_t num)
+{
+	vk_buffer_t *buf = (vk_buffer_t *) ctx;
+	uint32_t mask = vk_buffer_get_size (buf) - 4;
+	uint64_t i, acc = 0;
+
+	for (i = 0; i < num; i++)
+		acc += vk_buffer_get (buf, 4, (i * 4) & mask);
+	sink = acc;
+	return num;
+}
+
+static uint64_t
+bench_buffer_put32 (void *ctx, uint64_t num)
+{
+	vk_buffer_t *buf = (vk_buffer_t *) ctx;
+	uint32_t mask = vk_buffer_get_size (buf) - 4;
+	uint64_t i;
+
+	for (i = 0; i < num; i++)
+		vk_buffer_put (buf, 4, (i * 4) & mask, i);
+	return num;
+}
+
+/* Dependent random reads over a RAM-sized (zeroed) buffer, bound by TLB
+ * and cache misses. */
+static uint64_t
+bench_buffer_get32_random (void *ctx, uint64_t num)
+{
+	vk_buffer_t *buf = (vk_buffer_t *) ctx;
+	uint32_t mask = vk_buffer_get_size (buf) - 4, offs = 0;
+	uint64_t i;
+
+	for (i = 0; i < num; i++) {
+		offs = offs * 1664525 + 1013904223;
+		offs += vk_buffer_get32_fast (buf, (offs >> 4) & mask & ~3);
+	}
+	sink = offs;
+	return num;
+}
+
+static uint64_t
+bench_vector_append (void *ctx, uint64_t num)
+{
+	vk_vector_t *vector = (vk_vector_t *) ctx;
+	uint64_t i;
+
+	for (i = 0; i < num; i++) {
+		if ((i & 0xFFF) == 0)
+			vk_vector_clear_fast (vector);
+		*(uint32_t *) vk_vector_append_entry (vector) = i;
+	}
+	return num;
+}
+
+/****************************************************************************
+ Memory maps
+****************************************************************************/
+
+typedef struct {
+	vk_device_t base;
+	uint32_t reg;
+} dummy_dev_t;
+
+static int
+dummy_get (vk_device_t *dev, unsigned size, uint32_t addr, void *val)
+{
+	return set_ptr (val, size, ((dummy_dev_t *) dev)->reg);
+}
+
+static int
+dummy_put (vk_device_t *dev, unsigned size, uint32_t addr, uint64_t val)
+{
+	((dummy_dev_t *) dev)->reg = val;
+	return 0;
+}
+
+typedef struct {
+	vk_mmap_t *mmap;
+	uint32_t base;
+} mmap_ctx_t;
+
+static uint64_t
+bench_mmap_get32 (void *ctx, uint64_t num)
+{
+	mmap_ctx_t *mctx = (mmap_ctx_t *) ctx;
+	uint64_t i, acc = 0;
+	uint32_t val;
+
+	for (i = 0; i < num; i++) {
+		vk_mmap_get (mctx->mmap, 4, mctx->base + ((i * 4) & 0xFFFC), &val);
+		acc += val;
+	}
+	sink = acc;
+	return num;
+}
+
+static uint64_t
+bench_mmap_put32 (void *ctx, uint64_t num)
+{
+	mmap_ctx_t *mctx = (mmap_ctx_t *) ctx;
+	uint64_t i;
+
+	for (i = 0; i < num; i++)
+		vk_mmap_put (mctx->mmap, 4, mctx->base + ((i * 4) & 0xFFFC), i);
+	return num;
+}
+
+/* Eight 1 MB RAM regions, followed by a device region; the position of the
+ * accessed region determines the cost of the region lookup. */
+static vk_mmap_t *
+build_mmap (vk_machine_t *mach)
+{
+	vk_mmap_t *mmap = vk_mmap_new (mach);
+	dummy_dev_t *dummy;
+	unsigned i;
+
+	VK_ASSERT (mmap);
+
+	for (i = 0; i < 8; i++) {
+		vk_buffer_t *buf = vk_buffer_le32_new (1*MB, 0);
+		char name[16];
+
+		VK_ASSERT (buf);
+		vk_machine_register_buffer (mach, buf);
+
+		sprintf (name, "RAM%u", i);
+		vk_mmap_add_ram (mmap, i * 0x01000000, i * 0x01000000 + 0xFFFFF,
+		                 0xFFFFF, VK_REGION_RW, buf, name);
+	}
+
+	VK_DEVICE_ALLOC (dummy, mach);
+	VK_ASSERT (dummy);
+	dummy->base.get = dummy_get;
+	dummy->base.put = dummy_put;
+
+	vk_mmap_add_dev (mmap, 0x10000000, 0x1000FFFF, 0xFFFF,
+	                 VK_REGION_RW | VK_REGION_SIZE_ALL,
+	                 (vk_device_t *) dummy, "DEV");
+	return mmap;
+}
+
+/****************************************************************************
+ SH-4
+****************************************************************************/
+
+/* A tight loop of ALU instructions and a delayed branch:
+ *
+ *  00: ADD  #1,R0
+ *  02: ADD  #1,R1
+ *  04: MOV  R0,R2
+ *  06: BRA  00
+ *  08: NOP
+ */
+static const uint16_t sh4_code[] = {
+	0x7001, 0x7101, 0x6203, 0xAFFB, 0x0009
+};
+
+static uint64_t
+bench_sh4_run (void *ctx, uint64_t num)
+{
+	vk_cpu_t *cpu = (vk_cpu_t *) ctx;
+	uint64_t executed = cpu->executed;
+
+	vk_cpu_run (cpu, num);
+	return cpu->executed - executed;
+}
+
+/* With fastmem, instruction fetches go through the window. Returns NULL if
+ * the host can't set up the fastmem window. */
+static vk_cpu_t *
+build_sh4 (vk_machine_t *mach, bool fastmem)
+{
+	vk_buffer_t *ram;
+	vk_mmap_t *mmap = vk_mmap_new (mach);
+	vk_cpu_t *cpu;
+	unsigned i;
+
+	vk_buffer_ram_shared = fastmem;
+	ram = vk_buffer_new_ram (1*MB);
+	vk_buffer_ram_shared = false;
+
+	VK_ASSERT (ram && mmap);
+	vk_machine_register_buffer (mach, ram);
+
+	vk_mmap_add_ram (mmap, 0x00000000, 0x000FFFFF, 0xFFFFF,
+	                 VK_REGION_RW, ram, "RAM");
+	if (fastmem && vk_mmap_enable_fastmem (mmap, 0x20000000, 7)) {
+		vk_mmap_destroy (&mmap);
+		return NULL;
+	}
+
+	cpu = sh4_new (mach, mmap, true, true);
+	VK_ASSERT (cpu);
+
+	vk_device_reset ((vk_device_t *) cpu, VK_RESET_TYPE_HARD);
+
+	for (i = 0; i < NUMELEM (sh4_code); i++)
+		vk_buffer_put (ram, 2, i * 2, sh4_code[i]);
+	return cpu;
+}
+
+/****************************************************************************
+ Hikaru textures
+****************************************************************************/
+
+static uint64_t
+bench_texram_put (void *ctx, uint64_t num)
+{
+	hikaru_t *hikaru = (hikaru_t *) ctx;
+	uint64_t i;
+
+	/* MEMCTL bank 0x02 is mapped to TEXRAM bank 0, see build_hikaru. */
+	for (i = 0; i < num; i++)
+		vk_device_put (hikaru->memctl_m, 4,
+		               0x02000000 + ((i * 4) & 0x3FFFFC), i);
+	return num;
+}
+
+/* A MEMCTL DMA from RAM/S to TEXRAM bank 0, stopped one word short of
+ * completion, so that no IRQ is raised. */
+static uint64_t
+bench_texram_dma (void *ctx, uint64_t num)
+{
+	hikaru_t *hikaru = (hikaru_t *) ctx;
+
+	vk_device_put (hikaru->memctl_m, 4, 0x04000030, 0x40000000);
+	vk_device_put (hikaru->memctl_m, 4, 0x04000034, 0x04000000);
+	vk_device_put (hikaru->memctl_m, 4, 0x04000038, 0x01000000 | (num + 1));
+	vk_device_exec (hikaru->memctl_m, num);
+	return num;
+}
+
+/* Copies a 512x512 FB rectangle down and to the right, overlapping. */
+static uint64_t
+bench_gpu_dma (void *ctx, uint64_t num)
+{
+	hikaru_t *hikaru = (hikaru_t *) ctx;
+	hikaru_gpu_t *gpu = (hikaru_gpu_t *) hikaru->gpu;
+	uint64_t i;
+
+	for (i = 0; i < num; i++) {
+		vk_device_put (hikaru->gpu, 4, 0x1A040000, (16 << 11) | 16);
+		vk_device_put (hikaru->gpu, 4, 0x1A040004, (32 << 11) | 24);
+		vk_device_put (hikaru->gpu, 4, 0x1A040008, (512 << 16) | 512);
+		vk_device_put (hikaru->gpu, 4, 0x1A04000C, 1);
+		while (REG1ADMA (0xC) & 1)
+			vk_device_exec (hikaru->gpu, 1000000);
+	}
+	return num * 512 * 512;
+}
+
+static uint64_t
+bench_copy_level (void *ctx, uint64_t num)
+{
+	hikaru_t *hikaru = (hikaru_t *) ctx;
+	uint64_t i;
+
+	for (i = 0; i < num; i++)
+		hikaru_gpu_copy_level (hikaru->ram_s, hikaru->texram[0], 0,
+		                       0x80, 0xC0, 256, 256);
+	return num * 256 * 256;
+}
+
+static uint64_t
+bench_decode_abgr1111 (void *ctx, uint64_t num)
+{
+	hikaru_t *hikaru = (hikaru_t *) ctx;
+	uint64_t i;
+
+	for (i = 0; i < num; i++) {
+		void *data = hikaru_renderer_decode_texture_abgr1111 (
+			hikaru->texram[0], 256, 256, 0x80, 0xC0);
+		VK_ASSERT (data);
+		free (data);
+	}
+	return num * 256 * 256 * 2;
+}
+
+/* Only the components the benchmarks touch: memory, the MEMCTL (for the
+ * TEXRAM write path) and the GPU (which it queries for the TEXRAM
+ * layout). There is no renderer. */
+static hikaru_t *
+build_hikaru (void)
+{
+	hikaru_t *hikaru = ALLOC (hikaru_t);
+	vk_machine_t *mach = (vk_machine_t *) hikaru;
+
+	VK_ASSERT (hikaru);
+
+	hikaru->ram_s		= vk_buffer_le32_new (32*MB, 0);
+	hikaru->cmdram		= vk_buffer_le32_new (4*MB, 0);
+	hikaru->texram[0]	= vk_buffer_le32_new (4*MB, 0);
+	hikaru->texram[1]	= vk_buffer_le32_new (4*MB, 0);
+	hikaru->fb		= vk_buffer_le32_new (8*MB, 0);
+
+	VK_ASSERT (hikaru->ram_s && hikaru->cmdram && hikaru->fb &&
+	           hikaru->texram[0] && hikaru->texram[1]);
+
+	hikaru->gpu = hikaru_gpu_new (mach, hikaru->cmdram, hikaru->fb,
+	                              hikaru->texram, NULL);
+	hikaru->memctl_m = hikaru_memctl_new (mach, true);
+	VK_ASSERT (hikaru->gpu && hikaru->memctl_m);
+
+	vk_device_put (hikaru->memctl_m, 1, 0x0400001A, 0x04);
+	return hikaru;
+}
+
+int
+main (int argc, char **argv)
+{
+	vk_machine_t *mach = ALLOC (vk_machine_t);
+	mmap_ctx_t mmap_first, mmap_last, mmap_dev;
+	vk_buffer_t *buf, *heap_ram, *ram;
+	vk_vector_t *vector;
+	hikaru_t *hikaru;
+	unsigned i;
+
+	VK_ASSERT (mach);
+
+	buf = vk_buffer_le32_new (1*MB, 0);
+	vector = vk_vector_new (16, sizeof (uint32_t));
+	heap_ram = vk_buffer_le32_new (64*MB, 0);
+	ram = vk_buffer_new_ram (64*MB);
+	VK_ASSERT (buf && vector && heap_ram && ram);
+	vk_buffer_clear (heap_ram);
+	vk_buffer_clear (ram);
+
+	mmap_first.mmap = build_mmap (mach);
+	mmap_first.base = 0x00000000;
+	mmap_last.mmap = mmap_first.mmap;
+	mmap_last.base = 0x07000000;
+	mmap_dev.mmap = mmap_first.mmap;
+	mmap_dev.base = 0x10000000;
+
+	hikaru = build_hikaru ();
+
+	{
+		bench_t benches[] = {
+			{ "buffer_le32_get32",	bench_buffer_get32,	10000000, buf },
+			{ "buffer_le32_put32",	bench_buffer_put32,	10000000, buf },
+			{ "buffer_get32 (random, malloc)",	bench_buffer_get32_random,	1000000, heap_ram },
+			{ "buffer_get32 (random, RAM)",	bench_buffer_get32_random,	1000000, ram },
+			{ "vector_append_entry",	bench_vector_append,	10000000, vector },
+			{ "mmap_get32 (first region)",	bench_mmap_get32,	10000000, &mmap_first },
+			{ "mmap_get32 (8th region)",	bench_mmap_get32,	10000000, &mmap_last },
+			{ "mmap_get32 (device)",	bench_mmap_get32,	10000000, &mmap_dev },
+			{ "mmap_put32 (first region)",	bench_mmap_put32,	10000000, &mmap_first },
+			{ "mmap_put32 (8th region)",	bench_mmap_put32,	10000000, &mmap_last },
+			{ "mmap_put32 (device)",	bench_mmap_put32,	10000000, &mmap_dev },
+			{ "sh4_run (per insn)",	bench_sh4_run,		10000000, build_sh4 (mach, false) },
+			{ "sh4_run (per insn, fastmem)",	bench_sh4_run,	10000000, build_sh4 (mach, true) },
+			{ "texram_put32 (twiddling)",	bench_texram_put,	1000000, hikaru },
+			{ "texram_dma (per word)",	bench_texram_dma,	262144, hikaru },
+			{ "gpu_dma (per texel)",	bench_gpu_dma,		16, hikaru },
+			{ "copy_level (per texel)",	bench_copy_level,	16, hikaru },
+			{ "decode_abgr1111 (per texel)", bench_decode_abgr1111, 16, hikaru },
+		};
+
+		for (i = 0; i < NUMELEM (benches); i++) {
+			if (argc >= 2 && !strstr (benches[i].name, argv[1]))
+				continue;
+			if (!benches[i].ctx)
+				printf ("%-32s skipped, can't set it up here\n",
+				        benches[i].name);
+			else
+				run_bench (&benches[i]);
+		}
+	}
+
+	vk_buffer_destroy (&buf);
+	vk_vector_destroy (&vector);
+	return 0;
+}
@@ -18,6 +18,26 @@
 
 #include "vk/buffer.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef MPOL_BIND
+#define MPOL_BIND	2
+#endif
+
+#define HUGE_PAGE_SIZE	(2 * MB)
+
+vk_buffer_huge_pages_t vk_buffer_huge_pages = VK_BUFFER_HUGE_PAGES_THP;
+bool vk_buffer_numa_local = false;
+bool vk_buffer_ram_shared = false;
+
+static struct {
+	uint64_t bytes[3];
+	int node;
+} ram_stats = { { 0, 0, 0 }, -1 };
+
 static unsigned
 get_file_size (FILE *fp)
 {
@@ -53,6 +73,8 @@ vk_buffer_le32_put (vk_buffer_t *buf, unsigned size, uint32_t offs, uint64_t val
 	VK_ASSERT (is_size_valid (size));
 	VK_ASSERT ((offs + size - 1) < buf->size);
 
+	vk_buffer_mark_dirty (buf, offs, size);
+
 	switch (size) {
 	case 1:
 		buf->ptr[offs] = (uint8_t) val;
@@ -93,6 +115,8 @@ vk_buffer_be32_put (vk_buffer_t *buf, unsigned size, uint32_t offs, uint64_t val
 	VK_ASSERT (is_size_valid (size));
 	VK_ASSERT ((offs + size - 1) < buf->size);
 
+	vk_buffer_mark_dirty (buf, offs, size);
+
 	switch (size) {
 	case 1:
 		buf->ptr[offs] = (uint8_t) val;
@@ -118,6 +142,23 @@ vk_buffer_be32_put (vk_buffer_t *buf, unsigned size, uint32_t offs, uint64_t val
 #define vk_buffer_native_put vk_buffer_be32_put
 #endif
 
+static int
+init_buffer (vk_buffer_t *buf, unsigned size)
+{
+	buf->size = size;
+	buf->dirty_shift = VK_BUFFER_PAGE_SHIFT;
+	buf->gens = (uint64_t *) calloc (size / VK_BUFFER_PAGE_SIZE + 1,
+	                                 sizeof (uint64_t));
+	if (!buf->gens)
+		return -1;
+	buf->gen = 1;
+
+	buf->endianness = VK_BUFFER_NATIVE;
+	buf->get = vk_buffer_native_get;
+	buf->put = vk_buffer_native_put;
+	return 0;
+}
+
 vk_buffer_t *
 vk_buffer_new (unsigned size, unsigned alignment)
 {
@@ -126,6 +167,7 @@ vk_buffer_new (unsigned size, unsigned alignment)
 	vk_buffer_t *buf = ALLOC (vk_buffer_t);
 	if (!buf)
 		goto fail;
+	buf->fd = -1;
 
 	VK_ASSERT (is_pow2 (alignment));
 
@@ -137,10 +179,173 @@ vk_buffer_new (unsigned size, unsigned alignment)
 	if (!buf->ptr || ret)
 		goto fail;
 
-	buf->get = vk_buffer_native_get;
-	buf->put = vk_buffer_native_put;
+	if (init_buffer (buf, size))
+		goto fail;
+	return buf;
 
-	buf->size = size;
+fail:
+	vk_buffer_destroy (&buf);
+	return NULL;
+}
+
+/* Creates a buffer backed by an anonymous private mapping: its pages are
+ * only allocated, zero-filled, when first touched, and files loaded into it
+ * with vk_buffer_load_file () are mapped rather than read. */
+vk_buffer_t *
+vk_buffer_new_mapped (unsigned size)
+{
+	vk_buffer_t *buf = ALLOC (vk_buffer_t);
+	void *ptr;
+
+	if (!buf)
+		return NULL;
+	buf->fd = -1;
+
+	ptr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		goto fail;
+
+	buf->ptr = (uint8_t *) ptr;
+	buf->mapped = true;
+
+	if (init_buffer (buf, size))
+		goto fail;
+	return buf;
+
+fail:
+	vk_buffer_destroy (&buf);
+	return NULL;
+}
+
+/* Emulated RAMs are large and accessed at random, so they are backed by
+ * huge pages where possible, to cut down on TLB misses: either taken from
+ * the hugetlbfs pool or, failing that, transparent ones. Sizes that are not
+ * a multiple of the huge page size get normal pages. */
+
+static void *
+map_aligned (size_t size, size_t alignment)
+{
+	uint8_t *ptr, *aligned;
+	size_t head;
+
+	ptr = mmap (NULL, size + alignment, PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	aligned = (uint8_t *) (((uintptr_t) ptr + alignment - 1) & ~(alignment - 1));
+	head = aligned - ptr;
+	if (head)
+		munmap (ptr, head);
+	munmap (aligned + size, alignment - head);
+	return aligned;
+}
+
+static void *
+map_ram (size_t size, vk_buffer_huge_pages_t *pages)
+{
+	void *ptr;
+
+	if (size % HUGE_PAGE_SIZE)
+		*pages = VK_BUFFER_HUGE_PAGES_NONE;
+
+	if (*pages == VK_BUFFER_HUGE_PAGES_HUGETLB) {
+		ptr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED)
+			return ptr;
+		*pages = VK_BUFFER_HUGE_PAGES_THP;
+	}
+
+	if (*pages == VK_BUFFER_HUGE_PAGES_NONE) {
+		ptr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return (ptr != MAP_FAILED) ? ptr : NULL;
+	}
+
+	ptr = map_aligned (size, HUGE_PAGE_SIZE);
+	if (ptr && madvise (ptr, size, MADV_HUGEPAGE))
+		*pages = VK_BUFFER_HUGE_PAGES_NONE;
+	return ptr;
+}
+
+/* Shared RAM has to live in a memfd; hugetlb pages are available there too,
+ * transparent ones generally aren't. */
+static void *
+map_shared_ram (size_t size, vk_buffer_huge_pages_t *pages, int *fd)
+{
+	void *ptr;
+
+	if (*pages == VK_BUFFER_HUGE_PAGES_HUGETLB && !(size % HUGE_PAGE_SIZE)) {
+		*fd = memfd_create ("vk-ram", MFD_HUGETLB);
+		if (*fd >= 0 && ftruncate (*fd, size)) {
+			close (*fd);
+			*fd = -1;
+		}
+	}
+	if (*fd < 0) {
+		*pages = VK_BUFFER_HUGE_PAGES_NONE;
+		*fd = memfd_create ("vk-ram", 0);
+		if (*fd < 0 || ftruncate (*fd, size))
+			return NULL;
+	}
+
+	ptr = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	return (ptr != MAP_FAILED) ? ptr : NULL;
+}
+
+/* Binds the pages, not touched yet, to the NUMA node of the CPU we are
+ * running on. */
+static void
+bind_to_local_node (void *ptr, size_t size)
+{
+	unsigned cpu, node;
+	unsigned long mask;
+
+	if (syscall (SYS_getcpu, &cpu, &node, NULL) ||
+	    node >= sizeof (mask) * 8)
+		return;
+
+	mask = 1ul << node;
+	if (syscall (SYS_mbind, ptr, size, MPOL_BIND, &mask,
+	             sizeof (mask) * 8, 0)) {
+		VK_ERROR ("can't bind RAM to NUMA node %u: %s",
+		          node, strerror (errno));
+		return;
+	}
+	ram_stats.node = node;
+}
+
+/* Creates a little-endian buffer for emulated RAM, see above. */
+vk_buffer_t *
+vk_buffer_new_ram (unsigned size)
+{
+	vk_buffer_huge_pages_t pages = vk_buffer_huge_pages;
+	vk_buffer_t *buf = ALLOC (vk_buffer_t);
+
+	if (!buf)
+		return NULL;
+	buf->fd = -1;
+
+	if (init_buffer (buf, size))
+		goto fail;
+
+	buf->mapped = true;
+	buf->ptr = (uint8_t *) (vk_buffer_ram_shared ?
+	                        map_shared_ram (size, &pages, &buf->fd) :
+	                        map_ram (size, &pages));
+	if (!buf->ptr)
+		goto fail;
+
+	if (vk_buffer_numa_local)
+		bind_to_local_node (buf->ptr, size);
+
+	buf->endianness = VK_BUFFER_LE;
+	buf->get = vk_buffer_le32_get;
+	buf->put = vk_buffer_le32_put;
+
+	ram_stats.bytes[pages] += size;
 	return buf;
 
 fail:
@@ -148,11 +353,24 @@ fail:
 	return NULL;
 }
 
+void
+vk_buffer_print_ram_stats (FILE *fp)
+{
+	fprintf (fp, "RAM: %lu MB in hugetlb pages, %lu MB in transparent huge pages, %lu KB in normal pages",
+	         ram_stats.bytes[VK_BUFFER_HUGE_PAGES_HUGETLB] / MB,
+	         ram_stats.bytes[VK_BUFFER_HUGE_PAGES_THP] / MB,
+	         ram_stats.bytes[VK_BUFFER_HUGE_PAGES_NONE] / KB);
+	if (ram_stats.node >= 0)
+		fprintf (fp, ", bound to NUMA node %d", ram_stats.node);
+	fprintf (fp, "\n");
+}
+
 vk_buffer_t *
 vk_buffer_le32_new (unsigned size, unsigned alignment)
 {
 	vk_buffer_t *buf = vk_buffer_new (size, alignment);
 	if (buf) {
+		buf->endianness = VK_BUFFER_LE;
 		buf->get = vk_buffer_le32_get;
 		buf->put = vk_buffer_le32_put;
 	}
@@ -164,6 +382,7 @@ vk_buffer_be32_new (unsigned size, unsigned alignment)
 {
 	vk_buffer_t *buf = vk_buffer_new (size, alignment);
 	if (buf) {
+		buf->endianness = VK_BUFFER_BE;
 		buf->get = vk_buffer_be32_get;
 		buf->put = vk_buffer_be32_put;
 	}
@@ -206,13 +425,75 @@ fail:
 	return  NULL;
 }
 
+static int
+read_file (int fd, uint8_t *dst, unsigned size)
+{
+	while (size) {
+		ssize_t num = read (fd, dst, size);
+		if (num < 0 && errno == EINTR)
+			continue;
+		if (num <= 0)
+			return -1;
+		dst += num;
+		size -= num;
+	}
+	return 0;
+}
+
+/* Loads the file at 'path', which must be exactly 'size' bytes long, at
+ * offset 'offs' of the buffer. In mapped buffers, files loaded at a page
+ * boundary are mapped copy-on-write, and thus only read on first use; as
+ * the mapping covers the whole last page, files must be loaded in order of
+ * increasing offset. */
+int
+vk_buffer_load_file (vk_buffer_t *buf, uint32_t offs, const char *path,
+                     unsigned size)
+{
+	struct stat st;
+	int fd, ret = -1;
+
+	VK_ASSERT (buf);
+	VK_ASSERT (path);
+
+	if ((uint64_t) offs + size > buf->size)
+		return -1;
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat (fd, &st) || st.st_size != size)
+		goto done;
+
+	if (buf->mapped && !(offs % sysconf (_SC_PAGESIZE))) {
+		void *ptr = mmap (&buf->ptr[offs], size, PROT_READ | PROT_WRITE,
+		                  MAP_PRIVATE | MAP_FIXED, fd, 0);
+		if (ptr != MAP_FAILED) {
+			ret = 0;
+			goto done;
+		}
+	}
+
+	ret = read_file (fd, &buf->ptr[offs], size);
+done:
+	close (fd);
+	return ret;
+}
+
 void
 vk_buffer_destroy (vk_buffer_t **buf_)
 {
 	if (buf_) {
 		vk_buffer_t *buf = *buf_;
-		if (buf)
-			free (buf->ptr);
+		if (buf) {
+			if (!buf->mapped)
+				free (buf->ptr);
+			else if (buf->ptr)
+				munmap (buf->ptr, buf->size);
+			if (buf->fd >= 0)
+				close (buf->fd);
+			free (buf->gens);
+		}
 		free (buf);
 		*buf_ = NULL;
 	}
@@ -238,6 +519,57 @@ vk_buffer_clear (vk_buffer_t *buf)
 	VK_ASSERT (buf);
 	VK_ASSERT (buf->ptr);
 	memset (buf->ptr, 0, buf->size);
+	vk_buffer_mark_dirty (buf, 0, buf->size);
+}
+
+/* Finer pages let consumers tell apart writes to small neighbouring
+ * objects, at the cost of 8 bytes per page. All pages are regarded as
+ * written by the current generation afterwards. */
+int
+vk_buffer_set_dirty_granularity (vk_buffer_t *buf, unsigned shift)
+{
+	uint64_t *gens;
+	uint32_t i, num = (buf->size >> shift) + 1;
+
+	VK_ASSERT (buf);
+	VK_ASSERT (shift >= 2 && shift < 32);
+
+	gens = (uint64_t *) malloc (num * sizeof (uint64_t));
+	if (!gens)
+		return -1;
+	for (i = 0; i < num; i++)
+		gens[i] = buf->gen;
+
+	free (buf->gens);
+	buf->gens = gens;
+	buf->dirty_shift = shift;
+	return 0;
+}
+
+/* Makes the savestates regard all pages as clean. */
+void
+vk_buffer_clear_dirty (vk_buffer_t *buf)
+{
+	VK_ASSERT (buf);
+	buf->clean_gen = vk_buffer_new_generation (buf);
+}
+
+/* Gives dst, a copy of src, the same pages dirty for the savestates. */
+void
+vk_buffer_copy_dirty (vk_buffer_t *dst, vk_buffer_t *src)
+{
+	uint32_t page;
+
+	VK_ASSERT (dst && src);
+	VK_ASSERT (dst->size == src->size);
+
+	dst->clean_gen = vk_buffer_new_generation (dst);
+	for (page = 0; page < vk_buffer_get_num_state_pages (src); page++)
+		if (vk_buffer_is_page_dirty (src, page)) {
+			uint32_t offs = page << VK_BUFFER_PAGE_SHIFT;
+			vk_buffer_mark_dirty (dst, offs,
+			                      MIN2 (VK_BUFFER_PAGE_SIZE, src->size - offs));
+		}
 }
 
 int
@@ -251,15 +583,62 @@ vk_buffer_copy (vk_buffer_t *dst, vk_buffer_t *src, unsigned offs, unsigned nbyt
 	return -1;
 }
 
+#define INTERLEAVE(type_) \
+	do { \
+		type_ *restrict d = (type_ *) dst; \
+		const type_ *restrict s0 = (const type_ *) lo; \
+		const type_ *restrict s1 = (const type_ *) hi; \
+		for (i = 0; i < num; i++) { \
+			d[i * 2] = s0[i]; \
+			d[i * 2 + 1] = s1[i]; \
+		} \
+	} while (0)
+
+/* Copies the 'nbytes'-sized words of 'lo' and 'hi', 'size' bytes each, to
+ * the even and odd word slots of 'dst'. The loops are simple enough for the
+ * compiler to vectorize them. */
+void
+vk_interleave (void *dst, const void *lo, const void *hi, unsigned size,
+               unsigned nbytes)
+{
+	unsigned i, num = size / nbytes;
+
+	VK_ASSERT (is_size_valid (nbytes));
+
+	switch (nbytes) {
+	case 1:
+		INTERLEAVE (uint8_t);
+		break;
+	case 2:
+		INTERLEAVE (uint16_t);
+		break;
+	case 4:
+		INTERLEAVE (uint32_t);
+		break;
+	default:
+		INTERLEAVE (uint64_t);
+		break;
+	}
+}
+
+#undef INTERLEAVE
+
 int
-vk_buffer_copy_interleave (vk_buffer_t *dst, vk_buffer_t *src, unsigned offs, unsigned nbytes)
+vk_buffer_copy_interleave (vk_buffer_t *dst, unsigned offs,
+                           vk_buffer_t *lo, vk_buffer_t *hi, unsigned nbytes)
 {
 	VK_ASSERT (dst);
-	VK_ASSERT (src);
-	VK_ASSERT (nbytes > 0);
+	VK_ASSERT (lo);
+	VK_ASSERT (hi);
+	VK_ASSERT (is_size_valid (nbytes));
 
-	/* TODO see games.c */
-	return -1;
+	if (lo->size != hi->size || lo->size % nbytes ||
+	    (uint64_t) offs + lo->size * 2 > dst->size)
+		return -1;
+
+	vk_interleave (&dst->ptr[offs], lo->ptr, hi->ptr, lo->size, nbytes);
+	vk_buffer_mark_dirty (dst, offs, lo->size * 2);
+	return 0;
 }
 
 void
@@ -307,20 +686,90 @@ vk_buffer_dumpf (vk_buffer_t *buffer, const char *fmt, ...)
 	vk_buffer_dump (buffer, path);
 }
 
+/* In version 2 states, a buffer is stored as its size followed by a list of
+ * pages, each made of the page index and the page data, terminated by ~0.
+ * Full states store the non-zero pages only, and loading them clears the
+ * buffer first; incremental states store the pages dirtied since their base
+ * state was saved or loaded. */
+
+#define END_OF_PAGES	0xFFFFFFFF
+
+static inline unsigned
+get_page_size (vk_buffer_t *buf, uint32_t page)
+{
+	return MIN2 (VK_BUFFER_PAGE_SIZE, buf->size - (page << VK_BUFFER_PAGE_SHIFT));
+}
+
+static bool
+is_page_zero (const uint8_t *data, unsigned size)
+{
+	return data[0] == 0 && !memcmp (data, data + 1, size - 1);
+}
+
 int
-vk_buffer_load_state (vk_buffer_t *buffer, vk_state_t *state)
+vk_buffer_load_state (vk_buffer_t *buf, vk_state_t *state)
 {
-	VK_ASSERT (buffer);
+	uint32_t size, page;
+	int ret;
+
+	VK_ASSERT (buf);
 	VK_ASSERT (state);
 
-	return vk_state_get (state, buffer->ptr, buffer->size);
+	if (state->version < 2) {
+		vk_buffer_mark_dirty (buf, 0, buf->size);
+		return vk_state_get (state, buf->ptr, buf->size);
+	}
+
+	ret = vk_state_get (state, &size, sizeof (size));
+	if (ret || size != buf->size)
+		return -1;
+
+	if (!state->base)
+		vk_buffer_clear (buf);
+
+	while (!(ret = vk_state_get (state, &page, sizeof (page)))) {
+		uint32_t offs = page << VK_BUFFER_PAGE_SHIFT;
+		unsigned page_size;
+
+		if (page == END_OF_PAGES)
+			break;
+		if (page >= vk_buffer_get_num_state_pages (buf))
+			return -1;
+
+		page_size = get_page_size (buf, page);
+		ret = vk_state_get (state, &buf->ptr[offs], page_size);
+		if (ret)
+			break;
+		vk_buffer_mark_dirty (buf, offs, page_size);
+	}
+	return ret;
 }
 
 int
-vk_buffer_save_state (vk_buffer_t *buffer, vk_state_t *state)
+vk_buffer_save_state (vk_buffer_t *buf, vk_state_t *state)
 {
-	VK_ASSERT (buffer);
+	uint32_t size = buf->size, page, end = END_OF_PAGES;
+	int ret;
+
+	VK_ASSERT (buf);
 	VK_ASSERT (state);
 
-	return vk_state_put (state, buffer->ptr, buffer->size);
+	ret = vk_state_put (state, &size, sizeof (size));
+
+	for (page = 0; !ret && page < vk_buffer_get_num_state_pages (buf); page++) {
+		uint8_t *data = &buf->ptr[page << VK_BUFFER_PAGE_SHIFT];
+		unsigned page_size = get_page_size (buf, page);
+
+		if (state->base ? !vk_buffer_is_page_dirty (buf, page) :
+		                  is_page_zero (data, page_size))
+			continue;
+
+		ret = vk_state_put (state, &page, sizeof (page));
+		if (!ret)
+			ret = vk_state_put (state, data, page_size);
+	}
+
+	return ret ? ret : vk_state_put (state, &end, sizeof (end));
 }
+
+#undef END_OF_PAGES
@@ -22,13 +22,61 @@
 #include "vk/core.h"
 #include "vk/state.h"
 
+/* Buffers track when each of their pages was last written: writes stamp
+ * the page with the buffer's current generation, and each consumer (the
+ * savestates, rewind, caches of decoded data) remembers the generation it
+ * last synchronized at, as returned by vk_buffer_new_generation (), to
+ * later ask whether a range was written since. The savestates' one is
+ * kept in the buffer, see vk_buffer_clear_dirty ().
+ *
+ * Dirty tracking pages are VK_BUFFER_PAGE_SIZE bytes unless set otherwise
+ * with vk_buffer_set_dirty_granularity (); savestates and rewind always
+ * work in VK_BUFFER_PAGE_SIZE pages. Untracked buffers, which may be
+ * written behind our back, have all their pages always dirty. */
+#define VK_BUFFER_PAGE_SHIFT	12
+#define VK_BUFFER_PAGE_SIZE	(1 << VK_BUFFER_PAGE_SHIFT)
+
+/* The byte order values are stored in. Accesses to native buffers are
+ * inlined; the others go through the buffer get and put methods. */
+typedef enum {
+	VK_BUFFER_LE,
+	VK_BUFFER_BE,
+} vk_buffer_endianness_t;
+
+#ifdef VK_LITTLE_ENDIAN
+#define VK_BUFFER_NATIVE	VK_BUFFER_LE
+#else
+#define VK_BUFFER_NATIVE	VK_BUFFER_BE
+#endif
+
+/* The kind of pages backing buffers created with vk_buffer_new_ram (). */
+typedef enum {
+	VK_BUFFER_HUGE_PAGES_NONE,
+	VK_BUFFER_HUGE_PAGES_THP,
+	VK_BUFFER_HUGE_PAGES_HUGETLB,
+} vk_buffer_huge_pages_t;
+
+extern vk_buffer_huge_pages_t vk_buffer_huge_pages;
+extern bool vk_buffer_numa_local;
+
+/* If set, vk_buffer_new_ram () backs buffers with a memfd, so that they
+ * can be mapped more than once, see vk/fastmem.h. */
+extern bool vk_buffer_ram_shared;
+
 typedef struct vk_buffer_t vk_buffer_t;
 
 struct vk_buffer_t {
 	uint8_t *ptr;
 	unsigned size;
+	vk_buffer_endianness_t endianness;
 	uint64_t (* get) (vk_buffer_t *buf, unsigned size, uint32_t addr);
 	void	 (* put) (vk_buffer_t *buf, unsigned size, uint32_t addr, uint64_t val);
+	uint64_t *gens;
+	uint64_t gen, clean_gen;
+	unsigned dirty_shift;
+	bool untracked;
+	bool mapped;
+	int fd;
 };
 
 static inline bool
@@ -59,14 +107,92 @@ set_ptr (void *ptr, unsigned size, uint64_t val)
 	return 0;
 }
 
+/* The number of dirty tracking pages. */
+static inline unsigned
+vk_buffer_get_num_pages (vk_buffer_t *buf)
+{
+	return (uint32_t) (((uint64_t) buf->size + (1u << buf->dirty_shift) - 1) >>
+	                   buf->dirty_shift);
+}
+
+/* The number of VK_BUFFER_PAGE_SIZE pages, as saved by savestates and
+ * rewind. */
+static inline unsigned
+vk_buffer_get_num_state_pages (vk_buffer_t *buf)
+{
+	return (buf->size + VK_BUFFER_PAGE_SIZE - 1) >> VK_BUFFER_PAGE_SHIFT;
+}
+
+/* Bulk writers (DMAs, loaders) which store to buf->ptr directly must
+ * call this on the range they wrote. */
+static inline void
+vk_buffer_mark_dirty (vk_buffer_t *buf, uint32_t offs, uint32_t size)
+{
+	uint32_t page = offs >> buf->dirty_shift;
+	uint32_t last = (offs + size - 1) >> buf->dirty_shift;
+
+	if (!size)
+		return;
+	for (; page <= last; page++)
+		buf->gens[page] = buf->gen;
+}
+
+/* Starts a new generation, returning the previous one: the writes from
+ * now on are newer than it. */
+static inline uint64_t
+vk_buffer_new_generation (vk_buffer_t *buf)
+{
+	return buf->gen++;
+}
+
+/* Tells whether any byte of [offs, offs + size) was written after the
+ * generation 'since'. */
+static inline bool
+vk_buffer_is_range_dirty (vk_buffer_t *buf, uint32_t offs, uint32_t size,
+                          uint64_t since)
+{
+	uint32_t page = offs >> buf->dirty_shift;
+	uint32_t last = (offs + size - 1) >> buf->dirty_shift;
+
+	if (!size)
+		return false;
+	if (buf->untracked)
+		return true;
+	for (; page <= last; page++)
+		if (buf->gens[page] > since)
+			return true;
+	return false;
+}
+
+/* Tells whether the VK_BUFFER_PAGE_SIZE page was written since the last
+ * vk_buffer_clear_dirty (). */
+static inline bool
+vk_buffer_is_page_dirty (vk_buffer_t *buf, uint32_t page)
+{
+	uint32_t offs = page << VK_BUFFER_PAGE_SHIFT;
+
+	return vk_buffer_is_range_dirty (buf, offs,
+	                                 MIN2 (VK_BUFFER_PAGE_SIZE, buf->size - offs),
+	                                 buf->clean_gen);
+}
+
 vk_buffer_t	*vk_buffer_new (unsigned size, unsigned alignment);
 vk_buffer_t	*vk_buffer_new_from_file (const char *path, unsigned size);
+vk_buffer_t	*vk_buffer_new_mapped (unsigned size);
+vk_buffer_t	*vk_buffer_new_ram (unsigned size);
+void		 vk_buffer_print_ram_stats (FILE *fp);
 vk_buffer_t	*vk_buffer_le32_new (unsigned size, unsigned alignment);
 vk_buffer_t	*vk_buffer_be32_new (unsigned size, unsigned alignment);
 void		 vk_buffer_destroy (vk_buffer_t **buffer_);
 unsigned	 vk_buffer_get_size (vk_buffer_t *buf);
 void		*vk_buffer_get_ptr (vk_buffer_t *buf, unsigned offs);
 void		 vk_buffer_clear (vk_buffer_t *buffer);
+int		 vk_buffer_load_file (vk_buffer_t *buf, uint32_t offs, const char *path, unsigned size);
+void		 vk_interleave (void *dst, const void *lo, const void *hi, unsigned size, unsigned nbytes);
+int		 vk_buffer_copy_interleave (vk_buffer_t *dst, unsigned offs, vk_buffer_t *lo, vk_buffer_t *hi, unsigned nbytes);
+int		 vk_buffer_set_dirty_granularity (vk_buffer_t *buffer, unsigned shift);
+void		 vk_buffer_clear_dirty (vk_buffer_t *buffer);
+void		 vk_buffer_copy_dirty (vk_buffer_t *dst, vk_buffer_t *src);
 void		 vk_buffer_print (vk_buffer_t *buffer);
 void		 vk_buffer_print_some (vk_buffer_t *, unsigned lo, unsigned hi);
 void		 vk_buffer_dump (vk_buffer_t *buffer, const char *path);
@@ -74,10 +200,53 @@ void		 vk_buffer_dumpf (vk_buffer_t *buffer, const char *fmt, ...);
 int		 vk_buffer_load_state (vk_buffer_t *buffer, vk_state_t *state);
 int		 vk_buffer_save_state (vk_buffer_t *buffer, vk_state_t *state);
 
+/* vk_buffer_get{8,16,32,64}_fast () and vk_buffer_put{8,16,32,64}_fast ()
+ * amount to a plain load or store (plus marking the page dirty) on native
+ * buffers. */
+#define VK_BUFFER_DEFINE_FAST_ACCESSORS(bits_) \
+static inline uint##bits_##_t \
+vk_buffer_get##bits_##_fast (vk_buffer_t *buf, uint32_t offs) \
+{ \
+	VK_ASSERT ((offs + bits_ / 8 - 1) < buf->size); \
+	if (buf->endianness != VK_BUFFER_NATIVE) \
+		return buf->get (buf, bits_ / 8, offs); \
+	return *(uint##bits_##_t *) &buf->ptr[offs]; \
+} \
+\
+static inline void \
+vk_buffer_put##bits_##_fast (vk_buffer_t *buf, uint32_t offs, \
+                             uint##bits_##_t val) \
+{ \
+	VK_ASSERT ((offs + bits_ / 8 - 1) < buf->size); \
+	if (buf->endianness != VK_BUFFER_NATIVE) { \
+		buf->put (buf, bits_ / 8, offs, val); \
+		return; \
+	} \
+	vk_buffer_mark_dirty (buf, offs, bits_ / 8); \
+	*(uint##bits_##_t *) &buf->ptr[offs] = val; \
+}
+
+VK_BUFFER_DEFINE_FAST_ACCESSORS (8)
+VK_BUFFER_DEFINE_FAST_ACCESSORS (16)
+VK_BUFFER_DEFINE_FAST_ACCESSORS (32)
+VK_BUFFER_DEFINE_FAST_ACCESSORS (64)
+
+#undef VK_BUFFER_DEFINE_FAST_ACCESSORS
+
 static inline uint64_t
 vk_buffer_get (vk_buffer_t *buf, unsigned size, uint32_t addr)
 {
 	VK_ASSERT (buf);
+	switch (size) {
+	case 1:
+		return vk_buffer_get8_fast (buf, addr);
+	case 2:
+		return vk_buffer_get16_fast (buf, addr);
+	case 4:
+		return vk_buffer_get32_fast (buf, addr);
+	case 8:
+		return vk_buffer_get64_fast (buf, addr);
+	}
 	return buf->get (buf, size, addr);
 }
 
@@ -85,7 +254,23 @@ static inline void
 vk_buffer_put (vk_buffer_t *buf, unsigned size, uint32_t addr, uint64_t val)
 {
 	VK_ASSERT (buf);
-	buf->put (buf, size, addr, val);
+	switch (size) {
+	case 1:
+		vk_buffer_put8_fast (buf, addr, val);
+		break;
+	case 2:
+		vk_buffer_put16_fast (buf, addr, val);
+		break;
+	case 4:
+		vk_buffer_put32_fast (buf, addr, val);
+		break;
+	case 8:
+		vk_buffer_put64_fast (buf, addr, val);
+		break;
+	default:
+		buf->put (buf, size, addr, val);
+		break;
+	}
 }
 
 #endif /* _VK_BUFFER_H__ */
@@ -48,6 +48,7 @@ struct vk_cpu_t {
 	vk_mmap_t	*mmap;
 	vk_cpu_state_t	 state;
 	int remaining;
+	uint64_t	 executed;
 	vk_cpu_patch_t	patch;
 
 	int		 (* run) (vk_cpu_t *cpu, int cycles);
@@ -0,0 +1,212 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vk/fastmem.h"
+
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#define WINDOW_SIZE	(1ull << 32)
+
+static uint64_t num_traps = 0;
+
+uint64_t
+vk_fastmem_get_num_traps (void)
+{
+	return num_traps;
+}
+
+#ifdef VK_HAVE_FASTMEM
+
+typedef struct {
+	int32_t insn;
+	int32_t fixup;
+} fixup_t;
+
+/* Provided by the linker; weak, in case no accessor made it to the
+ * binary. */
+extern const fixup_t __start_vk_fastmem_fixups[] __attribute__ ((weak));
+extern const fixup_t __stop_vk_fastmem_fixups[] __attribute__ ((weak));
+
+static struct sigaction old_action;
+static bool handler_installed = false;
+
+static uintptr_t
+get_target (const int32_t *field)
+{
+	return (uintptr_t) field + *field;
+}
+
+static void
+segv_handler (int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = (ucontext_t *) context;
+	uintptr_t ip = uc->uc_mcontext.gregs[REG_RIP];
+	const fixup_t *fixup;
+
+	for (fixup = __start_vk_fastmem_fixups;
+	     fixup < __stop_vk_fastmem_fixups; fixup++)
+		if (get_target (&fixup->insn) == ip) {
+			uc->uc_mcontext.gregs[REG_RIP] = get_target (&fixup->fixup);
+			num_traps++;
+			return;
+		}
+
+	/* Not a fastmem access: let whoever was there before handle it, or
+	 * fault again with the default action. */
+	if (old_action.sa_flags & SA_SIGINFO)
+		old_action.sa_sigaction (sig, info, context);
+	else if (old_action.sa_handler != SIG_DFL &&
+	         old_action.sa_handler != SIG_IGN)
+		old_action.sa_handler (sig);
+	else
+		sigaction (SIGSEGV, &old_action, NULL);
+}
+
+static int
+install_handler (void)
+{
+	struct sigaction action;
+
+	if (handler_installed)
+		return 0;
+
+	memset (&action, 0, sizeof (action));
+	action.sa_sigaction = segv_handler;
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset (&action.sa_mask);
+	if (sigaction (SIGSEGV, &action, &old_action))
+		return -1;
+
+	handler_installed = true;
+	return 0;
+}
+
+/* Accesses at or above 'end' always take the slow path. */
+vk_fastmem_t *
+vk_fastmem_new (uint32_t end)
+{
+	vk_fastmem_t *fastmem;
+	void *base;
+
+	if (install_handler ()) {
+		VK_ERROR ("fastmem: can't install the SIGSEGV handler");
+		return NULL;
+	}
+
+	base = mmap (NULL, WINDOW_SIZE, PROT_NONE,
+	             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		VK_ERROR ("fastmem: can't reserve the window: %s",
+		          strerror (errno));
+		return NULL;
+	}
+
+	fastmem = ALLOC (vk_fastmem_t);
+	if (!fastmem) {
+		munmap (base, WINDOW_SIZE);
+		return NULL;
+	}
+	fastmem->base = (uint8_t *) base;
+	fastmem->end = end;
+	return fastmem;
+}
+
+void
+vk_fastmem_destroy (vk_fastmem_t **fastmem_)
+{
+	if (fastmem_) {
+		vk_fastmem_t *fastmem = *fastmem_;
+		if (fastmem) {
+			VK_LOG ("fastmem: %lu traps", num_traps);
+			munmap (fastmem->base, WINDOW_SIZE);
+		}
+		free (fastmem);
+		*fastmem_ = NULL;
+	}
+}
+
+/* Maps the pages of [lo, hi] to the buffer, at offset (address & mask).
+ * Pages only partially in the range, or whose offset is not page aligned,
+ * are left unmapped. */
+int
+vk_fastmem_map (vk_fastmem_t *fastmem, uint32_t lo, uint32_t hi,
+                uint32_t mask, vk_buffer_t *buf, bool writable)
+{
+	int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+	uint64_t addr, end;
+
+	VK_ASSERT (fastmem);
+	VK_ASSERT (buf);
+
+	if (buf->fd < 0 || buf->endianness != VK_BUFFER_NATIVE)
+		return -1;
+
+	if (writable) {
+		buf->untracked = true;
+		vk_buffer_mark_dirty (buf, 0, buf->size);
+	}
+
+	addr = ((uint64_t) lo + VK_BUFFER_PAGE_SIZE - 1) & ~(uint64_t) (VK_BUFFER_PAGE_SIZE - 1);
+	end = ((uint64_t) hi + 1) & ~(uint64_t) (VK_BUFFER_PAGE_SIZE - 1);
+
+	while (addr < end) {
+		uint32_t offs = addr & mask;
+		uint64_t size = MIN2 (end - addr, (uint64_t) mask + 1 - offs);
+		void *ptr;
+
+		size = MIN2 (size, buf->size > offs ? buf->size - offs : 0);
+		size &= ~(uint64_t) (VK_BUFFER_PAGE_SIZE - 1);
+		if (!size || offs % VK_BUFFER_PAGE_SIZE)
+			break;
+
+		ptr = mmap (fastmem->base + addr, size, prot,
+		            MAP_SHARED | MAP_FIXED, buf->fd, offs);
+		if (ptr == MAP_FAILED) {
+			VK_ERROR ("fastmem: can't map %08lX-%08lX: %s",
+			          addr, addr + size - 1, strerror (errno));
+			return -1;
+		}
+		addr += size;
+	}
+	return 0;
+}
+
+#else
+
+vk_fastmem_t *
+vk_fastmem_new (uint32_t end)
+{
+	VK_ERROR ("fastmem: not supported on this host");
+	return NULL;
+}
+
+void
+vk_fastmem_destroy (vk_fastmem_t **fastmem_)
+{
+}
+
+int
+vk_fastmem_map (vk_fastmem_t *fastmem, uint32_t lo, uint32_t hi,
+                uint32_t mask, vk_buffer_t *buf, bool writable)
+{
+	return -1;
+}
+
+#endif /* VK_HAVE_FASTMEM */
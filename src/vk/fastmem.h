@@ -0,0 +1,139 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VK_FASTMEM_H__
+#define __VK_FASTMEM_H__
+
+#include "vk/core.h"
+#include "vk/buffer.h"
+
+/* A fastmem window is a 4 GB range of host address space mirroring the
+ * address space of a CPU: buffers are mapped into it (several times over,
+ * if mirrored), so that accessing them takes a single host load or store
+ * at window base + address. Everything else in the window is left
+ * unmapped: accesses there fault, and the fault handler resumes them at a
+ * fixup which makes the accessor fail, so that the caller can take the
+ * slow path instead.
+ *
+ * Buffers must be backed by a memfd to be mapped, see vk_buffer_new_ram ().
+ * Writes through the window bypass dirty tracking, so buffers mapped
+ * writable are regarded as entirely dirty from then on; rewind and
+ * incremental savestates are not available with them.
+ *
+ * Only x86-64 Linux hosts are supported; elsewhere, vk_fastmem_new ()
+ * fails and the accessors always do. */
+
+#if defined (__x86_64__) && defined (__linux__)
+#define VK_HAVE_FASTMEM
+#endif
+
+typedef struct {
+	uint8_t *base;
+	uint32_t end;
+} vk_fastmem_t;
+
+vk_fastmem_t	*vk_fastmem_new (uint32_t end);
+void		 vk_fastmem_destroy (vk_fastmem_t **fastmem_);
+int		 vk_fastmem_map (vk_fastmem_t *fastmem, uint32_t lo, uint32_t hi,
+		                 uint32_t mask, vk_buffer_t *buf, bool writable);
+uint64_t	 vk_fastmem_get_num_traps (void);
+
+#ifdef VK_HAVE_FASTMEM
+
+/* Each access records the address of its host instruction, and that of
+ * its fixup, relative to the record itself, in a section of its own. */
+#define VK_FASTMEM_FIXUP \
+	".pushsection .text.vk_fastmem_fixup, \"ax\"\n" \
+	"3:	movl $1, %0\n" \
+	"	jmp 2b\n" \
+	".popsection\n" \
+	".pushsection vk_fastmem_fixups, \"a\"\n" \
+	"	.balign 4\n" \
+	"	.long 1b - ., 3b - .\n" \
+	".popsection\n"
+
+#define VK_FASTMEM_DEFINE_ACCESSORS(bits_, load_, store_) \
+static inline bool \
+vk_fastmem_get##bits_ (vk_fastmem_t *fastmem, uint32_t addr, \
+                       uint##bits_##_t *val) \
+{ \
+	uint64_t tmp; \
+	int failed = 0; \
+	if (!fastmem || addr >= fastmem->end) \
+		return false; \
+	asm volatile ("1:	" load_ "\n" \
+	              "2:\n" \
+	              VK_FASTMEM_FIXUP \
+	              : "+r" (failed), "=r" (tmp) \
+	              : "r" (fastmem->base), "r" ((uint64_t) addr) \
+	              : "memory"); \
+	*val = (uint##bits_##_t) tmp; \
+	return !failed; \
+} \
+\
+static inline bool \
+vk_fastmem_put##bits_ (vk_fastmem_t *fastmem, uint32_t addr, \
+                       uint##bits_##_t val) \
+{ \
+	int failed = 0; \
+	if (!fastmem || addr >= fastmem->end) \
+		return false; \
+	asm volatile ("1:	" store_ "\n" \
+	              "2:\n" \
+	              VK_FASTMEM_FIXUP \
+	              : "+r" (failed) \
+	              : "r" ((uint64_t) val), "r" (fastmem->base), \
+	                "r" ((uint64_t) addr) \
+	              : "memory"); \
+	return !failed; \
+}
+
+VK_FASTMEM_DEFINE_ACCESSORS (8,  "movzbl (%2,%3), %k1", "movb %b1, (%2,%3)")
+VK_FASTMEM_DEFINE_ACCESSORS (16, "movzwl (%2,%3), %k1", "movw %w1, (%2,%3)")
+VK_FASTMEM_DEFINE_ACCESSORS (32, "movl (%2,%3), %k1",   "movl %k1, (%2,%3)")
+VK_FASTMEM_DEFINE_ACCESSORS (64, "movq (%2,%3), %q1",   "movq %q1, (%2,%3)")
+
+#undef VK_FASTMEM_DEFINE_ACCESSORS
+
+#else
+
+#define VK_FASTMEM_DEFINE_ACCESSORS(bits_) \
+static inline bool \
+vk_fastmem_get##bits_ (vk_fastmem_t *fastmem, uint32_t addr, \
+                       uint##bits_##_t *val) \
+{ \
+	return false; \
+} \
+\
+static inline bool \
+vk_fastmem_put##bits_ (vk_fastmem_t *fastmem, uint32_t addr, \
+                       uint##bits_##_t val) \
+{ \
+	return false; \
+}
+
+VK_FASTMEM_DEFINE_ACCESSORS (8)
+VK_FASTMEM_DEFINE_ACCESSORS (16)
+VK_FASTMEM_DEFINE_ACCESSORS (32)
+VK_FASTMEM_DEFINE_ACCESSORS (64)
+
+#undef VK_FASTMEM_DEFINE_ACCESSORS
+
+#endif /* VK_HAVE_FASTMEM */
+
+#endif /* __VK_FASTMEM_H__ */
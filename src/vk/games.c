@@ -16,47 +16,470 @@
  * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
 #include "vk/core.h"
 #include "vk/games.h"
 #include "vk/buffer.h"
+#include "vk/vector.h"
+#include "vk/zip.h"
 
 static const unsigned current_version = 1;
 
+/* Bump whenever the layout of assembled sections changes. */
+static const unsigned cache_version = 1;
+
+char vk_game_cache_path[256] = "";
+uint32_t vk_game_rom_budget = 0;
+bool vk_game_print_crcs = false;
+
 enum {
 	MODE_ALTERNATIVE,
 	MODE_INTERLEAVE,
 	MODE_CONCATENATE
 };
 
-vk_buffer_t *
-vk_game_get_section_data (vk_game_t *game, const char *name)
+static vk_game_section_t *
+get_section (vk_game_t *game, const char *name)
 {
 	unsigned i;
 	for (i = 0; i < game->nsections; i++)
 		if (!strcmp (game->sections[i].name, name))
-			return game->sections[i].buffer;
+			return &game->sections[i];
 	return NULL;
 }
 
-static vk_buffer_t *
-load_datum (json_t *datum, const char *path, const char *game_name)
+vk_buffer_t *
+vk_game_get_section_data (vk_game_t *game, const char *name)
+{
+	vk_game_section_t *section = get_section (game, name);
+	return section ? section->buffer : NULL;
+}
+
+/* Returns the pager of a section loaded lazily, see load_lazy (). */
+vk_pager_t *
+vk_game_get_section_pager (vk_game_t *game, const char *name)
+{
+	vk_game_section_t *section = get_section (game, name);
+	return section ? section->pager : NULL;
+}
+
+static unsigned
+get_datum_size (json_t *datum)
+{
+	return json_integer_value (json_object_get (datum, "size"));
+}
+
+static void
+get_datum_path (char *full_path, json_t *datum, const char *path,
+                const char *game_name)
 {
 	json_t *name = json_object_get (datum, "name");
-	json_t *size = json_object_get (datum, "size");
 	const char *datum_name = json_string_value (name);
-	unsigned datum_size = json_integer_value (size);
-	vk_buffer_t *buffer;
-	char full_path[256];
 
 	sprintf (full_path, "%s/%s/%s", path, game_name, datum_name);
+}
+
+/* Interleaving and verifying data means reading them all, so it is done
+ * by a small pool of threads, each running a job at a time, once all
+ * sections have been set up. Data are verified only if their entry holds a
+ * "crc32" (hex string) field, or if vk_game_print_crcs is set, in which case
+ * the CRC32 of each datum is printed to fill in those fields; data backing
+ * an alternative or concatenated section are mapped in the meantime, so
+ * verifying them also warms up the page cache for those mappings.
+ *
+ * If the game has no directory, its data are read from 'game_name.zip'
+ * instead: each datum is then decoded straight into its section by a job
+ * of its own, and always checked against the CRC32 in the archive. */
+
+#define MAX_THREADS	16
+
+#define ZIP_CHUNK_SIZE	(256 * KB)
+
+typedef enum {
+	JOB_INTERLEAVE,
+	JOB_VERIFY,
+	JOB_DECODE,
+} job_type_t;
+
+typedef struct {
+	job_type_t type;
+	char path[2][256];
+	const vk_zip_entry_t *entry[2];
+	bool has_crc[2];
+	uint32_t crc[2];
+	unsigned size;
+	vk_buffer_t *dst;
+	uint32_t offs;
+	unsigned nbytes;
+	int ret;
+} load_job_t;
+
+typedef struct {
+	const char *path;
+	const char *game_name;
+	vk_vector_t *jobs;
+	unsigned next;
+	vk_zip_t *zip;
+	char zip_path[256];
+} loader_t;
+
+static bool
+get_datum_crc (json_t *datum, uint32_t *crc)
+{
+	const char *str = json_string_value (json_object_get (datum, "crc32"));
+	char *end;
+
+	if (!str)
+		return false;
+	*crc = strtoul (str, &end, 16);
+	if (*end) {
+		VK_ERROR ("invalid CRC32 '%s', not verifying", str);
+		return false;
+	}
+	return true;
+}
+
+static load_job_t *
+add_job (loader_t *loader, job_type_t type, unsigned size)
+{
+	load_job_t *job = (load_job_t *) vk_vector_append_entry (loader->jobs);
+
+	memset (job, 0, sizeof (load_job_t));
+	job->type = type;
+	job->size = size;
+	return job;
+}
+
+static const vk_zip_entry_t *
+find_zip_entry (loader_t *loader, json_t *datum)
+{
+	const char *name = json_string_value (json_object_get (datum, "name"));
+	const vk_zip_entry_t *entry;
+
+	entry = name ? vk_zip_find (loader->zip, name) : NULL;
+	return (entry && entry->size == get_datum_size (datum)) ? entry : NULL;
+}
+
+static int
+set_job_datum (loader_t *loader, load_job_t *job, unsigned i, json_t *datum)
+{
+	get_datum_path (job->path[i], datum, loader->path, loader->game_name);
+	job->has_crc[i] = get_datum_crc (datum, &job->crc[i]);
+	if (loader->zip) {
+		job->entry[i] = find_zip_entry (loader, datum);
+		if (!job->entry[i]) {
+			VK_ERROR ("can't find '%s' in '%s'",
+			          job->path[i], loader->zip_path);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Loads a datum at offset 'offs' of 'buffer'; see vk_buffer_load_file (). */
+static int
+load_datum (loader_t *loader, json_t *datum, vk_buffer_t *buffer,
+            uint32_t offs)
+{
+	unsigned datum_size = get_datum_size (datum);
+	char full_path[256];
+	load_job_t *job;
+	uint32_t crc;
+
+	get_datum_path (full_path, datum, loader->path, loader->game_name);
+
+	if (loader->zip) {
+		if (!find_zip_entry (loader, datum))
+			return -1;
+		job = add_job (loader, JOB_DECODE, datum_size);
+		set_job_datum (loader, job, 0, datum);
+		job->dst = buffer;
+		job->offs = offs;
+		printf ("Loading %u bytes from '%s'\n",
+		        datum_size, job->entry[0]->name);
+		return 0;
+	}
 
 	printf ("Loading %u bytes from '%s'\n", datum_size, full_path);
 
-	buffer = vk_buffer_new_from_file (full_path, datum_size);
+	if (vk_buffer_load_file (buffer, offs, full_path, datum_size))
+		return -1;
+
+	if (get_datum_crc (datum, &crc) || vk_game_print_crcs) {
+		job = add_job (loader, JOB_VERIFY, datum_size);
+		set_job_datum (loader, job, 0, datum);
+	}
+	return 0;
+}
 
+static int
+check_crc (load_job_t *job, unsigned i, uint32_t crc)
+{
+	if (vk_game_print_crcs)
+		printf ("'%s': \"crc32\" : \"%08X\"\n", job->path[i], crc);
+	if (job->has_crc[i] && crc != job->crc[i]) {
+		VK_ERROR ("'%s' has CRC32 %08X, expected %08X",
+		          job->path[i], crc, job->crc[i]);
+		return -1;
+	}
+	return 0;
+}
+
+/* Decodes one datum, or a pair of data to be interleaved a chunk at a
+ * time, straight into the section. */
+static int
+run_zip_job (loader_t *loader, load_job_t *job)
+{
+	unsigned num = (job->type == JOB_INTERLEAVE) ? 2 : 1, i;
+	vk_zip_reader_t readers[2];
+	uint8_t *dst = &job->dst->ptr[job->offs], *scratch = NULL;
+	uint32_t done, chunk;
+	int ret = 0;
+
+	VK_ASSERT ((uint64_t) job->offs + job->size * num <= job->dst->size);
+
+	for (i = 0; i < num; i++)
+		if (vk_zip_reader_init (&readers[i], loader->zip,
+		                        job->entry[i])) {
+			num = i;
+			ret = -1;
+			goto done;
+		}
+
+	if (job->type == JOB_DECODE)
+		ret = vk_zip_read (&readers[0], dst, job->size);
+	else {
+		scratch = (uint8_t *) malloc (ZIP_CHUNK_SIZE * 2);
+		if (!scratch || job->size % job->nbytes)
+			ret = -1;
+		for (done = 0; !ret && done < job->size; done += chunk) {
+			chunk = MIN2 (ZIP_CHUNK_SIZE, job->size - done);
+			ret = vk_zip_read (&readers[0], scratch, chunk) ||
+			      vk_zip_read (&readers[1], scratch + chunk, chunk);
+			if (!ret)
+				vk_interleave (dst + done * 2, scratch,
+				               scratch + chunk, chunk,
+				               job->nbytes);
+		}
+	}
+	vk_buffer_mark_dirty (job->dst, job->offs, job->size * num);
+
+done:
+	for (i = 0; i < num; i++) {
+		ret |= vk_zip_reader_finish (&readers[i]);
+		if (!ret)
+			ret = check_crc (job, i, readers[i].crc);
+	}
+	free (scratch);
+	return ret;
+}
+
+static vk_buffer_t *
+map_file (const char *path, unsigned size)
+{
+	vk_buffer_t *buffer = vk_buffer_new_mapped (size);
+
+	if (buffer && vk_buffer_load_file (buffer, 0, path, size))
+		vk_buffer_destroy (&buffer);
 	return buffer;
 }
 
+static int
+run_job (load_job_t *job)
+{
+	unsigned num = (job->type == JOB_INTERLEAVE) ? 2 : 1, i;
+	vk_buffer_t *src[2] = { NULL, NULL };
+	int ret = 0;
+
+	for (i = 0; i < num && !ret; i++) {
+		src[i] = map_file (job->path[i], job->size);
+		if (!src[i]) {
+			VK_ERROR ("can't load '%s'", job->path[i]);
+			ret = -1;
+		}
+	}
+
+	if (!ret && job->type == JOB_INTERLEAVE)
+		ret = vk_buffer_copy_interleave (job->dst, job->offs,
+		                                 src[0], src[1], job->nbytes);
+
+	/* zlib's CRC32 is portable C (no PCLMUL), but still runs at 2-3 GB/s;
+	 * verification costs ~0.1s for a full ROM set, split across jobs. */
+	for (i = 0; i < num && !ret; i++)
+		if (job->has_crc[i] || vk_game_print_crcs)
+			ret = check_crc (job, i, crc32 (0, src[i]->ptr,
+			                                job->size));
+
+	for (i = 0; i < num; i++)
+		vk_buffer_destroy (&src[i]);
+	return ret;
+}
+
+static load_job_t *
+get_job (loader_t *loader, unsigned i)
+{
+	return (load_job_t *) &loader->jobs->data[i * sizeof (load_job_t)];
+}
+
+static unsigned
+get_num_jobs (loader_t *loader)
+{
+	return loader->jobs->used / sizeof (load_job_t);
+}
+
+static void *
+job_thread (void *arg)
+{
+	loader_t *loader = (loader_t *) arg;
+	unsigned i;
+
+	while ((i = __sync_fetch_and_add (&loader->next, 1)) <
+	       get_num_jobs (loader)) {
+		load_job_t *job = get_job (loader, i);
+		job->ret = job->entry[0] ? run_zip_job (loader, job) :
+		                           run_job (job);
+	}
+	return NULL;
+}
+
+/* The thread count defaults to the number of CPUs, and can be set with
+ * ROM_THREADS; the calling thread runs jobs too. */
+static int
+run_jobs (loader_t *loader)
+{
+	unsigned num_jobs = get_num_jobs (loader), num_threads, i, j;
+	pthread_t threads[MAX_THREADS];
+	int ret = 0;
+
+	num_threads = vk_util_get_int_option ("ROM_THREADS",
+	                                      sysconf (_SC_NPROCESSORS_ONLN));
+	num_threads = MIN2 (MAX2 (num_threads, 1), MAX_THREADS);
+	num_threads = MIN2 (num_threads, num_jobs);
+
+	for (i = 1; i < num_threads; i++)
+		if (pthread_create (&threads[i], NULL, job_thread, loader))
+			break;
+	job_thread (loader);
+	for (j = 1; j < i; j++)
+		pthread_join (threads[j], NULL);
+
+	for (i = 0; i < num_jobs; i++)
+		ret |= get_job (loader, i)->ret;
+	return ret;
+}
+
+/* Interleaved sections are expensive to assemble, so, if a cache directory
+ * is set, they are saved there once assembled and mapped on later starts.
+ * Cached images are keyed by a hash of the section description and of the
+ * size, modification time and inode of each datum (or of the archive
+ * holding them): if any changes, the section is assembled and cached
+ * anew. Stale images are not removed. */
+
+static uint64_t
+hash_bytes (uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *bytes = (const uint8_t *) data;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+	return hash;
+}
+
+static uint64_t
+hash_string (uint64_t hash, const char *str)
+{
+	return hash_bytes (hash, str ? str : "", str ? strlen (str) + 1 : 1);
+}
+
+static int
+hash_file (uint64_t *hash, const char *path)
+{
+	struct stat st;
+
+	if (stat (path, &st))
+		return -1;
+	*hash = hash_string (*hash, path);
+	*hash = hash_bytes (*hash, &st.st_size, sizeof (st.st_size));
+	*hash = hash_bytes (*hash, &st.st_mtim, sizeof (st.st_mtim));
+	*hash = hash_bytes (*hash, &st.st_ino, sizeof (st.st_ino));
+	return 0;
+}
+
+static int
+get_cache_path (char *cache_path, json_t *root, loader_t *loader)
+{
+	json_t *data = json_object_get (root, "data");
+	const char *game_name = loader->game_name;
+	uint64_t hash = 0xCBF29CE484222325ull;
+	json_int_t amnt;
+	unsigned i;
+
+	cache_path[0] = '\0';
+	if (!vk_game_cache_path[0])
+		return -1;
+	if (loader->zip && hash_file (&hash, loader->zip_path))
+		return -1;
+
+	amnt = json_integer_value (json_object_get (root, "amnt"));
+	hash = hash_bytes (hash, &cache_version, sizeof (cache_version));
+	hash = hash_string (hash, game_name);
+	hash = hash_string (hash, json_string_value (json_object_get (root, "name")));
+	hash = hash_string (hash, json_string_value (json_object_get (root, "type")));
+	hash = hash_bytes (hash, &amnt, sizeof (amnt));
+
+	for (i = 0; i < json_array_size (data); i++) {
+		json_t *datum = json_array_get (data, i);
+		unsigned size = get_datum_size (datum);
+		char full_path[256];
+
+		get_datum_path (full_path, datum, loader->path, game_name);
+		hash = hash_bytes (hash, &size, sizeof (size));
+		if (loader->zip)
+			hash = hash_string (hash, full_path);
+		else if (hash_file (&hash, full_path))
+			return -1;
+	}
+
+	snprintf (cache_path, 256, "%s/%s-%s-%016llx.bin",
+	          vk_game_cache_path, game_name,
+	          json_string_value (json_object_get (root, "name")),
+	          (unsigned long long) hash);
+	return 0;
+}
+
+/* Writes to a temporary file first, so that a crash, or another instance
+ * loading the same game, never sees a partial image. */
+static void
+write_cache (vk_buffer_t *buffer, const char *cache_path)
+{
+	char tmp_path[272];
+	FILE *fp;
+	size_t num;
+
+	if (mkdir (vk_game_cache_path, 0755) && errno != EEXIST)
+		goto fail;
+
+	snprintf (tmp_path, sizeof (tmp_path), "%s.%d", cache_path, getpid ());
+	fp = fopen (tmp_path, "wb");
+	if (!fp)
+		goto fail;
+	num = fwrite (buffer->ptr, 1, buffer->size, fp);
+	if (fclose (fp) || num != buffer->size || rename (tmp_path, cache_path)) {
+		unlink (tmp_path);
+		goto fail;
+	}
+
+	printf ("Cached section in '%s'\n", cache_path);
+	return;
+fail:
+	VK_ERROR ("can't write ROM cache '%s': %s", cache_path, strerror (errno));
+}
+
 static unsigned
 get_section_size (json_t *data, unsigned ndata, unsigned mode)
 {
@@ -86,8 +509,228 @@ get_section_size (json_t *data, unsigned ndata, unsigned mode)
 	return total_bytes;
 }
 
+/* Returns the word size of an interleaved section, 0 if invalid. */
+static unsigned
+get_interleave_size (json_t *root, vk_game_section_t *section, unsigned ndata)
+{
+	json_t *amnt = json_object_get (root, "amnt");
+	unsigned nbytes = json_integer_value (amnt);
+
+	/* XXX wrong, we need to interleave 2 by 2 for hikaru eproms,
+	 * see braveff */
+	if (!amnt)
+		return 0;
+	if (nbytes != 1 && nbytes != 2 && nbytes != 4 && nbytes != 8)
+		return 0;
+	if (ndata & 1) {
+		VK_ERROR ("section %s: odd number of interleaved data",
+		          section->name);
+		return 0;
+	}
+	return nbytes;
+}
+
+static int
+load_interleaved (loader_t *loader, json_t *root, vk_game_section_t *section,
+                  json_t *data, unsigned ndata)
+{
+	unsigned nbytes = get_interleave_size (root, section, ndata), i;
+	uint32_t base = 0;
+
+	if (!nbytes)
+		return -1;
+	for (i = 0; i < ndata; i += 2) {
+		json_t *lo, *hi;
+		load_job_t *job;
+		lo = json_array_get (data, i);
+		hi = json_array_get (data, i + 1);
+		if (get_datum_size (lo) != get_datum_size (hi))
+			return -1;
+
+		job = add_job (loader, JOB_INTERLEAVE, get_datum_size (lo));
+		if (set_job_datum (loader, job, 0, lo) ||
+		    set_job_datum (loader, job, 1, hi))
+			return -1;
+		job->dst = section->buffer;
+		job->offs = base;
+		job->nbytes = nbytes;
+
+		printf ("Loading %u bytes from '%s' and '%s'\n",
+		        job->size * 2, job->path[0], job->path[1]);
+		base += job->size * 2;
+	}
+	return 0;
+}
+
+/* Interleaved sections larger than vk_game_rom_budget are not loaded at
+ * all: they are backed by a pager instead, which reads and interleaves
+ * the data of a bank when it is first accessed, and keeps at most the
+ * budget resident. The data files are kept open meanwhile. Deflated data
+ * can't be read at random, so sections read from archives are always
+ * loaded whole. */
+
+typedef struct {
+	int fd[2];
+	uint32_t base;
+	uint32_t size;
+} lazy_pair_t;
+
+typedef struct {
+	unsigned nbytes;
+	unsigned num_pairs;
+	lazy_pair_t *pairs;
+	uint8_t *scratch;
+} lazy_section_t;
+
+static void
+destroy_lazy_section (lazy_section_t *lazy)
+{
+	unsigned i;
+
+	if (!lazy)
+		return;
+	for (i = 0; lazy->pairs && i < lazy->num_pairs; i++) {
+		if (lazy->pairs[i].fd[0] >= 0)
+			close (lazy->pairs[i].fd[0]);
+		if (lazy->pairs[i].fd[1] >= 0)
+			close (lazy->pairs[i].fd[1]);
+	}
+	free (lazy->pairs);
+	free (lazy->scratch);
+	free (lazy);
+}
+
+static int
+read_at (int fd, uint8_t *dst, uint32_t size, uint32_t offs)
+{
+	while (size) {
+		ssize_t num = pread (fd, dst, size, offs);
+		if (num < 0 && errno == EINTR)
+			continue;
+		if (num <= 0)
+			return -1;
+		dst += num;
+		size -= num;
+		offs += num;
+	}
+	return 0;
+}
+
+static int
+fill_lazy_section (void *opaque, uint8_t *dst, uint32_t offs, uint32_t size)
+{
+	lazy_section_t *lazy = (lazy_section_t *) opaque;
+	unsigned i;
+
+	for (i = 0; i < lazy->num_pairs && size; i++) {
+		lazy_pair_t *pair = &lazy->pairs[i];
+		uint32_t end = pair->base + pair->size * 2, num, src;
+
+		if (offs >= end)
+			continue;
+
+		num = MIN2 (size, end - offs);
+		src = (offs - pair->base) / 2;
+		if (read_at (pair->fd[0], lazy->scratch, num / 2, src) ||
+		    read_at (pair->fd[1], lazy->scratch + num / 2, num / 2, src))
+			return -1;
+		vk_interleave (dst, lazy->scratch, lazy->scratch + num / 2,
+		               num / 2, lazy->nbytes);
+
+		dst += num;
+		offs += num;
+		size -= num;
+	}
+	return size ? -1 : 0;
+}
+
+static int
+open_datum (loader_t *loader, json_t *datum)
+{
+	char full_path[256];
+	struct stat st;
+	uint32_t crc;
+	int fd;
+
+	get_datum_path (full_path, datum, loader->path, loader->game_name);
+
+	fd = open (full_path, O_RDONLY);
+	if (fd < 0 || fstat (fd, &st) || st.st_size != get_datum_size (datum)) {
+		VK_ERROR ("can't load '%s'", full_path);
+		if (fd >= 0)
+			close (fd);
+		return -1;
+	}
+
+	if (get_datum_crc (datum, &crc) || vk_game_print_crcs) {
+		load_job_t *job = add_job (loader, JOB_VERIFY,
+		                           get_datum_size (datum));
+		set_job_datum (loader, job, 0, datum);
+	}
+	return fd;
+}
+
+static int
+load_lazy (loader_t *loader, json_t *root, vk_game_section_t *section,
+           json_t *data, unsigned ndata, uint32_t total_size)
+{
+	lazy_section_t *lazy;
+	uint32_t base = 0;
+	unsigned i;
+
+	lazy = ALLOC (lazy_section_t);
+	if (!lazy)
+		return -1;
+
+	lazy->nbytes = get_interleave_size (root, section, ndata);
+	lazy->num_pairs = ndata / 2;
+	lazy->pairs = (lazy_pair_t *) calloc (lazy->num_pairs,
+	                                      sizeof (lazy_pair_t));
+	lazy->scratch = (uint8_t *) malloc (VK_PAGER_BANK_SIZE);
+	if (!lazy->nbytes || !lazy->pairs || !lazy->scratch)
+		goto fail;
+
+	for (i = 0; i < lazy->num_pairs; i++)
+		lazy->pairs[i].fd[0] = lazy->pairs[i].fd[1] = -1;
+
+	for (i = 0; i < lazy->num_pairs; i++) {
+		json_t *lo = json_array_get (data, i * 2);
+		json_t *hi = json_array_get (data, i * 2 + 1);
+		lazy_pair_t *pair = &lazy->pairs[i];
+
+		pair->base = base;
+		pair->size = get_datum_size (lo);
+		if (pair->size != get_datum_size (hi) ||
+		    (pair->size * 2) % VK_PAGER_BANK_SIZE)
+			goto fail;
+
+		pair->fd[0] = open_datum (loader, lo);
+		pair->fd[1] = open_datum (loader, hi);
+		if (pair->fd[0] < 0 || pair->fd[1] < 0)
+			goto fail;
+		base += pair->size * 2;
+	}
+
+	section->pager = vk_pager_new (total_size, vk_game_rom_budget,
+	                               fill_lazy_section, lazy);
+	if (!section->pager)
+		goto fail;
+
+	printf ("Paging section %s in %u MB banks, at most %u MB resident\n",
+	        section->name, VK_PAGER_BANK_SIZE / MB,
+	        vk_game_rom_budget / MB);
+	return 0;
+fail:
+	destroy_lazy_section (lazy);
+	return -1;
+}
+
+/* Sets up a section; interleaved data are only queued for loading. If
+ * the section has to be cached once loaded, its path is put in
+ * 'cache_path'. */
 static int
-load_section (json_t *root, vk_game_section_t *section, const char *path, const char *game_name)
+load_section (loader_t *loader, json_t *root, vk_game_section_t *section,
+              char *cache_path)
 {
 	json_t *name, *type, *data;
 	const char *name_value, *type_value;
@@ -126,63 +769,48 @@ load_section (json_t *root, vk_game_section_t *section, const char *path, const
 
 	strcpy (section->name, name_value);
 
+	/* Sections are backed by private mappings of the ROM files where
+	 * possible, so they are only read, and take up memory, on first
+	 * use. */
+	section->buffer = vk_buffer_new_mapped (total_size);
+	if (!section->buffer)
+		return -1;
+
 	switch (mode) {
 	case MODE_ALTERNATIVE:
-		section->buffer = NULL;
 		for (i = 0; i < ndata; i++) {
 			json_t *datum = json_array_get (data, i);
-			section->buffer = load_datum (datum, path, game_name);
-			if (section->buffer)
+			if (!load_datum (loader, datum, section->buffer, 0))
 				break;
 		}
-		if (!section->buffer)
+		if (i == ndata)
 			return -1;
 		break;
 	case MODE_INTERLEAVE:
-		/* XXX wrong, we need to interleave 2 by 2 for hikaru eproms,
-		 * see braveff */
-		section->buffer = vk_buffer_new (total_size, 0);
-		if (!section->buffer)
-			return -1;
-		base = 0;
-		for (i = 0; i < ndata; i++) {
-			json_t *datum = json_array_get (data, i);
-			json_t *amnt = json_object_get (root, "amnt");
-			unsigned nbytes = json_integer_value (amnt), j;
-			if (!amnt)
-				return -1;
-			if (nbytes != 1 && nbytes != 2 && nbytes != 4 && nbytes != 8)
-				return -1;
-			vk_buffer_t *buf = load_datum (datum, path, game_name);
-			if (!buf)
-				return -1;
-			for (j = 0; j < vk_buffer_get_size (buf); j += nbytes) {
-				unsigned k = base + ((i & 1) + j) * nbytes;
-				uint64_t bytes = vk_buffer_get (buf, nbytes, j);
-				vk_buffer_put (section->buffer, nbytes, k, bytes);
-			}
-			if (i & 1)
-				base += vk_buffer_get_size (buf) * 2;
-			vk_buffer_destroy (&buf);
+		if (vk_game_rom_budget && total_size > vk_game_rom_budget &&
+		    !loader->zip) {
+			vk_buffer_destroy (&section->buffer);
+			return load_lazy (loader, root, section, data, ndata,
+			                  total_size);
+		}
+		if (!get_cache_path (cache_path, root, loader) &&
+		    !vk_buffer_load_file (section->buffer, 0, cache_path,
+		                          total_size)) {
+			printf ("Loading section %s from '%s'\n",
+			        name_value, cache_path);
+			cache_path[0] = '\0';
+			break;
 		}
+		if (load_interleaved (loader, root, section, data, ndata))
+			return -1;
 		break;
 	case MODE_CONCATENATE:
-		section->buffer = vk_buffer_new (total_size, 0);
-		if (!section->buffer)
-			return -1;
 		base = 0;
 		for (i = 0; i < ndata; i++) {
 			json_t *datum = json_array_get (data, i);
-			vk_buffer_t *buffer = load_datum (datum, path, game_name);
-			unsigned j;
-			if (!buffer)
+			if (load_datum (loader, datum, section->buffer, base))
 				return -1;
-			for (j = 0; j < vk_buffer_get_size (buffer); j += 1) {
-				uint8_t byte = vk_buffer_get (buffer, 1, j);
-				vk_buffer_put (section->buffer, 1, j+base, byte);
-			}
-			base += vk_buffer_get_size (buffer);
-			vk_buffer_destroy (&buffer);
+			base += get_datum_size (datum);
 		}
 		break;
 	}
@@ -192,8 +820,12 @@ load_section (json_t *root, vk_game_section_t *section, const char *path, const
 static int
 load_sections (json_t *root, vk_game_t *game, const char *path, const char *game_name)
 {
+	loader_t loader = { path, game_name, NULL, 0, NULL, "" };
+	char (*cache_paths)[256] = NULL;
 	json_t *sections;
 	unsigned i, nsections;
+	struct stat st;
+	int ret = -1;
 
 	VK_ASSERT (root);
 	VK_ASSERT (game);
@@ -207,15 +839,43 @@ load_sections (json_t *root, vk_game_t *game, const char *path, const char *game
 	game->sections = (vk_game_section_t *) calloc (nsections, sizeof (vk_game_section_t));
 	if (!game->sections)
 		return -1;
+	game->nsections = nsections;
+
+	cache_paths = calloc (nsections, sizeof (cache_paths[0]));
+	loader.jobs = vk_vector_new (16, sizeof (load_job_t));
+	if (!cache_paths || !loader.jobs)
+		goto done;
+
+	snprintf (loader.zip_path, sizeof (loader.zip_path), "%s/%s",
+	          path, game_name);
+	if (stat (loader.zip_path, &st) || !S_ISDIR (st.st_mode)) {
+		strncat (loader.zip_path, ".zip",
+		         sizeof (loader.zip_path) - strlen (loader.zip_path) - 1);
+		loader.zip = vk_zip_open (loader.zip_path);
+		if (loader.zip)
+			printf ("Loading game from '%s'\n", loader.zip_path);
+	}
 
 	for (i = 0; i < nsections; i++) {
 		json_t *section = json_array_get (sections, i);
-		if (load_section (section, &game->sections[i], path, game_name))
-			return -1;
+		if (load_section (&loader, section, &game->sections[i],
+		                  cache_paths[i]))
+			goto done;
 	}
 
-	game->nsections = nsections;
-	return 0;
+	if (run_jobs (&loader))
+		goto done;
+
+	for (i = 0; i < nsections; i++)
+		if (cache_paths[i][0])
+			write_cache (game->sections[i].buffer, cache_paths[i]);
+	ret = 0;
+
+done:
+	vk_vector_destroy (&loader.jobs);
+	vk_zip_destroy (&loader.zip);
+	free (cache_paths);
+	return ret;
 }
 
 vk_game_t *
@@ -254,8 +914,13 @@ vk_game_destroy (vk_game_t **game_)
 	if (game_) {
 		vk_game_t *game = *game_;
 		unsigned i;
-		for (i = 0; i < game->nsections; i++)
-			vk_buffer_destroy (&game->sections[i].buffer);
+		for (i = 0; i < game->nsections; i++) {
+			vk_game_section_t *section = &game->sections[i];
+			vk_buffer_destroy (&section->buffer);
+			if (section->pager)
+				destroy_lazy_section (section->pager->opaque);
+			vk_pager_destroy (&section->pager);
+		}
 		free (game->sections);
 		free (game);
 		*game_ = NULL;
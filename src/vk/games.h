@@ -20,10 +20,13 @@
 #define __VK_GAMES_H__
 
 #include "vk/buffer.h"
+#include "vk/pager.h"
 
+/* A section holds either a buffer or, if loaded lazily, a pager. */
 typedef struct {
 	char name[32];
 	vk_buffer_t *buffer;
+	vk_pager_t *pager;
 } vk_game_section_t;
 
 typedef struct {
@@ -44,9 +47,20 @@ typedef struct {
 	unsigned nentries;
 } vk_game_list_t;
 
+/* Directory where assembled ROM sections are cached; empty to disable. */
+extern char vk_game_cache_path[256];
+
+/* Interleaved sections larger than this many bytes are paged in lazily,
+ * keeping at most this many bytes resident; 0 to disable. */
+extern uint32_t vk_game_rom_budget;
+
+/* Print the CRC32 of every ROM file loaded, whether it is verified or not. */
+extern bool vk_game_print_crcs;
+
 vk_game_t	*vk_game_new (vk_game_list_t *list, const char *path, const char *name);
 void		 vk_game_destroy (vk_game_t **game_);
 vk_buffer_t	*vk_game_get_section_data (vk_game_t *game, const char *name);
+vk_pager_t	*vk_game_get_section_pager (vk_game_t *game, const char *name);
 
 vk_game_list_t	*vk_game_list_new (const char *path);
 void		 vk_game_list_destroy (vk_game_list_t **game_list_);
@@ -16,11 +16,14 @@
  * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <pthread.h>
+
 #include "vk/machine.h"
 #include "vk/state.h"
 #include "vk/buffer.h"
 #include "vk/device.h"
 #include "vk/cpu.h"
+#include "vk/profiler.h"
 
 void
 vk_machine_destroy (vk_machine_t **mach_)
@@ -29,6 +32,8 @@ vk_machine_destroy (vk_machine_t **mach_)
 		vk_machine_t *mach = *mach_;
 		unsigned i;
 
+		vk_machine_wait_state (mach);
+
 		vk_renderer_destroy (&mach->renderer);
 		mach->destroy (mach_);
 
@@ -46,6 +51,7 @@ vk_machine_destroy (vk_machine_t **mach_)
 
 		vk_vector_destroy (&mach->cpus);
 
+		free (mach->state_base);
 		free (mach);
 		*mach_ = NULL;
 	}
@@ -129,8 +135,71 @@ vk_machine_run_frame (vk_machine_t *mach)
 	return mach->run_frame (mach);
 }
 
+/* Makes all buffer pages clean for the savestates. Incremental states need
+ * the pages dirtied since their base, so the base is forgotten. */
+void
+vk_machine_clear_dirty (vk_machine_t *mach)
+{
+	unsigned i;
+
+	free (mach->state_base);
+	mach->state_base = NULL;
+
+	VK_VECTOR_FOREACH (mach->buffers, i) {
+		vk_buffer_t *buf = *(vk_buffer_t **) &mach->buffers->data[i];
+		vk_buffer_clear_dirty (buf);
+	}
+}
+
+static void
+set_state_base (vk_machine_t *mach, const char *path)
+{
+	vk_machine_clear_dirty (mach);
+	mach->state_base = strdup (path);
+}
+
+/* Loads or saves the state of the devices and of the machine itself, that
+ * is, everything but the buffers. */
+static int
+load_save_devices_state (vk_machine_t *mach, vk_state_t *state, uint32_t mode)
+{
+	char *op = (mode == VK_STATE_LOAD) ? "load" : "save";
+	unsigned i;
+	int ret;
+
+	VK_VECTOR_FOREACH (mach->devices, i) {
+		vk_device_t *dev = *(vk_device_t **) &mach->devices->data[i];
+		ret = (mode == VK_STATE_LOAD) ?
+		      vk_device_load_state (dev, state) :
+		      vk_device_save_state (dev, state);
+		if (ret) {
+			VK_ERROR ("%s state: cannot %s device", op, op);
+			return ret;
+		}
+	}
+
+	ret = (mode == VK_STATE_LOAD) ? mach->load_state (mach, state) :
+	                                mach->save_state (mach, state);
+	if (ret)
+		VK_ERROR ("%s state; cannot %s machine", op, op);
+	return ret;
+}
+
+int
+vk_machine_load_devices_state (vk_machine_t *mach, vk_state_t *state)
+{
+	return load_save_devices_state (mach, state, VK_STATE_LOAD);
+}
+
+int
+vk_machine_save_devices_state (vk_machine_t *mach, vk_state_t *state)
+{
+	return load_save_devices_state (mach, state, VK_STATE_SAVE);
+}
+
 static int
-load_save_state (vk_machine_t *mach, const char *path, uint32_t mode)
+load_save_state (vk_machine_t *mach, const char *path, uint32_t mode,
+                 bool incremental)
 {
 	vk_state_t *state;
 	char *op;
@@ -139,16 +208,29 @@ load_save_state (vk_machine_t *mach, const char *path, uint32_t mode)
 
 	VK_ASSERT (mach);
 
+	/* Don't race a background save, which may be writing this very
+	 * file or the base of an incremental state. */
+	vk_machine_wait_state (mach);
+
 	op = (mode == VK_STATE_LOAD) ? "load" : "save";
 
-	state = vk_state_new (path, mode);
+	state = incremental ? vk_state_new_incremental (path, mach->state_base) :
+	                      vk_state_new (path, mode);
 	if (!state) {
 		VK_ERROR ("%s state: cannot create state object", op);
 		ret = -1;
 		goto done;
 	}
 
-	if (mode == VK_STATE_LOAD)
+	/* An incremental state is applied on top of its base state. */
+	if (mode == VK_STATE_LOAD && state->base) {
+		ret = load_save_state (mach, state->base, VK_STATE_LOAD, false);
+		if (ret) {
+			VK_ERROR ("load state: cannot load base state '%s'",
+			          state->base);
+			goto done;
+		}
+	} else if (mode == VK_STATE_LOAD)
 		vk_machine_reset (mach, VK_RESET_TYPE_HARD);
 
 	VK_VECTOR_FOREACH (mach->buffers, i) {
@@ -162,26 +244,17 @@ load_save_state (vk_machine_t *mach, const char *path, uint32_t mode)
 		}
 	}
 
-	VK_VECTOR_FOREACH (mach->devices, i) {
-		vk_device_t *dev = *(vk_device_t **) &mach->devices->data[i];
-		ret = (mode == VK_STATE_LOAD) ?
-		      vk_device_load_state (dev, state) :
-		      vk_device_save_state (dev, state);
-		if (ret) {
-			VK_ERROR ("%s state: cannot %s device", op, op);
-			goto done;
-		}
-	}
-
-	ret = (mode == VK_STATE_LOAD) ? mach->load_state (mach, state) :
-	                                mach->save_state (mach, state);
-	if (ret) {
-		VK_ERROR ("%s state; cannot %s machine", op, op);
+	ret = load_save_devices_state (mach, state, mode);
+	if (ret)
 		goto done;
-	}
+
+	/* Full states become the base of later incremental saves. */
+	if (!state->base)
+		set_state_base (mach, path);
 
 done:
-	vk_state_destroy (&state, ret);
+	if (state)
+		vk_state_destroy (&state, ret);
 	if (ret && mode == VK_STATE_LOAD) {
 		VK_ERROR ("load state: resetting machine");
 		vk_machine_reset (mach, VK_RESET_TYPE_HARD);
@@ -189,16 +262,258 @@ done:
 	return ret;
 }
 
+/* Loads either a full or an incremental state; in the latter case, its base
+ * state is loaded first. */
 int
 vk_machine_load_state (vk_machine_t *mach, const char *path)
 {
-	return load_save_state (mach, path, VK_STATE_LOAD);
+	return load_save_state (mach, path, VK_STATE_LOAD, false);
 }
 
 int
 vk_machine_save_state (vk_machine_t *mach, const char *path)
 {
-	return load_save_state (mach, path, VK_STATE_SAVE);
+	return load_save_state (mach, path, VK_STATE_SAVE, false);
+}
+
+/* Writes to untracked buffers (e.g., through fastmem) are not seen, so
+ * incremental states can't be taken. */
+static bool
+has_untracked_buffers (vk_machine_t *mach)
+{
+	unsigned i;
+
+	VK_VECTOR_FOREACH (mach->buffers, i) {
+		vk_buffer_t *buf = *(vk_buffer_t **) &mach->buffers->data[i];
+		if (buf->untracked)
+			return true;
+	}
+	return false;
+}
+
+/* Saves only what changed since the last full state was saved or loaded;
+ * falls back to a full save if there is none. */
+int
+vk_machine_save_state_incremental (vk_machine_t *mach, const char *path)
+{
+	if (has_untracked_buffers (mach)) {
+		VK_ERROR ("save state: some buffers are untracked, can't save an incremental state");
+		return -1;
+	}
+	if (!mach->state_base || !strcmp (mach->state_base, path)) {
+		VK_ERROR ("save state: no base state, saving a full state");
+		return vk_machine_save_state (mach, path);
+	}
+	return load_save_state (mach, path, VK_STATE_SAVE, true);
+}
+
+/* An asynchronous save copies the buffers (only their dirty pages, for
+ * incremental states) and the serialized device state to RAM, and then
+ * compresses and writes them from a worker thread, in the same format
+ * load_save_state () uses. At most one save is in flight at any time. */
+struct vk_state_job_t {
+	pthread_t thread;
+	char *path;
+	char *base;
+	vk_buffer_t **buffers;
+	unsigned num_buffers;
+	vk_state_t *devices;
+	uint64_t snapshot_time;
+	int ret;
+};
+
+static void
+destroy_state_job (vk_state_job_t **job_)
+{
+	vk_state_job_t *job = *job_;
+	unsigned i;
+
+	if (!job)
+		return;
+
+	if (job->buffers)
+		for (i = 0; i < job->num_buffers; i++)
+			vk_buffer_destroy (&job->buffers[i]);
+	free (job->buffers);
+	if (job->devices) {
+		free (job->devices->mem.data);
+		vk_state_destroy (&job->devices, 0);
+	}
+	free (job->path);
+	free (job->base);
+	free (job);
+	*job_ = NULL;
+}
+
+static vk_buffer_t *
+snapshot_buffer (vk_buffer_t *buf, bool incremental)
+{
+	unsigned page, num_pages = vk_buffer_get_num_state_pages (buf);
+	vk_buffer_t *copy;
+
+	copy = vk_buffer_new (buf->size, 0);
+	if (!copy)
+		return NULL;
+
+	vk_buffer_copy_dirty (copy, buf);
+
+	if (!incremental) {
+		memcpy (copy->ptr, buf->ptr, buf->size);
+		return copy;
+	}
+
+	/* Only dirty pages are saved, the others are never read. */
+	for (page = 0; page < num_pages; page++) {
+		uint32_t offs = page << VK_BUFFER_PAGE_SHIFT;
+		if (vk_buffer_is_page_dirty (buf, page))
+			memcpy (&copy->ptr[offs], &buf->ptr[offs],
+			        MIN2 (VK_BUFFER_PAGE_SIZE, buf->size - offs));
+	}
+	return copy;
+}
+
+static void *
+state_job_main (void *arg)
+{
+	vk_state_job_t *job = (vk_state_job_t *) arg;
+	uint64_t start = vk_profiler_get_time ();
+	vk_state_t *state;
+	unsigned i;
+	int ret = 0;
+
+	state = job->base ? vk_state_new_incremental (job->path, job->base) :
+	                    vk_state_new (job->path, VK_STATE_SAVE);
+	if (!state) {
+		ret = -1;
+		goto done;
+	}
+
+	for (i = 0; !ret && i < job->num_buffers; i++)
+		ret = vk_buffer_save_state (job->buffers[i], state);
+
+	if (!ret)
+		ret = vk_state_put (state, job->devices->mem.data,
+		                    job->devices->mem.offs);
+
+	vk_state_destroy (&state, ret);
+
+done:
+	if (ret)
+		VK_ERROR ("save state: cannot write '%s'", job->path);
+	else
+		printf ("saved state '%s' (snapshot %.1f ms, write %.1f ms)\n",
+		        job->path, job->snapshot_time / 1000000.0,
+		        (vk_profiler_get_time () - start) / 1000000.0);
+	job->ret = ret;
+	return NULL;
+}
+
+/* Waits for the background save, if any, to complete, and returns its
+ * result. */
+int
+vk_machine_wait_state (vk_machine_t *mach)
+{
+	vk_state_job_t *job;
+	int ret;
+
+	VK_ASSERT (mach);
+
+	job = mach->state_job;
+	if (!job)
+		return 0;
+
+	pthread_join (job->thread, NULL);
+	ret = job->ret;
+
+	/* A failed full state can't be the base of incremental ones. */
+	if (ret && !job->base && mach->state_base &&
+	    !strcmp (mach->state_base, job->path)) {
+		free (mach->state_base);
+		mach->state_base = NULL;
+	}
+
+	destroy_state_job (&mach->state_job);
+	return ret;
+}
+
+/* Snapshots the machine state and writes it in the background; returns
+ * as soon as the snapshot is taken. Completion is logged to stdout and
+ * errors are reported by the next vk_machine_wait_state (). */
+int
+vk_machine_save_state_async (vk_machine_t *mach, const char *path,
+                             bool incremental)
+{
+	uint64_t start = vk_profiler_get_time ();
+	vk_state_job_t *job;
+	unsigned i;
+	int ret;
+
+	VK_ASSERT (mach);
+	VK_ASSERT (path);
+
+	vk_machine_wait_state (mach);
+
+	if (incremental && has_untracked_buffers (mach)) {
+		VK_ERROR ("save state: some buffers are untracked, can't save an incremental state");
+		return -1;
+	}
+	if (incremental &&
+	    (!mach->state_base || !strcmp (mach->state_base, path))) {
+		VK_ERROR ("save state: no base state, saving a full state");
+		incremental = false;
+	}
+
+	job = ALLOC (vk_state_job_t);
+	if (!job)
+		return -1;
+
+	job->path = strdup (path);
+	if (!job->path)
+		goto fail;
+	if (incremental) {
+		job->base = strdup (mach->state_base);
+		if (!job->base)
+			goto fail;
+	}
+
+	job->num_buffers = mach->buffers->used / mach->buffers->element_size;
+	job->buffers = (vk_buffer_t **) calloc (job->num_buffers,
+	                                        sizeof (vk_buffer_t *));
+	if (!job->buffers)
+		goto fail;
+
+	for (i = 0; i < job->num_buffers; i++) {
+		vk_buffer_t *buf = *(vk_buffer_t **)
+			&mach->buffers->data[i * mach->buffers->element_size];
+		job->buffers[i] = snapshot_buffer (buf, incremental);
+		if (!job->buffers[i])
+			goto fail;
+	}
+
+	job->devices = vk_state_new_in_memory (VK_STATE_SAVE, NULL, 0);
+	if (!job->devices)
+		goto fail;
+	if (vk_machine_save_devices_state (mach, job->devices))
+		goto fail;
+
+	job->snapshot_time = vk_profiler_get_time () - start;
+
+	ret = pthread_create (&job->thread, NULL, state_job_main, job);
+	if (ret) {
+		VK_ERROR ("save state: cannot create thread: %s",
+		          strerror (ret));
+		goto fail;
+	}
+	mach->state_job = job;
+
+	/* The snapshot becomes the base of later incremental saves. */
+	if (!incremental)
+		set_state_base (mach, path);
+	return 0;
+
+fail:
+	destroy_state_job (&job);
+	return -1;
 }
 
 const char *
@@ -206,3 +521,36 @@ vk_machine_get_debug_string (vk_machine_t *mach)
 {
 	return mach->get_debug_string (mach);
 }
+
+/* Prints the machine-specific execution statistics, accumulated since the
+ * machine was created, as 'key=value' lines. */
+void
+vk_machine_print_stats (vk_machine_t *mach, FILE *fp, double secs)
+{
+	VK_ASSERT (mach);
+	VK_ASSERT (fp);
+
+	if (mach->print_stats)
+		mach->print_stats (mach, fp, secs);
+}
+
+/* Prints the memory access counters of the machine memory maps. */
+void
+vk_machine_print_mmap_stats (vk_machine_t *mach, FILE *fp)
+{
+	VK_ASSERT (mach);
+	VK_ASSERT (fp);
+
+	if (mach->print_mmap_stats)
+		mach->print_mmap_stats (mach, fp);
+}
+
+/* Zeroes the memory access counters, to measure a specific scene. */
+void
+vk_machine_reset_mmap_stats (vk_machine_t *mach)
+{
+	VK_ASSERT (mach);
+
+	if (mach->reset_mmap_stats)
+		mach->reset_mmap_stats (mach);
+}
@@ -33,6 +33,7 @@ typedef enum {
 } vk_reset_type_t;
 
 typedef struct vk_machine_t vk_machine_t;
+typedef struct vk_state_job_t vk_state_job_t;
 
 struct vk_machine_t {
 	char name[64];
@@ -44,6 +45,9 @@ struct vk_machine_t {
 	vk_vector_t	*devices;
 	vk_vector_t	*cpus;
 
+	char		*state_base;
+	vk_state_job_t	*state_job;
+
 	void		 (* destroy)(vk_machine_t **mach_);
 	int		 (* load_game) (vk_machine_t *mach, vk_game_t *game);
 	void		 (* reset) (vk_machine_t *mach, vk_reset_type_t type);
@@ -51,6 +55,9 @@ struct vk_machine_t {
 	int		 (* load_state) (vk_machine_t *mach, vk_state_t *state);
 	int		 (* save_state) (vk_machine_t *mach, vk_state_t *state);
 	const char	*(* get_debug_string)(vk_machine_t *mach);
+	void		 (* print_stats)(vk_machine_t *mach, FILE *fp, double secs);
+	void		 (* print_mmap_stats)(vk_machine_t *mach, FILE *fp);
+	void		 (* reset_mmap_stats)(vk_machine_t *mach);
 };
 
 #define VK_MACH_LOG(mach_, fmt_, args_...) \
@@ -83,6 +90,15 @@ void		 vk_machine_reset (vk_machine_t *mach, vk_reset_type_t type);
 int		 vk_machine_run_frame (vk_machine_t *mach);
 int		 vk_machine_load_state (vk_machine_t *mach, const char *path);
 int		 vk_machine_save_state (vk_machine_t *mach, const char *path);
+int		 vk_machine_save_state_incremental (vk_machine_t *mach, const char *path);
+int		 vk_machine_save_state_async (vk_machine_t *mach, const char *path, bool incremental);
+int		 vk_machine_wait_state (vk_machine_t *mach);
+int		 vk_machine_load_devices_state (vk_machine_t *mach, vk_state_t *state);
+int		 vk_machine_save_devices_state (vk_machine_t *mach, vk_state_t *state);
+void		 vk_machine_clear_dirty (vk_machine_t *mach);
 const char	*vk_machine_get_debug_string (vk_machine_t *mach);
+void		 vk_machine_print_stats (vk_machine_t *mach, FILE *fp, double secs);
+void		 vk_machine_print_mmap_stats (vk_machine_t *mach, FILE *fp);
+void		 vk_machine_reset_mmap_stats (vk_machine_t *mach);
 
 #endif /* __VK_MACH_H__ */
@@ -23,6 +23,9 @@
 #include "vk/input.h"
 #include "vk/renderer.h"
 #include "vk/games.h"
+#include "vk/profiler.h"
+#include "vk/mmap.h"
+#include "vk/rewind.h"
 
 #ifdef VK_HAVE_HIKARU
 #include "mach/hikaru/hikaru.h"
@@ -36,29 +39,42 @@ unsigned vk_verbosity = 0;
 static struct {
 	char rom_path[256];
 	char rom_name[256];
+	char prof_path[256];
 	int num_frames;
 	int start_state;
+	bool bench;
+	bool mmap_stats;
+	int rewind_secs;
 } options;
 
 static vk_game_list_t *game_list;
 static vk_game_t *game;
 static vk_machine_t *mach;
+static vk_rewind_t *rewind_buffer;
 
+/* Incremental states only hold what changed since the last full state was
+ * saved or loaded, and are thus much faster to save. States are written in
+ * the background; the machine logs when they are done. */
 static int
-load_or_save_state (vk_machine_t *mach, bool flag)
+load_or_save_state (vk_machine_t *mach, bool flag, bool incremental)
 {
 	char *path;
 	int ret;
 
-	ret = asprintf (&path, "%s.vkstate", mach->game->name);
+	ret = asprintf (&path, incremental ? "%s.incr.vkstate" : "%s.vkstate",
+	                mach->game->name);
 	if (ret <= 0)
 		goto fail;
 
-	ret = flag ? vk_machine_load_state (mach, path) :
-	             vk_machine_save_state (mach, path);
+	if (flag) {
+		ret = vk_machine_load_state (mach, path);
+		if (rewind_buffer)
+			vk_rewind_reset (rewind_buffer);
+	} else
+		ret = vk_machine_save_state_async (mach, path, incremental);
 
 	if (!ret)
-		printf ("%s state '%s'\n", flag ? "loaded" : "saved", path);
+		printf ("%s state '%s'\n", flag ? "loaded" : "saving", path);
 	else
 		VK_ERROR ("failed to %s state '%s'", flag ? "load" : "save", path);
 
@@ -75,6 +91,10 @@ process_events (void)
 	SDL_Event event;
 	bool quit = false;
 
+	/* No window, no events. Benchmarks must not depend on input. */
+	if (vk_renderer_headless || options.bench)
+		return false;
+
 	while (SDL_PollEvent (&event)) {
 		switch (event.type) {
 		case SDL_KEYDOWN:
@@ -89,10 +109,28 @@ process_events (void)
 				paused ^= 1;
 				break;
 			case SDLK_F1:
-				load_or_save_state (mach, true);
+				load_or_save_state (mach, true, false);
+				break;
+			case SDLK_F2:
+				load_or_save_state (mach, true, true);
+				break;
+			case SDLK_F3:
+				load_or_save_state (mach, false, true);
 				break;
 			case SDLK_F4:
-				load_or_save_state (mach, false);
+				load_or_save_state (mach, false, false);
+				break;
+			case SDLK_F7:
+				vk_machine_reset_mmap_stats (mach);
+				printf ("memory access counters reset\n");
+				break;
+			case SDLK_F8:
+				vk_machine_print_mmap_stats (mach, stdout);
+				break;
+			case SDLK_BACKSPACE:
+				if (rewind_buffer &&
+				    vk_rewind_step_back (rewind_buffer))
+					printf ("rewind: no older frames\n");
 				break;
 			default:
 				break;
@@ -117,19 +155,72 @@ main_loop (vk_machine_t *mach, int num_frames)
 		if (num_frames > 0 && frame++ >= num_frames)
 			return;
 		if (!paused) {
+			vk_profiler_begin_frame ();
 			vk_renderer_begin_frame (mach->renderer);
 			vk_machine_run_frame (mach);
 			vk_renderer_end_frame (mach->renderer);
+			if (rewind_buffer)
+				vk_rewind_capture (rewind_buffer);
+			vk_profiler_end_frame ();
 		}
 	}
 }
 
-static const char global_opts[] = "R:r:n:l:vh?";
+/* Runs the requested number of frames as fast as possible and prints the
+ * resulting statistics as 'key=value' lines on stdout. */
+static void
+run_bench (vk_machine_t *mach, int num_frames)
+{
+	uint64_t start, end;
+	double secs;
+
+	start = SDL_GetPerformanceCounter ();
+	main_loop (mach, num_frames);
+	end = SDL_GetPerformanceCounter ();
+
+	secs = (double) (end - start) / SDL_GetPerformanceFrequency ();
+
+	printf ("frames=%d\n", num_frames);
+	printf ("wall_time=%.6f\n", secs);
+	printf ("fps=%.3f\n", num_frames / secs);
+	printf ("draw_calls_per_frame=%.1f\n",
+	        (double) mach->renderer->num_draw_calls / num_frames);
+	vk_machine_print_stats (mach, stdout, secs);
+	fflush (stdout);
+}
+
+static const char global_opts[] = "R:r:n:l:HP:bM:w:C:B:L:NFVvh?";
+static const struct option global_long_opts[] = {
+	{ "bench",	no_argument,	NULL,	'b' },
+	{ NULL,		0,		NULL,	0 }
+};
 static const char global_help[] = "Usage: %s [options]\n"
 "	-R <path>	Path to the ROM directory\n"
 "	-r <string>	Name of the game to run\n"
 "	-n <num>	Only run for num frames\n"
 "	-l <num>	Load state num at startup\n"
+"	-H		Run headless: no window, no rendering\n"
+"	-P <path>	Write per-frame profiling data to path (CSV,\n"
+"			or Chrome trace if path ends in .json)\n"
+"	-b, --bench	Run -n frames (default 600) without input nor\n"
+"			throttling, then print speed statistics\n"
+"	-M <num>	Count memory accesses per 2^num bytes page too,\n"
+"			print them at exit (F8 prints them at any time,\n"
+"			F7 resets them)\n"
+"	-w <num>	Keep the last num seconds for rewinding with\n"
+"			backspace\n"
+"	-C <path>	Cache assembled ROM sections in path, and map\n"
+"			them from there on later runs\n"
+"	-B <num>	Load ROM sections larger than num MB lazily,\n"
+"			in 1 MB banks, keeping at most num MB resident\n"
+"	-L <pages>	Back emulated RAM with huge pages: none, thp\n"
+"			(transparent, the default) or hugetlb\n"
+"	-N		Bind emulated RAM to the local NUMA node\n"
+"	-F		Map emulated RAM into a host window per CPU\n"
+"			(fastmem); RAM accesses are then not counted by -M,\n"
+"			and rewind and incremental savestates are disabled\n"
+"	-V		Print the CRC32 of each ROM file loaded, to fill\n"
+"			in the \"crc32\" fields of vk-games.json\n"
 "	-v		Set verbosity (affects debug messages)\n"
 "	-h              Show this help\n";
 
@@ -152,7 +243,8 @@ parse_global_opts (int argc, char **argv)
 		return -1;
 	}
 
-	while ((opt = getopt (argc, argv, global_opts)) != -1) {
+	while ((opt = getopt_long (argc, argv, global_opts,
+	                           global_long_opts, NULL)) != -1) {
 		switch (opt) {
 		case 'R':
 			strncpy (options.rom_path, optarg, 256);
@@ -166,6 +258,58 @@ parse_global_opts (int argc, char **argv)
 		case 'l':
 			options.start_state = atoi (optarg);
 			break;
+		case 'H':
+			vk_renderer_headless = true;
+			break;
+		case 'P':
+			strncpy (options.prof_path, optarg, sizeof (options.prof_path) - 1);
+			break;
+		case 'b':
+			options.bench = true;
+			break;
+		case 'w':
+			options.rewind_secs = atoi (optarg);
+			break;
+		case 'C':
+			strncpy (vk_game_cache_path, optarg, 255);
+			break;
+		case 'B':
+			if (atoi (optarg) < 1 || atoi (optarg) > 4095) {
+				VK_ERROR ("invalid ROM budget %s MB", optarg);
+				return -1;
+			}
+			vk_game_rom_budget = (uint32_t) atoi (optarg) * MB;
+			break;
+		case 'L':
+			if (!strcmp (optarg, "none"))
+				vk_buffer_huge_pages = VK_BUFFER_HUGE_PAGES_NONE;
+			else if (!strcmp (optarg, "thp"))
+				vk_buffer_huge_pages = VK_BUFFER_HUGE_PAGES_THP;
+			else if (!strcmp (optarg, "hugetlb"))
+				vk_buffer_huge_pages = VK_BUFFER_HUGE_PAGES_HUGETLB;
+			else {
+				VK_ERROR ("invalid huge page type '%s'", optarg);
+				return -1;
+			}
+			break;
+		case 'N':
+			vk_buffer_numa_local = true;
+			break;
+		case 'F':
+			vk_mmap_fastmem = true;
+			vk_buffer_ram_shared = true;
+			break;
+		case 'V':
+			vk_game_print_crcs = true;
+			break;
+		case 'M':
+			vk_mmap_page_shift = atoi (optarg);
+			if (vk_mmap_page_shift < 2 || vk_mmap_page_shift > 24) {
+				VK_ERROR ("invalid page size 2^%u", vk_mmap_page_shift);
+				return -1;
+			}
+			options.mmap_stats = true;
+			break;
 		case 'v':
 			vk_verbosity = 1;
 			break;
@@ -178,6 +322,13 @@ parse_global_opts (int argc, char **argv)
 			return -1;
 		}
 	}
+
+	/* Writes through fastmem are not tracked, so rewind would have to
+	 * copy all of RAM every frame. */
+	if (vk_mmap_fastmem && options.rewind_secs > 0) {
+		VK_ERROR ("-F and -w can't be used together");
+		return -1;
+	}
 	return 0;
 }
 
@@ -195,6 +346,10 @@ finalize (void)
 {
 	/* XXX free the game list and the game data */
 	printf ("Finalizing\n");
+	vk_profiler_close ();
+	vk_rewind_destroy (&rewind_buffer);
+	if (mach && options.mmap_stats)
+		vk_machine_print_mmap_stats (mach, stdout);
 	if (mach)
 		vk_machine_destroy (&mach);
 }
@@ -268,6 +423,7 @@ main (const int argc, char **argv)
 		VK_ERROR ("failed to load '%s': game name not in game list", options.rom_name);
 		goto fail;
 	}
+	vk_buffer_print_ram_stats (stdout);
 
 	atexit (finalize);
 	//signal (SIGINT,  finalize);
@@ -276,10 +432,24 @@ main (const int argc, char **argv)
 	vk_machine_reset (mach, VK_RESET_TYPE_HARD);
 
 	if (options.start_state >= 0)
-		load_or_save_state (mach, true);
+		load_or_save_state (mach, true, false);
+
+	if (options.prof_path[0] && vk_profiler_open (options.prof_path))
+		goto fail;
+
+	if (options.rewind_secs > 0) {
+		rewind_buffer = vk_rewind_new (mach, options.rewind_secs * 60);
+		if (!rewind_buffer) {
+			VK_ERROR ("failed to allocate the rewind buffer");
+			goto fail;
+		}
+	}
 
 	printf ("Running\n");
-	main_loop (mach, options.num_frames);
+	if (options.bench)
+		run_bench (mach, options.num_frames > 0 ? options.num_frames : 600);
+	else
+		main_loop (mach, options.num_frames);
 
 fail:
 	return 0;
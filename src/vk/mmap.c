@@ -20,6 +20,25 @@
 
 #include "vk/mmap.h"
 
+#include <inttypes.h>
+
+/* Each region counts the reads and writes it serves, by access size; these
+ * counters are cheap enough to be always on. Per-page histograms are only
+ * kept if vk_mmap_page_shift is set when the region is added. */
+
+#define MAX_PRINTED_PAGES	8
+
+unsigned vk_mmap_page_shift = 0;
+bool vk_mmap_fastmem = false;
+
+typedef struct {
+	uint64_t reads[4];
+	uint64_t writes[4];
+	uint64_t *pages;
+	unsigned page_shift;
+	unsigned num_pages;
+} region_stats_t;
+
 typedef struct {
 	uint32_t lo;
 	uint32_t hi;
@@ -31,6 +50,7 @@ typedef struct {
 		void *ptr;
 	};
 	char *name;
+	region_stats_t stats;
 } region_t;
 
 static inline unsigned
@@ -49,6 +69,21 @@ get_size_flag_for_size (unsigned size)
 	return 0;
 }
 
+/* Maps access sizes 1, 2, 4, 8 to counter indices 0-3. */
+static inline unsigned
+get_index_for_size (unsigned size)
+{
+	return __builtin_ctz (size);
+}
+
+static inline void
+count_access (region_t *region, uint64_t *counters, unsigned size, uint32_t addr)
+{
+	counters[get_index_for_size (size)]++;
+	if (region->stats.pages)
+		region->stats.pages[(addr - region->lo) >> region->stats.page_shift]++;
+}
+
 static int
 add_region (vk_mmap_t *mmap, uint32_t lo, uint32_t hi, uint32_t mask,
             uint32_t flags, void *ptr, const char *name)
@@ -78,6 +113,16 @@ add_region (vk_mmap_t *mmap, uint32_t lo, uint32_t hi, uint32_t mask,
 
 	VK_ASSERT (region->name);
 
+	memset (&region->stats, 0, sizeof (region_stats_t));
+	if (vk_mmap_page_shift) {
+		region->stats.page_shift = vk_mmap_page_shift;
+		region->stats.num_pages = ((hi - lo) >> vk_mmap_page_shift) + 1;
+		region->stats.pages = (uint64_t *)
+			calloc (region->stats.num_pages, sizeof (uint64_t));
+		if (!region->stats.pages)
+			return -1;
+	}
+
 	return 0;
 }
 
@@ -136,8 +181,12 @@ vk_mmap_get (vk_mmap_t *mmap, unsigned size, uint32_t addr, void *data)
 	VK_ASSERT (is_size_valid (size));
 
 	region = get_region (mmap, addr, VK_REGION_R);
-	if (!region || !(region->flags & get_size_flag_for_size (size)))
+	if (!region || !(region->flags & get_size_flag_for_size (size))) {
+		mmap->unmapped[0]++;
 		return -1;
+	}
+
+	count_access (region, region->stats.reads, size, addr);
 
 	if (region->flags & VK_REGION_LOG_R)
 		VK_MACH_LOG (mmap->mach, "%s R%u %08X", region->name, size * 8, addr);
@@ -145,7 +194,7 @@ vk_mmap_get (vk_mmap_t *mmap, unsigned size, uint32_t addr, void *data)
 	if (region->flags & VK_REGION_DIRECT) {
 		uint32_t offs = addr & region->mask;
 		uint64_t temp;
-		temp = region->buf->get (region->buf, size, offs);
+		temp = vk_buffer_get (region->buf, size, offs);
 		set_ptr (data, size, temp);
 		return 0;
 	}
@@ -162,24 +211,188 @@ vk_mmap_put (vk_mmap_t *mmap, unsigned size, uint32_t addr, uint64_t data)
 	VK_ASSERT (is_size_valid (size));
 
 	region = get_region (mmap, addr, VK_REGION_W);
-	if (!region)
+	if (!region || !(region->flags & get_size_flag_for_size (size))) {
+		mmap->unmapped[1]++;
 		return -1;
+	}
 
-	if (!(region->flags & get_size_flag_for_size (size)))
-		return -1;
+	count_access (region, region->stats.writes, size, addr);
 
 	if (region->flags & VK_REGION_LOG_W)
 		VK_MACH_LOG (mmap->mach, "%s W%u %08X = %lX", region->name, size * 8, addr, data);
 
 	if (region->flags & VK_REGION_DIRECT) {
 		uint32_t offs = addr & region->mask;
-		region->buf->put (region->buf, size, offs, data);
+		vk_buffer_put (region->buf, size, offs, data);
 		return 0;
 	}
 
 	return vk_device_put (region->dev, size, addr, data);
 }
 
+/* Only the pages wholly within a region are mapped. */
+static bool
+overlaps_earlier_region (vk_mmap_t *mmap, region_t *region)
+{
+	uint64_t lo = ((uint64_t) region->lo + VK_BUFFER_PAGE_SIZE - 1) & ~(uint64_t) (VK_BUFFER_PAGE_SIZE - 1);
+	uint64_t hi = (((uint64_t) region->hi + 1) & ~(uint64_t) (VK_BUFFER_PAGE_SIZE - 1)) - 1;
+	uint32_t offs;
+
+	VK_VECTOR_FOREACH (mmap->regions, offs) {
+		region_t *other = (region_t *) &mmap->regions->data[offs];
+		if (other == region)
+			break;
+		if (lo <= hi && other->lo <= hi && other->hi >= lo)
+			return true;
+	}
+	return false;
+}
+
+/* Maps the RAM and ROM regions into a fastmem window, with the address
+ * space mirrored 'num_mirrors' times every 'mirror_size' bytes; accesses
+ * past the last mirror always take the slow path. Regions logging reads,
+ * or shadowed by an earlier region, are left out; those logging writes
+ * are mapped read-only. Accesses served by the window are not counted in
+ * the statistics. */
+int
+vk_mmap_enable_fastmem (vk_mmap_t *mmap, uint32_t mirror_size,
+                        unsigned num_mirrors)
+{
+	uint32_t offs;
+	unsigned i;
+
+	VK_ASSERT (mmap);
+	VK_ASSERT (!mmap->fastmem);
+
+	mmap->fastmem = vk_fastmem_new ((uint64_t) mirror_size * num_mirrors);
+	if (!mmap->fastmem)
+		return -1;
+
+	VK_VECTOR_FOREACH (mmap->regions, offs) {
+		region_t *region = (region_t *) &mmap->regions->data[offs];
+		bool writable = (region->flags & VK_REGION_W) &&
+		                !(region->flags & VK_REGION_LOG_W);
+
+		if (!(region->flags & VK_REGION_DIRECT) ||
+		    (region->flags & VK_REGION_LOG_R) ||
+		    overlaps_earlier_region (mmap, region))
+			continue;
+
+		for (i = 0; i < num_mirrors; i++)
+			if (vk_fastmem_map (mmap->fastmem,
+			                    region->lo + i * mirror_size,
+			                    region->hi + i * mirror_size,
+			                    region->mask, region->buf,
+			                    writable))
+				break;
+		VK_LOG ("fastmem: %s %s", region->name,
+		        (i == num_mirrors) ? (writable ? "mapped" : "mapped read-only") :
+		                             "not mapped");
+	}
+	return 0;
+}
+
+typedef struct {
+	uint64_t count;
+	uint32_t page;
+} page_entry_t;
+
+static int
+compare_page_entries (const void *a, const void *b)
+{
+	const page_entry_t *x = (const page_entry_t *) a;
+	const page_entry_t *y = (const page_entry_t *) b;
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+static void
+print_region_pages (region_t *region, FILE *fp)
+{
+	page_entry_t top[MAX_PRINTED_PAGES];
+	unsigned i, num = 0;
+
+	/* Keep the hottest pages with a simple insertion; the histograms are
+	 * far larger than the number of pages we print. */
+	for (i = 0; i < region->stats.num_pages; i++) {
+		uint64_t count = region->stats.pages[i];
+		if (!count)
+			continue;
+		if (num < MAX_PRINTED_PAGES)
+			num++;
+		else if (count <= top[num - 1].count)
+			continue;
+		top[num - 1].count = count;
+		top[num - 1].page = i;
+		qsort (top, num, sizeof (page_entry_t), compare_page_entries);
+	}
+
+	for (i = 0; i < num; i++) {
+		uint32_t lo = region->lo + (top[i].page << region->stats.page_shift);
+		fprintf (fp, "\t\t@%08X  %" PRIu64 "\n", lo, top[i].count);
+	}
+}
+
+/* Prints the access counters of all the regions which were accessed at
+ * least once; 'Rn' and 'Wn' are reads and writes of n bits. */
+void
+vk_mmap_print_stats (vk_mmap_t *mmap, FILE *fp)
+{
+	uint32_t offs;
+
+	VK_ASSERT (mmap);
+	VK_ASSERT (fp);
+
+	VK_VECTOR_FOREACH (mmap->regions, offs) {
+		region_t *region = (region_t *) &mmap->regions->data[offs];
+		region_stats_t *stats = &region->stats;
+		uint64_t total = 0;
+		unsigned i;
+
+		for (i = 0; i < 4; i++)
+			total += stats->reads[i] + stats->writes[i];
+		if (!total)
+			continue;
+
+		fprintf (fp, "\t%-12s %08X-%08X  %s  "
+		         "R8=%" PRIu64 " R16=%" PRIu64 " R32=%" PRIu64 " R64=%" PRIu64 " "
+		         "W8=%" PRIu64 " W16=%" PRIu64 " W32=%" PRIu64 " W64=%" PRIu64 "\n",
+		         region->name, region->lo, region->hi,
+		         (region->flags & VK_REGION_DIRECT) ? "direct" : "device",
+		         stats->reads[0], stats->reads[1],
+		         stats->reads[2], stats->reads[3],
+		         stats->writes[0], stats->writes[1],
+		         stats->writes[2], stats->writes[3]);
+
+		if (stats->pages)
+			print_region_pages (region, fp);
+	}
+
+	if (mmap->unmapped[0] || mmap->unmapped[1])
+		fprintf (fp, "\tunmapped: R=%" PRIu64 " W=%" PRIu64 "\n",
+		         mmap->unmapped[0], mmap->unmapped[1]);
+}
+
+void
+vk_mmap_reset_stats (vk_mmap_t *mmap)
+{
+	uint32_t offs;
+
+	VK_ASSERT (mmap);
+
+	VK_VECTOR_FOREACH (mmap->regions, offs) {
+		region_t *region = (region_t *) &mmap->regions->data[offs];
+		region_stats_t *stats = &region->stats;
+
+		memset (stats->reads, 0, sizeof (stats->reads));
+		memset (stats->writes, 0, sizeof (stats->writes));
+		if (stats->pages)
+			memset (stats->pages, 0,
+			        stats->num_pages * sizeof (uint64_t));
+	}
+
+	mmap->unmapped[0] = mmap->unmapped[1] = 0;
+}
+
 vk_mmap_t *
 vk_mmap_new (vk_machine_t *mach)
 {
@@ -215,9 +428,11 @@ vk_mmap_destroy (vk_mmap_t **mmap_)
 			VK_VECTOR_FOREACH (mmap->regions, offs) {
 				region_t *region = (region_t *) &mmap->regions->data[offs];
 				free (region->name);
+				free (region->stats.pages);
 			}
 
 			vk_vector_destroy (&mmap->regions);
+			vk_fastmem_destroy (&mmap->fastmem);
 			mmap->mach = NULL;
 		}
 		free (mmap);
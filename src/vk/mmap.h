@@ -23,6 +23,7 @@
 
 #include "vk/region.h"
 #include "vk/vector.h"
+#include "vk/fastmem.h"
 
 #define VK_REGION_R		(1 << 0)
 #define VK_REGION_W		(1 << 1)
@@ -43,8 +44,18 @@
 typedef struct {
 	vk_vector_t *regions;
 	vk_machine_t *mach;
+	uint64_t unmapped[2];
+	vk_fastmem_t *fastmem;
 } vk_mmap_t;
 
+/* If non-zero, regions added from now on also count accesses per page of
+ * (1 << vk_mmap_page_shift) bytes. */
+extern unsigned vk_mmap_page_shift;
+
+/* If set, machines are expected to call vk_mmap_enable_fastmem () on
+ * their CPU mmaps. */
+extern bool vk_mmap_fastmem;
+
 vk_mmap_t	*vk_mmap_new (vk_machine_t *mach);
 void		 vk_mmap_destroy (vk_mmap_t **mmap_);
 int		 vk_mmap_add_ram (vk_mmap_t *mmap, uint32_t lo, uint32_t hi,
@@ -58,5 +69,9 @@ int		 vk_mmap_add_dev (vk_mmap_t *mmap, uint32_t lo, uint32_t hi,
 		                  vk_device_t *dev, const char *name);
 int		 vk_mmap_get (vk_mmap_t *mmap, unsigned size, uint32_t addr, void *data);
 int		 vk_mmap_put (vk_mmap_t *mmap, unsigned size, uint32_t addr, uint64_t data);
+int		 vk_mmap_enable_fastmem (vk_mmap_t *mmap, uint32_t mirror_size,
+		                         unsigned num_mirrors);
+void		 vk_mmap_print_stats (vk_mmap_t *mmap, FILE *fp);
+void		 vk_mmap_reset_stats (vk_mmap_t *mmap);
 
 #endif /* __VK_MMAP_H__ */
@@ -0,0 +1,118 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vk/pager.h"
+
+vk_pager_t *
+vk_pager_new (uint32_t size, uint32_t budget, vk_pager_fill_t fill,
+              void *opaque)
+{
+	vk_pager_t *pager;
+
+	VK_ASSERT (size);
+	VK_ASSERT (fill);
+
+	pager = ALLOC (vk_pager_t);
+	if (!pager)
+		return NULL;
+
+	pager->size = size;
+	pager->num_banks = (size + VK_PAGER_BANK_SIZE - 1) >> VK_PAGER_BANK_SHIFT;
+	pager->max_resident = MAX2 (budget >> VK_PAGER_BANK_SHIFT, 1);
+	pager->fill = fill;
+	pager->opaque = opaque;
+
+	pager->banks = (uint8_t **) calloc (pager->num_banks, sizeof (uint8_t *));
+	pager->last_use = (uint64_t *) calloc (pager->num_banks, sizeof (uint64_t));
+	if (!pager->banks || !pager->last_use)
+		goto fail;
+
+	return pager;
+fail:
+	vk_pager_destroy (&pager);
+	return NULL;
+}
+
+void
+vk_pager_destroy (vk_pager_t **pager_)
+{
+	if (pager_) {
+		vk_pager_t *pager = *pager_;
+		unsigned i;
+		if (pager) {
+			VK_LOG ("pager: %u banks, %lu faults, %lu evictions",
+			        pager->num_banks, pager->stats.faults,
+			        pager->stats.evictions);
+			for (i = 0; pager->banks && i < pager->num_banks; i++)
+				free (pager->banks[i]);
+			free (pager->banks);
+			free (pager->last_use);
+		}
+		free (pager);
+		*pager_ = NULL;
+	}
+}
+
+/* Faults are rare enough that a linear scan for the victim is fine. */
+static uint8_t *
+evict_lru (vk_pager_t *pager)
+{
+	unsigned i, victim = 0;
+	uint64_t oldest = ~0ull;
+	uint8_t *data;
+
+	for (i = 0; i < pager->num_banks; i++)
+		if (pager->banks[i] && pager->last_use[i] < oldest) {
+			oldest = pager->last_use[i];
+			victim = i;
+		}
+
+	data = pager->banks[victim];
+	pager->banks[victim] = NULL;
+	pager->num_resident--;
+	pager->stats.evictions++;
+	return data;
+}
+
+uint8_t *
+vk_pager_fault (vk_pager_t *pager, uint32_t offs)
+{
+	unsigned bank = offs >> VK_PAGER_BANK_SHIFT;
+	uint32_t base = bank << VK_PAGER_BANK_SHIFT;
+	uint8_t *data;
+
+	VK_ASSERT (bank < pager->num_banks);
+
+	data = (pager->num_resident >= pager->max_resident) ?
+	       evict_lru (pager) : (uint8_t *) malloc (VK_PAGER_BANK_SIZE);
+	if (!data)
+		return NULL;
+
+	pager->stats.faults++;
+	if (pager->fill (pager->opaque, data, base,
+	                 MIN2 (VK_PAGER_BANK_SIZE, pager->size - base))) {
+		VK_ERROR ("pager: cannot fill bank %u", bank);
+		free (data);
+		return NULL;
+	}
+
+	pager->banks[bank] = data;
+	pager->last_use[bank] = ++pager->clock;
+	pager->num_resident++;
+	return data + (offs & (VK_PAGER_BANK_SIZE - 1));
+}
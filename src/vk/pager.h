@@ -0,0 +1,107 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VK_PAGER_H__
+#define __VK_PAGER_H__
+
+#include "vk/core.h"
+
+/* A pager is a read-only store whose contents are produced on demand, one
+ * bank at a time, by a fill callback, the first time they are accessed.
+ * At most 'budget' bytes of banks are kept resident: past that, the least
+ * recently used bank is evicted, to be filled again on its next access.
+ *
+ * Accessing a resident bank costs a table lookup. */
+
+#define VK_PAGER_BANK_SHIFT	20
+#define VK_PAGER_BANK_SIZE	(1 << VK_PAGER_BANK_SHIFT)
+
+typedef int (* vk_pager_fill_t) (void *opaque, uint8_t *dst, uint32_t offs,
+                                 uint32_t size);
+
+typedef struct {
+	uint32_t size;
+	unsigned num_banks;
+	unsigned max_resident;
+	unsigned num_resident;
+	uint8_t **banks;
+	uint64_t *last_use;
+	uint64_t clock;
+	vk_pager_fill_t fill;
+	void *opaque;
+	struct {
+		uint64_t faults;
+		uint64_t evictions;
+	} stats;
+} vk_pager_t;
+
+vk_pager_t	*vk_pager_new (uint32_t size, uint32_t budget,
+		               vk_pager_fill_t fill, void *opaque);
+void		 vk_pager_destroy (vk_pager_t **pager_);
+uint8_t		*vk_pager_fault (vk_pager_t *pager, uint32_t offs);
+
+/* Returns a pointer to the byte at 'offs', valid until the next access to
+ * another bank, or NULL if the bank could not be filled. */
+static inline uint8_t *
+vk_pager_get_ptr (vk_pager_t *pager, uint32_t offs)
+{
+	unsigned bank = offs >> VK_PAGER_BANK_SHIFT;
+	uint8_t *data = pager->banks[bank];
+
+	if (!data)
+		return vk_pager_fault (pager, offs);
+	pager->last_use[bank] = ++pager->clock;
+	return data + (offs & (VK_PAGER_BANK_SIZE - 1));
+}
+
+static inline uint32_t
+vk_pager_get_size (vk_pager_t *pager)
+{
+	return pager ? pager->size : 0;
+}
+
+/* Reads a little-endian value; accesses must not cross a bank boundary. */
+static inline int
+vk_pager_get (vk_pager_t *pager, unsigned size, uint32_t offs, uint64_t *val)
+{
+	uint8_t *data;
+
+	VK_ASSERT ((uint64_t) offs + size <= pager->size);
+
+	data = vk_pager_get_ptr (pager, offs);
+	if (!data)
+		return -1;
+
+	switch (size) {
+	case 1:
+		*val = *data;
+		break;
+	case 2:
+		*val = cpu_to_le16 (*(uint16_t *) data);
+		break;
+	case 4:
+		*val = cpu_to_le32 (*(uint32_t *) data);
+		break;
+	default:
+		*val = cpu_to_le64 (*(uint64_t *) data);
+		break;
+	}
+	return 0;
+}
+
+#endif /* __VK_PAGER_H__ */
@@ -0,0 +1,170 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vk/profiler.h"
+
+#include <inttypes.h>
+
+/* Per-frame statistics are written either as CSV, one row per section per
+ * frame:
+ *
+ *  frame,section,calls,ns
+ *
+ * where the section named "frame" holds the total frame time; or, if the
+ * output path ends in ".json", as a Chrome trace (chrome://tracing), with
+ * one complete event per frame and one counter event per frame holding
+ * the time spent in each section, in milliseconds. */
+
+#define MAX_SECTIONS	32
+
+bool vk_profiler_enabled = false;
+
+static struct {
+	FILE *fp;
+	bool is_trace;
+	uint64_t origin;
+	uint64_t frame_start;
+	unsigned frame;
+	unsigned num_sections;
+	vk_profiler_section_t *sections[MAX_SECTIONS];
+} prof;
+
+void
+vk_profiler_register (vk_profiler_section_t *section)
+{
+	if (prof.num_sections >= MAX_SECTIONS) {
+		VK_ERROR ("profiler: too many sections, ignoring '%s'",
+		          section->name);
+		section->index = -2;
+		return;
+	}
+	section->index = prof.num_sections;
+	prof.sections[prof.num_sections++] = section;
+}
+
+int
+vk_profiler_open (const char *path)
+{
+	size_t len;
+
+	VK_ASSERT (path);
+	VK_ASSERT (!prof.fp);
+
+	prof.fp = fopen (path, "w");
+	if (!prof.fp) {
+		VK_ERROR ("profiler: can't open '%s' for writing", path);
+		return -1;
+	}
+
+	len = strlen (path);
+	prof.is_trace = len >= 5 && !strcmp (path + len - 5, ".json");
+
+	if (prof.is_trace)
+		fprintf (prof.fp, "{\"traceEvents\":[\n");
+	else
+		fprintf (prof.fp, "frame,section,calls,ns\n");
+
+	prof.origin = vk_profiler_get_time ();
+	prof.frame = 0;
+
+	vk_profiler_enabled = true;
+	return 0;
+}
+
+void
+vk_profiler_close (void)
+{
+	if (!prof.fp)
+		return;
+
+	if (prof.is_trace)
+		fprintf (prof.fp, "{}]}\n");
+
+	fclose (prof.fp);
+	prof.fp = NULL;
+
+	vk_profiler_enabled = false;
+}
+
+void
+vk_profiler_begin_frame (void)
+{
+	unsigned i;
+
+	if (!vk_profiler_enabled)
+		return;
+
+	for (i = 0; i < prof.num_sections; i++) {
+		prof.sections[i]->elapsed = 0;
+		prof.sections[i]->calls = 0;
+	}
+	prof.frame_start = vk_profiler_get_time ();
+}
+
+static void
+write_csv (uint64_t total)
+{
+	unsigned i;
+
+	fprintf (prof.fp, "%u,frame,1,%" PRIu64 "\n", prof.frame, total);
+	for (i = 0; i < prof.num_sections; i++) {
+		vk_profiler_section_t *section = prof.sections[i];
+		fprintf (prof.fp, "%u,%s,%" PRIu64 ",%" PRIu64 "\n", prof.frame,
+		         section->name, section->calls, section->elapsed);
+	}
+}
+
+static void
+write_trace (uint64_t total)
+{
+	double ts = (prof.frame_start - prof.origin) / 1000.0;
+	unsigned i;
+
+	fprintf (prof.fp,
+	         "{\"name\":\"frame %u\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+	         "\"ts\":%.3f,\"dur\":%.3f},\n",
+	         prof.frame, ts, total / 1000.0);
+
+	fprintf (prof.fp,
+	         "{\"name\":\"sections\",\"ph\":\"C\",\"pid\":1,\"tid\":1,"
+	         "\"ts\":%.3f,\"args\":{", ts);
+	for (i = 0; i < prof.num_sections; i++) {
+		vk_profiler_section_t *section = prof.sections[i];
+		fprintf (prof.fp, "%s\"%s\":%.3f", i ? "," : "",
+		         section->name, section->elapsed / 1000000.0);
+	}
+	fprintf (prof.fp, "}},\n");
+}
+
+void
+vk_profiler_end_frame (void)
+{
+	uint64_t total;
+
+	if (!vk_profiler_enabled)
+		return;
+
+	total = vk_profiler_get_time () - prof.frame_start;
+
+	if (prof.is_trace)
+		write_trace (total);
+	else
+		write_csv (total);
+
+	prof.frame++;
+}
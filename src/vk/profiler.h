@@ -0,0 +1,88 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VK_PROFILER_H__
+#define __VK_PROFILER_H__
+
+#include <time.h>
+
+#include "vk/core.h"
+
+/* A profiler section times a piece of code, accumulating the time spent in
+ * it and the number of times it was entered over a frame. Sections are
+ * statically allocated by their users and register themselves on first
+ * use:
+ *
+ *  static vk_profiler_section_t prof_foo = VK_PROFILER_SECTION ("foo");
+ *
+ *  vk_profiler_enter (&prof_foo);
+ *  foo ();
+ *  vk_profiler_leave (&prof_foo);
+ *
+ * When the profiler is not open, entering and leaving a section costs a
+ * single branch. */
+
+typedef struct {
+	const char *name;
+	int index;	/* -1 if not registered yet, -2 if it couldn't be */
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t calls;
+} vk_profiler_section_t;
+
+#define VK_PROFILER_SECTION(name_) \
+	{ (name_), -1, 0, 0, 0 }
+
+extern bool vk_profiler_enabled;
+
+int	vk_profiler_open (const char *path);
+void	vk_profiler_close (void);
+void	vk_profiler_begin_frame (void);
+void	vk_profiler_end_frame (void);
+void	vk_profiler_register (vk_profiler_section_t *section);
+
+static inline uint64_t
+vk_profiler_get_time (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void
+vk_profiler_enter (vk_profiler_section_t *section)
+{
+	if (!vk_profiler_enabled)
+		return;
+	if (section->index == -1)
+		vk_profiler_register (section);
+	if (section->index < 0)
+		return;
+	section->start = vk_profiler_get_time ();
+}
+
+static inline void
+vk_profiler_leave (vk_profiler_section_t *section)
+{
+	if (!vk_profiler_enabled || section->index < 0)
+		return;
+	section->elapsed += vk_profiler_get_time () - section->start;
+	section->calls++;
+}
+
+#endif /* __VK_PROFILER_H__ */
@@ -22,6 +22,8 @@
 
 /* TODO change API to avoid leaking the SDL window and GL context. */
 
+bool vk_renderer_headless = false;
+
 void
 vk_renderer_clear_gl_errors (void)
 {
@@ -49,6 +51,8 @@ vk_renderer_end_frame (vk_renderer_t *renderer)
 
 	if (renderer->end_frame)
 		renderer->end_frame (renderer);
+	if (renderer->headless)
+		return;
 	SDL_GL_SwapWindow (renderer->window);
 
 	temp = SDL_GetTicks ();
@@ -72,6 +76,19 @@ vk_renderer_init (vk_renderer_t *renderer)
 	VK_ASSERT (renderer->width);
 	VK_ASSERT (renderer->height);
 
+	/* In headless mode the machine runs as usual, but the renderer
+	 * backend is expected to skip all GL work; there is no window to
+	 * present to, and no context to draw with. */
+	renderer->headless = vk_renderer_headless;
+	if (renderer->headless) {
+		if (SDL_Init (SDL_INIT_TIMER)) {
+			VK_ERROR ("could not initialize SDL: '%s'", SDL_GetError ());
+			return -1;
+		}
+		VK_PRINT ("renderer: headless");
+		return 0;
+	}
+
 	if (SDL_Init (SDL_INIT_VIDEO | SDL_INIT_TIMER)) {
 		VK_ERROR ("could not initialize SDL: '%s'", SDL_GetError ());
 		return -1;
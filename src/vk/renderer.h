@@ -55,6 +55,10 @@
 	} while (0)
 #endif
 
+/* When set before the renderer is created, no window nor GL context is
+ * created, and nothing is drawn; see vk_renderer_init. */
+extern bool vk_renderer_headless;
+
 typedef struct vk_renderer_t vk_renderer_t;
 
 struct vk_renderer_t {
@@ -63,8 +67,12 @@ struct vk_renderer_t {
 
 	unsigned width;
 	unsigned height;
+	bool headless;
 	char message[256];
 
+	/* Statistics, updated by the backend. */
+	uint64_t num_draw_calls;
+
 	void	(* destroy)(vk_renderer_t **renderer_);
 	void	(* reset)(vk_renderer_t *renderer);
 	void	(* begin_frame)(vk_renderer_t *renderer);
@@ -0,0 +1,434 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vk/rewind.h"
+#include "vk/buffer.h"
+
+/* Pages are identified by the index of their buffer in the machine buffer
+ * list and their index within the buffer; the serialized device state is
+ * treated as an additional buffer, with index num_buffers. */
+
+typedef struct {
+	uint32_t buf;
+	uint32_t page;
+	size_t offs;
+} rewind_page_t;
+
+typedef struct {
+	rewind_page_t *pages;
+	unsigned num_pages, max_pages;
+	uint8_t *data;
+	size_t used, size;
+} rewind_delta_t;
+
+struct vk_rewind_t {
+	vk_machine_t *mach;
+	unsigned num_buffers;
+
+	bool has_keyframe;
+	uint8_t **keyframe;
+
+	/* The buffer generations the newest frame was captured at */
+	uint64_t *gens;
+
+	/* The device state of the newest frame, and a scratch area where the
+	 * device state of the frame being captured is serialized. */
+	uint8_t *devices, *scratch;
+	uint32_t devices_size, devices_cap, scratch_cap;
+
+	/* The ring of deltas, from oldest to newest */
+	rewind_delta_t *deltas;
+	unsigned max_deltas, first, num_deltas;
+};
+
+static vk_buffer_t *
+get_buffer (vk_rewind_t *rewind, uint32_t buf)
+{
+	vk_vector_t *buffers = rewind->mach->buffers;
+	return *(vk_buffer_t **) &buffers->data[buf * buffers->element_size];
+}
+
+static uint8_t *
+get_page_ptr (uint8_t *base, uint32_t page)
+{
+	return base + ((size_t) page << VK_BUFFER_PAGE_SHIFT);
+}
+
+static uint32_t
+get_page_size (uint32_t size, uint32_t page)
+{
+	return MIN2 (VK_BUFFER_PAGE_SIZE, size - (page << VK_BUFFER_PAGE_SHIFT));
+}
+
+static uint32_t
+get_size (vk_rewind_t *rewind, uint32_t buf)
+{
+	return (buf == rewind->num_buffers) ? rewind->devices_size :
+	       get_buffer (rewind, buf)->size;
+}
+
+static rewind_delta_t *
+get_delta (vk_rewind_t *rewind, unsigned i)
+{
+	return &rewind->deltas[(rewind->first + i) % rewind->max_deltas];
+}
+
+static int
+save_devices (vk_rewind_t *rewind)
+{
+	vk_state_t *state;
+	int ret;
+
+	state = vk_state_new_in_memory (VK_STATE_SAVE, rewind->scratch,
+	                                rewind->scratch_cap);
+	if (!state)
+		return -1;
+
+	ret = vk_machine_save_devices_state (rewind->mach, state);
+
+	rewind->scratch = state->mem.data;
+	rewind->scratch_cap = state->mem.size;
+	if (!rewind->has_keyframe)
+		rewind->devices_size = state->mem.offs;
+	else if (!ret && state->mem.offs != rewind->devices_size) {
+		VK_ERROR ("rewind: device state size changed");
+		ret = -1;
+	}
+
+	vk_state_destroy (&state, ret);
+	return ret;
+}
+
+static int
+add_page (rewind_delta_t *delta, uint32_t buf, uint32_t page,
+          uint8_t *src, uint32_t size)
+{
+	rewind_page_t *entry;
+
+	if (delta->num_pages == delta->max_pages) {
+		unsigned max = delta->max_pages ? delta->max_pages * 2 : 256;
+		void *pages = realloc (delta->pages, max * sizeof (rewind_page_t));
+		if (!pages)
+			return -1;
+		delta->pages = (rewind_page_t *) pages;
+		delta->max_pages = max;
+	}
+	if (delta->used + size > delta->size) {
+		size_t new_size = MAX2 (delta->size * 2, delta->used + size);
+		void *data = realloc (delta->data, new_size);
+		if (!data)
+			return -1;
+		delta->data = (uint8_t *) data;
+		delta->size = new_size;
+	}
+
+	entry = &delta->pages[delta->num_pages++];
+	entry->buf = buf;
+	entry->page = page;
+	entry->offs = delta->used;
+
+	memcpy (&delta->data[delta->used], src, size);
+	delta->used += size;
+	return 0;
+}
+
+/* The pages of a delta are sorted by buffer and page, see capture_delta. */
+static uint8_t *
+find_page (rewind_delta_t *delta, uint32_t buf, uint32_t page)
+{
+	unsigned lo = 0, hi = delta->num_pages;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		rewind_page_t *entry = &delta->pages[mid];
+		if (entry->buf == buf && entry->page == page)
+			return &delta->data[entry->offs];
+		if (entry->buf < buf || (entry->buf == buf && entry->page < page))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static void
+apply_delta (vk_rewind_t *rewind, rewind_delta_t *delta, uint8_t **dst)
+{
+	unsigned i;
+
+	for (i = 0; i < delta->num_pages; i++) {
+		rewind_page_t *entry = &delta->pages[i];
+		uint32_t size = get_page_size (get_size (rewind, entry->buf),
+		                               entry->page);
+		memcpy (get_page_ptr (dst[entry->buf], entry->page),
+		        &delta->data[entry->offs], size);
+	}
+}
+
+static int
+capture_keyframe (vk_rewind_t *rewind)
+{
+	unsigned i;
+
+	if (save_devices (rewind))
+		return -1;
+
+	for (i = 0; i < rewind->num_buffers; i++) {
+		vk_buffer_t *buf = get_buffer (rewind, i);
+		memcpy (rewind->keyframe[i], buf->ptr, buf->size);
+	}
+
+	free (rewind->keyframe[i]);
+	rewind->keyframe[i] = (uint8_t *) malloc (rewind->devices_size);
+	free (rewind->devices);
+	rewind->devices = (uint8_t *) malloc (rewind->devices_size);
+	rewind->devices_cap = rewind->devices_size;
+	if (!rewind->keyframe[i] || !rewind->devices)
+		return -1;
+	memcpy (rewind->keyframe[i], rewind->scratch, rewind->devices_size);
+	memcpy (rewind->devices, rewind->scratch, rewind->devices_size);
+
+	rewind->num_deltas = 0;
+	rewind->has_keyframe = true;
+	return 0;
+}
+
+static int
+capture_delta (vk_rewind_t *rewind)
+{
+	rewind_delta_t *delta;
+	uint32_t i, page, cap;
+	uint8_t *tmp;
+	int ret = 0;
+
+	if (save_devices (rewind))
+		return -1;
+
+	/* When the ring is full, fold the oldest delta into the keyframe and
+	 * reuse it for the new frame. */
+	if (rewind->num_deltas == rewind->max_deltas) {
+		delta = get_delta (rewind, 0);
+		apply_delta (rewind, delta, rewind->keyframe);
+		rewind->first = (rewind->first + 1) % rewind->max_deltas;
+		rewind->num_deltas--;
+	}
+
+	delta = get_delta (rewind, rewind->num_deltas);
+	delta->num_pages = 0;
+	delta->used = 0;
+
+	for (i = 0; !ret && i < rewind->num_buffers; i++) {
+		vk_buffer_t *buf = get_buffer (rewind, i);
+		uint32_t num_pages = vk_buffer_get_num_state_pages (buf);
+
+		for (page = 0; !ret && page < num_pages; page++) {
+			uint32_t size = get_page_size (buf->size, page);
+			if (vk_buffer_is_range_dirty (buf, page << VK_BUFFER_PAGE_SHIFT,
+			                              size, rewind->gens[i]))
+				ret = add_page (delta, i, page,
+				                get_page_ptr (buf->ptr, page), size);
+		}
+	}
+
+	for (page = 0; !ret && page * VK_BUFFER_PAGE_SIZE < rewind->devices_size; page++) {
+		uint8_t *cur = get_page_ptr (rewind->scratch, page);
+		uint8_t *old = get_page_ptr (rewind->devices, page);
+		uint32_t size = get_page_size (rewind->devices_size, page);
+
+		if (memcmp (cur, old, size))
+			ret = add_page (delta, rewind->num_buffers, page, cur, size);
+	}
+	if (ret)
+		return ret;
+
+	/* The scratch copy becomes the newest device state */
+	tmp = rewind->devices;
+	rewind->devices = rewind->scratch;
+	rewind->scratch = tmp;
+	cap = rewind->devices_cap;
+	rewind->devices_cap = rewind->scratch_cap;
+	rewind->scratch_cap = cap;
+
+	rewind->num_deltas++;
+	return 0;
+}
+
+static void
+sync_generations (vk_rewind_t *rewind)
+{
+	unsigned i;
+
+	for (i = 0; i < rewind->num_buffers; i++)
+		rewind->gens[i] = vk_buffer_new_generation (get_buffer (rewind, i));
+}
+
+/* Drops all the captured frames; the next capture takes a new keyframe.
+ * Must be called whenever the machine state changes outside of emulation,
+ * e.g., when a savestate is loaded. */
+void
+vk_rewind_reset (vk_rewind_t *rewind)
+{
+	VK_ASSERT (rewind);
+
+	rewind->has_keyframe = false;
+	rewind->num_deltas = 0;
+}
+
+/* Captures the state at the end of the current frame. */
+int
+vk_rewind_capture (vk_rewind_t *rewind)
+{
+	int ret;
+
+	VK_ASSERT (rewind);
+
+	ret = rewind->has_keyframe ? capture_delta (rewind) :
+	                             capture_keyframe (rewind);
+	if (ret) {
+		VK_ERROR ("rewind: capture failed, dropping the rewind buffer");
+		vk_rewind_reset (rewind);
+	}
+
+	sync_generations (rewind);
+	return ret;
+}
+
+/* Restores the state of the frame before the newest captured one, which is
+ * dropped. The keyframe itself can't be stepped back from. */
+int
+vk_rewind_step_back (vk_rewind_t *rewind)
+{
+	rewind_delta_t *newest;
+	vk_state_t *state;
+	unsigned i, j;
+	int ret;
+
+	VK_ASSERT (rewind);
+
+	if (!rewind->num_deltas)
+		return -1;
+
+	/* Each page stored in the newest delta reverts to its most recent
+	 * older copy: in an older delta, or else in the keyframe. */
+	newest = get_delta (rewind, rewind->num_deltas - 1);
+	for (i = 0; i < newest->num_pages; i++) {
+		rewind_page_t *entry = &newest->pages[i];
+		uint32_t size = get_page_size (get_size (rewind, entry->buf),
+		                               entry->page);
+		uint8_t *src = NULL;
+
+		for (j = rewind->num_deltas - 1; j > 0 && !src; j--)
+			src = find_page (get_delta (rewind, j - 1),
+			                 entry->buf, entry->page);
+		if (!src)
+			src = get_page_ptr (rewind->keyframe[entry->buf],
+			                    entry->page);
+
+		if (entry->buf == rewind->num_buffers)
+			memcpy (get_page_ptr (rewind->devices, entry->page), src, size);
+		else {
+			/* Marked dirty for the savestates, too */
+			vk_buffer_t *buf = get_buffer (rewind, entry->buf);
+			memcpy (get_page_ptr (buf->ptr, entry->page), src, size);
+			vk_buffer_mark_dirty (buf, entry->page << VK_BUFFER_PAGE_SHIFT,
+			                      size);
+		}
+	}
+	rewind->num_deltas--;
+
+	state = vk_state_new_in_memory (VK_STATE_LOAD, rewind->devices,
+	                                rewind->devices_size);
+	if (!state)
+		return -1;
+	ret = vk_machine_load_devices_state (rewind->mach, state);
+	vk_state_destroy (&state, ret);
+
+	sync_generations (rewind);
+	vk_renderer_reset (rewind->mach->renderer);
+	return ret;
+}
+
+vk_rewind_t *
+vk_rewind_new (vk_machine_t *mach, unsigned num_frames)
+{
+	vk_rewind_t *rewind;
+	unsigned i;
+
+	VK_ASSERT (mach);
+	VK_ASSERT (num_frames > 0);
+
+	rewind = ALLOC (vk_rewind_t);
+	if (!rewind)
+		goto fail;
+
+	rewind->mach = mach;
+	rewind->num_buffers = mach->buffers->used / mach->buffers->element_size;
+
+	rewind->keyframe = (uint8_t **) calloc (rewind->num_buffers + 1,
+	                                        sizeof (uint8_t *));
+	rewind->gens = (uint64_t *) calloc (rewind->num_buffers,
+	                                    sizeof (uint64_t));
+	if (!rewind->keyframe || !rewind->gens)
+		goto fail;
+	for (i = 0; i < rewind->num_buffers; i++) {
+		rewind->keyframe[i] = (uint8_t *) malloc (get_buffer (rewind, i)->size);
+		if (!rewind->keyframe[i])
+			goto fail;
+	}
+
+	rewind->max_deltas = num_frames;
+	rewind->deltas = (rewind_delta_t *) calloc (num_frames,
+	                                            sizeof (rewind_delta_t));
+	if (!rewind->deltas)
+		goto fail;
+
+	return rewind;
+
+fail:
+	vk_rewind_destroy (&rewind);
+	return NULL;
+}
+
+void
+vk_rewind_destroy (vk_rewind_t **rewind_)
+{
+	if (rewind_) {
+		vk_rewind_t *rewind = *rewind_;
+		if (rewind) {
+			unsigned i;
+
+			if (rewind->keyframe)
+				for (i = 0; i <= rewind->num_buffers; i++)
+					free (rewind->keyframe[i]);
+			free (rewind->keyframe);
+			free (rewind->gens);
+
+			if (rewind->deltas)
+				for (i = 0; i < rewind->max_deltas; i++) {
+					free (rewind->deltas[i].pages);
+					free (rewind->deltas[i].data);
+				}
+			free (rewind->deltas);
+
+			free (rewind->devices);
+			free (rewind->scratch);
+		}
+		free (rewind);
+		*rewind_ = NULL;
+	}
+}
@@ -0,0 +1,39 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VK_REWIND_H__
+#define __VK_REWIND_H__
+
+#include "vk/machine.h"
+
+/* The rewind buffer keeps the states of the last few frames in RAM: the
+ * oldest one in full (the keyframe), the others as the pages which changed
+ * from one frame to the next (the deltas). Capturing a frame only copies the
+ * buffer pages dirtied during the frame, and the device state pages which
+ * differ from the previous frame's. Rewind tracks buffer writes with a
+ * generation of its own, so that it doesn't disturb incremental savestates. */
+
+typedef struct vk_rewind_t vk_rewind_t;
+
+vk_rewind_t	*vk_rewind_new (vk_machine_t *mach, unsigned num_frames);
+void		 vk_rewind_destroy (vk_rewind_t **rewind_);
+void		 vk_rewind_reset (vk_rewind_t *rewind);
+int		 vk_rewind_capture (vk_rewind_t *rewind);
+int		 vk_rewind_step_back (vk_rewind_t *rewind);
+
+#endif /* __VK_REWIND_H__ */
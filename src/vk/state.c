@@ -18,14 +18,61 @@
 
 #include "vk/state.h"
 
-#define VK_STATE_VERSION	1
+#define VK_STATE_VERSION	2
 
-vk_state_t *
-vk_state_new (const char *path, uint32_t mode)
+/* The header is a fixed-size string holding the version, followed, since
+ * version 2, by the length of the base path (zero for full states) and
+ * the base path itself. Version 1 states are uncompressed full states,
+ * which gzread reads transparently. */
+
+static int
+put_header (vk_state_t *state, const char *base)
+{
+	char template[32] = "";
+	uint32_t len = base ? strlen (base) : 0;
+
+	sprintf (template, "valkyrie state %08X\n", VK_STATE_VERSION);
+	if (vk_state_put (state, template, sizeof (template)) ||
+	    vk_state_put (state, &len, sizeof (len)))
+		return -1;
+	if (len) {
+		state->base = strdup (base);
+		if (!state->base || vk_state_put (state, state->base, len))
+			return -1;
+	}
+	return 0;
+}
+
+static int
+get_header (vk_state_t *state)
+{
+	char header[32];
+	uint32_t len;
+
+	if (vk_state_get (state, header, sizeof (header)) ||
+	    header[sizeof (header) - 1] != '\0' ||
+	    sscanf (header, "valkyrie state %08X\n", &state->version) != 1 ||
+	    state->version < 1 || state->version > VK_STATE_VERSION)
+		return -1;
+
+	if (state->version < 2)
+		return 0;
+
+	if (vk_state_get (state, &len, sizeof (len)) || len >= 4096)
+		return -1;
+	if (len) {
+		state->base = (char *) calloc (len + 1, 1);
+		if (!state->base || vk_state_get (state, state->base, len))
+			return -1;
+	}
+	return 0;
+}
+
+static vk_state_t *
+state_new (const char *path, uint32_t mode, const char *base)
 {
-	char template[32] = "", header[32];
 	vk_state_t *state;
-	size_t size;
+	int ret;
 
 	VK_ASSERT (path);
 	VK_ASSERT (mode == VK_STATE_LOAD || mode == VK_STATE_SAVE);
@@ -34,22 +81,19 @@ vk_state_new (const char *path, uint32_t mode)
 	if (!state)
 		return NULL;
 
-	state->fp = fopen (path, (mode == VK_STATE_LOAD) ? "rb" : "wb");
-	if (!state->fp)
-		goto fail;
-
 	state->mode = mode;
+	state->version = VK_STATE_VERSION;
 
-	sprintf (template, "valkyrie state %08X\n", VK_STATE_VERSION);
-	if (mode == VK_STATE_LOAD) {
-		size = fread ((void *) header, 1, sizeof (template), state->fp);
-		if (size != sizeof (template) || strcmp (template, header))
-			goto fail;
-	} else {
-		size = fwrite ((void *) template, 1, sizeof (template), state->fp);
-		if (size != sizeof (template))
-			goto fail;
-	}
+	/* Compression level 1: most of the state is RAM, which compresses
+	 * well enough even at the fastest setting. */
+	state->gz = gzopen (path, (mode == VK_STATE_LOAD) ? "rb" : "wb1");
+	if (!state->gz)
+		goto fail;
+
+	ret = (mode == VK_STATE_LOAD) ? get_header (state) :
+	                                put_header (state, base);
+	if (ret)
+		goto fail;
 
 	return state;
 
@@ -58,6 +102,41 @@ fail:
 	return NULL;
 }
 
+vk_state_t *
+vk_state_new (const char *path, uint32_t mode)
+{
+	return state_new (path, mode, NULL);
+}
+
+vk_state_t *
+vk_state_new_incremental (const char *path, const char *base)
+{
+	VK_ASSERT (base);
+
+	return state_new (path, VK_STATE_SAVE, base);
+}
+
+vk_state_t *
+vk_state_new_in_memory (uint32_t mode, void *data, uint32_t size)
+{
+	vk_state_t *state;
+
+	VK_ASSERT (mode == VK_STATE_LOAD || mode == VK_STATE_SAVE);
+	VK_ASSERT (data || mode == VK_STATE_SAVE);
+
+	state = ALLOC (vk_state_t);
+	if (!state)
+		return NULL;
+
+	state->mode = mode;
+	state->version = VK_STATE_VERSION;
+	state->mem.data = (uint8_t *) data;
+	state->mem.size = size;
+	state->mem.offs = 0;
+
+	return state;
+}
+
 void
 vk_state_destroy (vk_state_t **state_, int ret)
 {
@@ -66,10 +145,10 @@ vk_state_destroy (vk_state_t **state_, int ret)
 	VK_ASSERT (state_);
 	state = *state_;
 
-	if (state->mode == VK_STATE_LOAD ||
-	    (state->mode == VK_STATE_SAVE && ret == 0))
-		fclose (state->fp);
+	if (state->gz)
+		gzclose (state->gz);
 
+	free (state->base);
 	free (state);
 	*state_ = NULL;
 }
@@ -77,27 +156,50 @@ vk_state_destroy (vk_state_t **state_, int ret)
 int
 vk_state_put (vk_state_t *state, void *src, uint32_t size)
 {
-	size_t num;
+	int num;
 
 	if (state->mode != VK_STATE_SAVE)
 		return -1;
 
 	VK_LOG ("state: W%08X %p", size, src);
 
-	num = fwrite (src, 1, size, state->fp);
-	return (num != size || ferror (state->fp)) ? -1 : 0;
+	if (!state->gz) {
+		if (state->mem.offs + size > state->mem.size) {
+			uint32_t new_size = MAX2 (state->mem.size * 2,
+			                          state->mem.offs + size);
+			uint8_t *data = realloc (state->mem.data, new_size);
+			if (!data)
+				return -1;
+			state->mem.data = data;
+			state->mem.size = new_size;
+		}
+		memcpy (&state->mem.data[state->mem.offs], src, size);
+		state->mem.offs += size;
+		return 0;
+	}
+
+	num = gzwrite (state->gz, src, size);
+	return (num != (int) size) ? -1 : 0;
 }
 
 int
 vk_state_get (vk_state_t *state, void *dst, uint32_t size)
 {
-	size_t num;
+	int num;
 
 	if (state->mode != VK_STATE_LOAD)
 		return -1;
 
 	VK_LOG ("state: R%08X %p", size, dst);
 
-	num = fread (dst, 1, size, state->fp);
-	return (num != size || ferror (state->fp)) ? -1 : 0;
+	if (!state->gz) {
+		if (state->mem.offs + size > state->mem.size)
+			return -1;
+		memcpy (dst, &state->mem.data[state->mem.offs], size);
+		state->mem.offs += size;
+		return 0;
+	}
+
+	num = gzread (state->gz, dst, size);
+	return (num != (int) size) ? -1 : 0;
 }
@@ -21,15 +21,32 @@
 
 #include "vk/core.h"
 
+#include <zlib.h>
+
 #define VK_STATE_SAVE	(0 << 0)
 #define VK_STATE_LOAD	(1 << 0)
 
+/* A state is a zlib-compressed stream. An incremental state only holds what
+ * changed since its base, the full state at path 'base', which must be
+ * loaded before it.
+ *
+ * In-memory states have no header and are read from, or written to, the
+ * caller-owned mem.data, which puts grow with realloc as needed. */
 typedef struct {
 	uint32_t mode;
-	FILE *fp;
+	uint32_t version;
+	char *base;
+	gzFile gz;
+	struct {
+		uint8_t *data;
+		uint32_t size;
+		uint32_t offs;
+	} mem;
 } vk_state_t;
 
 vk_state_t	*vk_state_new (const char *path, uint32_t mode);
+vk_state_t	*vk_state_new_incremental (const char *path, const char *base);
+vk_state_t	*vk_state_new_in_memory (uint32_t mode, void *data, uint32_t size);
 int		 vk_state_put (vk_state_t *state, void *src, uint32_t size);
 int		 vk_state_get (vk_state_t *state, void *dst, uint32_t size);
 void		 vk_state_destroy (vk_state_t **state_, int ret);
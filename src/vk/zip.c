@@ -0,0 +1,283 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vk/zip.h"
+
+#define EOCD_SIGNATURE		0x06054B50
+#define CENTRAL_SIGNATURE	0x02014B50
+#define LOCAL_SIGNATURE		0x04034B50
+
+#define EOCD_SIZE		22
+#define CENTRAL_SIZE		46
+#define LOCAL_SIZE		30
+
+#define METHOD_STORED		0
+#define METHOD_DEFLATED		8
+
+static uint16_t
+get16 (const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get32 (const uint8_t *p)
+{
+	return get16 (p) | ((uint32_t) get16 (p + 2) << 16);
+}
+
+/* The end of central directory record is followed by a comment of up to
+ * 64k, so it is looked for backwards from the end of the archive. */
+static const uint8_t *
+find_eocd (vk_zip_t *zip)
+{
+	size_t offs, min;
+
+	if (zip->size < EOCD_SIZE)
+		return NULL;
+	min = (zip->size > EOCD_SIZE + 0xFFFF) ? zip->size - EOCD_SIZE - 0xFFFF : 0;
+	offs = zip->size - EOCD_SIZE;
+	do {
+		if (get32 (zip->data + offs) == EOCD_SIGNATURE)
+			return zip->data + offs;
+	} while (offs-- > min);
+	return NULL;
+}
+
+static int
+parse_central_directory (vk_zip_t *zip)
+{
+	const uint8_t *eocd = find_eocd (zip), *p, *end;
+	unsigned i;
+
+	if (!eocd)
+		return -1;
+
+	zip->num_entries = get16 (eocd + 10);
+	p = zip->data + get32 (eocd + 16);
+	end = eocd;
+	if (p > end || get32 (eocd + 12) > (size_t) (end - p))
+		return -1;
+
+	zip->entries = (vk_zip_entry_t *) calloc (zip->num_entries + 1,
+	                                          sizeof (vk_zip_entry_t));
+	if (!zip->entries)
+		return -1;
+
+	for (i = 0; i < zip->num_entries; i++) {
+		vk_zip_entry_t *entry = &zip->entries[i];
+		unsigned name_len;
+
+		if (end - p < CENTRAL_SIZE || get32 (p) != CENTRAL_SIGNATURE)
+			return -1;
+		name_len = get16 (p + 28);
+		if (end - p < CENTRAL_SIZE + name_len ||
+		    name_len >= sizeof (entry->name))
+			return -1;
+
+		/* Encrypted entries are left with an unknown method. */
+		entry->method = (get16 (p + 8) & 1) ? ~0u : get16 (p + 10);
+		entry->crc = get32 (p + 16);
+		entry->comp_size = get32 (p + 20);
+		entry->size = get32 (p + 24);
+		entry->offs = get32 (p + 42);
+		memcpy (entry->name, p + CENTRAL_SIZE, name_len);
+		entry->name[name_len] = '\0';
+
+		p += CENTRAL_SIZE + name_len + get16 (p + 30) + get16 (p + 32);
+	}
+	return 0;
+}
+
+vk_zip_t *
+vk_zip_open (const char *path)
+{
+	vk_zip_t *zip;
+	struct stat st;
+	int fd;
+
+	VK_ASSERT (path);
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	zip = ALLOC (vk_zip_t);
+	if (!zip || fstat (fd, &st) || !st.st_size)
+		goto fail;
+
+	zip->size = st.st_size;
+	zip->data = mmap (NULL, zip->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (zip->data == MAP_FAILED) {
+		zip->data = NULL;
+		goto fail;
+	}
+	close (fd);
+	fd = -1;
+
+	if (parse_central_directory (zip)) {
+		VK_ERROR ("zip: '%s' is not a valid zip archive", path);
+		goto fail;
+	}
+	return zip;
+fail:
+	if (fd >= 0)
+		close (fd);
+	vk_zip_destroy (&zip);
+	return NULL;
+}
+
+void
+vk_zip_destroy (vk_zip_t **zip_)
+{
+	if (zip_) {
+		vk_zip_t *zip = *zip_;
+		if (zip) {
+			if (zip->data)
+				munmap (zip->data, zip->size);
+			free (zip->entries);
+		}
+		free (zip);
+		*zip_ = NULL;
+	}
+}
+
+/* Entries are matched either by their full name or by their file name,
+ * so that archives holding their files in a directory work as well. */
+const vk_zip_entry_t *
+vk_zip_find (vk_zip_t *zip, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < zip->num_entries; i++) {
+		const char *entry_name = zip->entries[i].name;
+		const char *base = strrchr (entry_name, '/');
+		if (!strcmp (entry_name, name) ||
+		    (base && !strcmp (base + 1, name)))
+			return &zip->entries[i];
+	}
+	return NULL;
+}
+
+int
+vk_zip_reader_init (vk_zip_reader_t *reader, vk_zip_t *zip,
+                    const vk_zip_entry_t *entry)
+{
+	const uint8_t *local;
+	size_t offs;
+
+	VK_ASSERT (reader);
+	VK_ASSERT (zip);
+	VK_ASSERT (entry);
+
+	memset (reader, 0, sizeof (vk_zip_reader_t));
+	reader->entry = entry;
+
+	if (entry->offs > zip->size || zip->size - entry->offs < LOCAL_SIZE)
+		goto fail;
+	local = zip->data + entry->offs;
+	if (get32 (local) != LOCAL_SIGNATURE)
+		goto fail;
+
+	/* The local extra field may differ from the central one. */
+	offs = (size_t) entry->offs + LOCAL_SIZE + get16 (local + 26) + get16 (local + 28);
+	if (offs > zip->size || zip->size - offs < entry->comp_size)
+		goto fail;
+	reader->src = zip->data + offs;
+
+	switch (entry->method) {
+	case METHOD_STORED:
+		if (entry->comp_size != entry->size)
+			goto fail;
+		break;
+	case METHOD_DEFLATED:
+		reader->strm.next_in = (Bytef *) reader->src;
+		reader->strm.avail_in = entry->comp_size;
+		if (inflateInit2 (&reader->strm, -MAX_WBITS) != Z_OK)
+			goto fail;
+		reader->inflating = true;
+		break;
+	default:
+		VK_ERROR ("zip: '%s' uses unsupported method %u",
+		          entry->name, entry->method);
+		return -1;
+	}
+
+	reader->crc = crc32 (0, NULL, 0);
+	return 0;
+fail:
+	VK_ERROR ("zip: '%s' is corrupt", entry->name);
+	return -1;
+}
+
+int
+vk_zip_read (vk_zip_reader_t *reader, void *dst, uint32_t size)
+{
+	const vk_zip_entry_t *entry = reader->entry;
+
+	if (size > entry->size - reader->pos)
+		goto fail;
+
+	if (!reader->inflating)
+		memcpy (dst, reader->src + reader->pos, size);
+	else {
+		z_stream *strm = &reader->strm;
+
+		strm->next_out = (Bytef *) dst;
+		strm->avail_out = size;
+		while (strm->avail_out) {
+			int ret = inflate (strm, Z_NO_FLUSH);
+			if (ret == Z_STREAM_END && strm->avail_out)
+				goto fail;
+			if (ret != Z_OK && ret != Z_STREAM_END)
+				goto fail;
+		}
+	}
+
+	reader->crc = crc32 (reader->crc, (const Bytef *) dst, size);
+	reader->pos += size;
+	return 0;
+fail:
+	VK_ERROR ("zip: '%s' is corrupt", entry->name);
+	return -1;
+}
+
+/* Releases the reader; fails unless the whole entry was read and matches
+ * its CRC32. */
+int
+vk_zip_reader_finish (vk_zip_reader_t *reader)
+{
+	const vk_zip_entry_t *entry = reader->entry;
+
+	if (reader->inflating)
+		inflateEnd (&reader->strm);
+	reader->inflating = false;
+
+	if (reader->pos != entry->size)
+		return -1;
+	if (reader->crc != entry->crc) {
+		VK_ERROR ("zip: '%s' has CRC32 %08X, expected %08X",
+		          entry->name, reader->crc, entry->crc);
+		return -1;
+	}
+	return 0;
+}
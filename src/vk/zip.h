@@ -0,0 +1,67 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VK_ZIP_H__
+#define __VK_ZIP_H__
+
+#include <zlib.h>
+
+#include "vk/core.h"
+
+/* A read-only view of a zip archive. The archive is mapped as a whole, and
+ * its entries can be decoded concurrently, each by its own reader. Only
+ * stored and deflated entries are supported; neither zip64 nor encryption
+ * is. */
+
+typedef struct {
+	char name[256];
+	unsigned method;
+	uint32_t crc;
+	uint32_t comp_size;
+	uint32_t size;
+	uint32_t offs;
+} vk_zip_entry_t;
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	unsigned num_entries;
+	vk_zip_entry_t *entries;
+} vk_zip_t;
+
+/* A reader decodes an entry front to back, in pieces of any size, and
+ * checks its CRC32 once done. */
+typedef struct {
+	const vk_zip_entry_t *entry;
+	const uint8_t *src;
+	uint32_t pos;
+	uint32_t crc;
+	bool inflating;
+	z_stream strm;
+} vk_zip_reader_t;
+
+vk_zip_t		*vk_zip_open (const char *path);
+void			 vk_zip_destroy (vk_zip_t **zip_);
+const vk_zip_entry_t	*vk_zip_find (vk_zip_t *zip, const char *name);
+
+int	vk_zip_reader_init (vk_zip_reader_t *reader, vk_zip_t *zip,
+	                    const vk_zip_entry_t *entry);
+int	vk_zip_read (vk_zip_reader_t *reader, void *dst, uint32_t size);
+int	vk_zip_reader_finish (vk_zip_reader_t *reader);
+
+#endif /* __VK_ZIP_H__ */